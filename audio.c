@@ -0,0 +1,237 @@
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+
+#include "audio.h"
+
+#define WAV_HEADER_SIZE  44
+#define WAV_BUFFER       4096
+
+static void *run_writer        (void *arg);
+static void  write_wav_header  (chip8_audio *a);
+
+chip8_audio *open_audio(chip8_audio_sink sink, const char *path, unsigned int rate)
+{
+    FILE *fp = NULL;
+
+    if (sink == CHIP8_AUDIO_WAV && (fp = fopen(path, "wb")) == NULL) {
+        return NULL;
+    }
+
+    chip8_audio *a = calloc(1, sizeof(chip8_audio));
+
+    if (a == NULL) {
+        fprintf(stderr, "unable to allocate audio\n");
+        exit(1);
+    }
+
+    a->sink = sink;
+    a->rate = rate > 0 ? rate : AUDIO_RATE;
+    a->step = (uint32_t) (((uint64_t) AUDIO_FREQUENCY << 32) / a->rate);
+    a->fp   = fp;
+    atomic_init(&a->head, 0);
+    atomic_init(&a->tail, 0);
+    atomic_init(&a->done, false);
+
+    if (sink == CHIP8_AUDIO_WAV) {
+        // sizes are filled in when the file is closed
+        write_wav_header(a);
+
+        if (pthread_create(&a->writer, NULL, run_writer, a) != 0) {
+            fprintf(stderr, "unable to start the audio writer\n");
+            exit(1);
+        }
+    }
+
+    return a;
+}
+
+void attach_audio(chip8 *c, chip8_audio *a)
+{
+    c->audio = a;
+}
+
+void push_audio_tick(chip8_audio *a, bool tone)
+{
+    a->ticks_seen++;
+    a->tone_ticks += tone;
+
+    if (a->sink == CHIP8_AUDIO_NULL) {
+        return;
+    }
+
+    unsigned int head = atomic_load_explicit(&a->head, memory_order_relaxed);
+
+    if (head - atomic_load_explicit(&a->tail, memory_order_acquire) == AUDIO_RING_SIZE) {
+        // a device plays in real time, a late tick is worth nothing
+        if (a->sink == CHIP8_AUDIO_DEVICE) {
+            a->dropped++;
+            return;
+        }
+        while (head - atomic_load_explicit(&a->tail, memory_order_acquire) == AUDIO_RING_SIZE) {
+            sched_yield();
+        }
+    }
+
+    a->ticks[head % AUDIO_RING_SIZE] = tone;
+
+    atomic_store_explicit(&a->head, head + 1, memory_order_release);
+}
+
+/* Tick n starts on sample n * rate / 60, so rates that aren't a multiple
+ * of 60 don't drift
+ */
+static unsigned int tick_length(chip8_audio *a, unsigned long n)
+{
+    return (n + 1) * a->rate / 60 - n * a->rate / 60;
+}
+
+/* Renders up to n samples of the ticks queued so far, stopping early only
+ * between ticks. latency, if not 0, is how many ticks may be left queued
+ * before older ones are skipped.
+ */
+static size_t generate(chip8_audio *a, int16_t *out, size_t n, unsigned int latency)
+{
+    size_t i = 0;
+
+    while (i < n) {
+        if (a->left == 0) {
+            unsigned int tail = atomic_load_explicit(&a->tail, memory_order_relaxed);
+            unsigned int head = atomic_load_explicit(&a->head, memory_order_acquire);
+
+            if (latency > 0 && head - tail > latency) {
+                tail = head - latency;
+            }
+            if (tail == head) {
+                atomic_store_explicit(&a->tail, tail, memory_order_release);
+                break;
+            }
+
+            bool tone = a->ticks[tail % AUDIO_RING_SIZE];
+            atomic_store_explicit(&a->tail, tail + 1, memory_order_release);
+
+            // every beep starts at the same point of the wave
+            if (tone && !a->tone) {
+                a->phase = 0;
+            }
+            a->tone = tone;
+            a->left = tick_length(a, a->played++);
+        }
+
+        size_t k = n - i < a->left ? n - i : a->left;
+
+        if (a->tone) {
+            for (size_t j = 0; j < k; j++) {
+                out[i + j] = a->phase < 0x80000000u ? AUDIO_AMPLITUDE : -AUDIO_AMPLITUDE;
+                a->phase += a->step;
+            }
+        } else {
+            memset(&out[i], 0, k * sizeof(int16_t));
+        }
+
+        i       += k;
+        a->left -= k;
+    }
+
+    return i;
+}
+
+void render_audio(chip8_audio *a, int16_t *out, size_t n)
+{
+    size_t done = generate(a, out, n, AUDIO_LATENCY);
+
+    // the machine is behind (or paused), play silence until it catches up
+    memset(&out[done], 0, (n - done) * sizeof(int16_t));
+}
+
+/* WAV file, 16-bit mono PCM, all fields little-endian */
+static void put_u16(unsigned char *p, unsigned int v)
+{
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+}
+
+static void put_u32(unsigned char *p, uint32_t v)
+{
+    put_u16(p, v & 0xFFFF);
+    put_u16(p + 2, v >> 16);
+}
+
+static void write_wav_header(chip8_audio *a)
+{
+    unsigned char header[WAV_HEADER_SIZE];
+    uint32_t      data = a->samples * 2;
+
+    memcpy(header, "RIFF", 4);
+    put_u32(header + 4, WAV_HEADER_SIZE - 8 + data);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    put_u32(header + 16, 16);
+    put_u16(header + 20, 1);
+    put_u16(header + 22, 1);
+    put_u32(header + 24, a->rate);
+    put_u32(header + 28, a->rate * 2);
+    put_u16(header + 32, 2);
+    put_u16(header + 34, 16);
+    memcpy(header + 36, "data", 4);
+    put_u32(header + 40, data);
+
+    fwrite(header, 1, sizeof(header), a->fp);
+}
+
+static void *run_writer(void *arg)
+{
+    chip8_audio *a = arg;
+    struct timespec nap = { 0, 1000000 };
+
+    int16_t       samples[WAV_BUFFER];
+    unsigned char bytes[WAV_BUFFER * 2];
+
+    for (;;) {
+        /* done is read first, a tick pushed before it is then rendered too */
+        bool   done = atomic_load_explicit(&a->done, memory_order_acquire);
+        size_t n    = generate(a, samples, WAV_BUFFER, 0);
+
+        if (n == 0) {
+            if (done) {
+                break;
+            }
+            nanosleep(&nap, NULL);
+            continue;
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            put_u16(&bytes[i * 2], (uint16_t) samples[i]);
+        }
+        fwrite(bytes, 2, n, a->fp);
+
+        a->samples += n;
+    }
+
+    return NULL;
+}
+
+bool close_audio(chip8_audio *a)
+{
+    if (a == NULL) {
+        return true;
+    }
+
+    bool ok = true;
+
+    if (a->sink == CHIP8_AUDIO_WAV) {
+        atomic_store_explicit(&a->done, true, memory_order_release);
+        pthread_join(a->writer, NULL);
+
+        // a pipe keeps the empty sizes, most readers then read to the end
+        if (fseek(a->fp, 0, SEEK_SET) == 0) {
+            write_wav_header(a);
+        }
+
+        ok = !ferror(a->fp);
+        ok = fclose(a->fp) == 0 && ok;
+    }
+
+    free(a);
+
+    return ok;
+}
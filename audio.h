@@ -0,0 +1,85 @@
+#ifndef AUDIO_H
+#define AUDIO_H
+
+#include <pthread.h>
+
+#include "chip8.h"
+
+/* Sound timer audio
+ *
+ * Once attached, the core reports at every 60 Hz boundary whether the tick
+ * that just ended had the sound timer running, one byte through a lock-free
+ * ring. The consumer turns every tick into exactly rate / 60 samples of a
+ * square wave or of silence, so the tone starts and stops on the sample a
+ * tick begins at and its length is exactly ST ticks. The machine's thread
+ * never renders samples or touches a file or device.
+ *
+ * Sinks:
+ *
+ *   device  the frontend's audio callback pulls samples with render_audio.
+ *           Ticks are dropped if the callback falls a whole ring behind, and
+ *           skipped so it never lags more than AUDIO_LATENCY ticks.
+ *   wav     a writer thread renders every tick into a 16-bit mono WAV file.
+ *           The machine waits if it falls a whole ring behind.
+ *   null    ticks are only counted.
+ */
+
+#define AUDIO_RING_SIZE  256
+#define AUDIO_LATENCY    4
+#define AUDIO_RATE       48000
+#define AUDIO_FREQUENCY  440
+#define AUDIO_AMPLITUDE  6000
+
+typedef enum chip8_audio_sink_t {
+    CHIP8_AUDIO_NULL = 0,
+    CHIP8_AUDIO_DEVICE,
+    CHIP8_AUDIO_WAV
+} chip8_audio_sink;
+
+typedef struct chip8_audio_t {
+    /* 1 for a tick with the tone on, the machine fills head, the consumer
+     * drains from tail
+     */
+    unsigned char    ticks[AUDIO_RING_SIZE];
+    _Alignas(64) atomic_uint head;
+    _Alignas(64) atomic_uint tail;
+    atomic_bool      done;
+
+    chip8_audio_sink sink;
+    unsigned int     rate;
+
+    /* Machine side, ticks seen, ticks with the tone on and ticks the
+     * device sink had no room for
+     */
+    _Alignas(64) unsigned long ticks_seen;
+    unsigned long    tone_ticks;
+    unsigned long    dropped;
+
+    /* Generator, consumer side. Phase of the square wave as a fraction of
+     * 2^32, the tick being played and samples left of it
+     */
+    uint32_t         phase;
+    uint32_t         step;
+    bool             tone;
+    unsigned long    played;
+    unsigned int     left;
+
+    /* WAV writer */
+    pthread_t        writer;
+    FILE            *fp;
+    unsigned long    samples;
+} chip8_audio;
+
+/* path is only used by the WAV sink, NULL if it can't be created */
+chip8_audio  *open_audio       (chip8_audio_sink sink, const char *path, unsigned int rate);
+/* Drains the ring, finishes the file and frees the audio, false if a write failed */
+bool          close_audio      (chip8_audio *a);
+void          attach_audio     (chip8 *c, chip8_audio *a);
+
+/* Device sink, fills out with n samples, silence past the last tick */
+void          render_audio     (chip8_audio *a, int16_t *out, size_t n);
+
+/* Called by the core at every 60 Hz boundary before the timers tick */
+void          push_audio_tick  (chip8_audio *a, bool tone);
+
+#endif
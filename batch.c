@@ -0,0 +1,91 @@
+#include "batch.h"
+
+chip8_batch *create_batch(unsigned int count)
+{
+    chip8_batch *b = calloc(1, sizeof(chip8_batch));
+    if (b == NULL) {
+        return NULL;
+    }
+
+    size_t pages_size = (size_t) count * MEMORY_PAGES * sizeof(chip8_page);
+
+    b->count    = count;
+    b->machines = calloc(count, sizeof(chip8));
+    b->pages    = aligned_alloc(BATCH_PAGE_SIZE, (pages_size + BATCH_PAGE_SIZE - 1) / BATCH_PAGE_SIZE * BATCH_PAGE_SIZE);
+    b->displays = calloc(count, sizeof(chip8_display));
+
+    if (b->machines == NULL || b->pages == NULL || b->displays == NULL) {
+        destroy_batch(b);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < (size_t) count * MEMORY_PAGES; i++) {
+        atomic_init(&b->pages[i].refs, 0);
+        b->pages[i].pooled = true;
+    }
+    for (unsigned int i = 0; i < count; i++) {
+        atomic_init(&b->displays[i].refs, 0);
+        b->displays[i].pooled = true;
+    }
+
+    for (unsigned int i = 0; i < count; i++) {
+        reset_batch_machine(b, i);
+    }
+
+    return b;
+}
+
+void destroy_batch(chip8_batch *b)
+{
+    if (b == NULL) {
+        return;
+    }
+
+    for (unsigned int i = 0; b->machines != NULL && i < b->count; i++) {
+        finalize(&b->machines[i]);
+    }
+
+    free(b->machines);
+    free(b->pages);
+    free(b->displays);
+    free(b);
+}
+
+chip8 *get_batch_machine(chip8_batch *b, unsigned int i)
+{
+    return &b->machines[i];
+}
+
+void reset_batch_machine(chip8_batch *b, unsigned int i)
+{
+    chip8 *c = &b->machines[i];
+
+    finalize(c);
+
+    /* attach the machine to its part of the pools before initialize, parts
+     * still held by a fork are left to it and replaced by fresh allocations
+     */
+    for (int k = 0; k < MEMORY_PAGES; k++) {
+        chip8_page *p = &b->pages[(size_t) i * MEMORY_PAGES + k];
+
+        if (atomic_load(&p->refs) == 0) {
+            atomic_store(&p->refs, 1);
+            c->pages[k] = p;
+        }
+    }
+
+    if (atomic_load(&b->displays[i].refs) == 0) {
+        atomic_store(&b->displays[i].refs, 1);
+        c->display = &b->displays[i];
+    }
+
+    initialize(c);
+}
+
+void run_batch(chip8_batch *b, unsigned long n)
+{
+    /* one machine at a time for all n cycles keeps its state in cache */
+    for (unsigned int i = 0; i < b->count; i++) {
+        run_cycles(&b->machines[i], n);
+    }
+}
@@ -0,0 +1,36 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "chip8.h"
+
+/* Batched multi-instance runner
+ *
+ * A batch holds many machines in one contiguous pool. The machine records
+ * (registers, stack, timers) sit back to back, and their memory pages and
+ * displays live in separate pools, so stepping a machine only touches its own
+ * few cache lines of hot state plus the code it runs. Pooled machines decode
+ * straight from memory instead of keeping a 32 KB instruction cache each.
+ *
+ * Pooled pages may be shared with forks of a batch machine, such forks have
+ * to be finalized before the batch is destroyed.
+ */
+
+#define BATCH_PAGE_SIZE 4096
+
+typedef struct chip8_batch_t {
+    /* Number of machines */
+    unsigned int count;
+    /* Machine records, hot state */
+    chip8 *machines;
+    /* Memory pages and displays of every machine, cold state */
+    chip8_page    *pages;
+    chip8_display *displays;
+} chip8_batch;
+
+chip8_batch *create_batch         (unsigned int count);
+void         destroy_batch        (chip8_batch *b);
+chip8       *get_batch_machine    (chip8_batch *b, unsigned int i);
+void         reset_batch_machine  (chip8_batch *b, unsigned int i);
+void         run_batch            (chip8_batch *b, unsigned long n);
+
+#endif
@@ -0,0 +1,347 @@
+#include <dirent.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "chip8.h"
+#include "quirks.h"
+
+/* chip8-batch, runs every ROM of a directory or manifest for a fixed cycle
+ * budget on a pool of worker threads and reports, per ROM, the hash of the
+ * final framebuffer, the cycles executed, the wall time and whether the ROM
+ * loaded.
+ *
+ * usage: chip8-batch [-j threads] [-c cycles] [-f cycles_per_frame] [-e interpreter|threaded]
+ *                    [-Q quirks_db] [-o output] <dir|manifest>
+ *
+ * With -Q every ROM runs with the quirks the database has for it (see
+ * quirks.h), the classic machine's otherwise.
+ *
+ * A manifest is a text file with one ROM path per line. Every worker owns a
+ * deque of jobs, pops from its bottom and steals from the top of the others
+ * once it runs dry, so a few slow ROMs don't leave the other threads idle.
+ */
+
+#define DEFAULT_CYCLES  1000000UL
+#define DEFAULT_THREADS 4
+#define MAX_THREADS     256
+
+typedef struct job_t {
+    char          *path;
+    chip8_load_result result;
+    uint64_t       hash;
+    unsigned long  cycles;
+    double         seconds;
+} job;
+
+typedef struct deque_t {
+    pthread_mutex_t lock;
+    /* Job indices, owner pops at bottom, thieves take from top */
+    unsigned int   *items;
+    unsigned int    top, bottom;
+} deque;
+
+typedef struct pool_t {
+    job           *jobs;
+    deque         *deques;
+    unsigned int   workers;
+    unsigned long  cycles;
+    unsigned int   frame;
+    chip8_engine   engine;
+    chip8_quirks_db *db;
+} pool;
+
+typedef struct worker_t {
+    pool         *p;
+    unsigned int  id;
+    pthread_t     thread;
+} worker;
+
+static int   collect_roms (const char *source, char ***paths);
+static void *run_worker   (void *arg);
+static void  run_job      (chip8 *c, pool *p, job *j);
+static void *checked      (void *ptr);
+
+int main(int argc, char **argv)
+{
+    unsigned int  threads = DEFAULT_THREADS;
+    unsigned long cycles  = DEFAULT_CYCLES;
+    unsigned int  frame   = CYCLES_PER_FRAME;
+    chip8_engine  engine  = CHIP8_ENGINE_INTERPRETER;
+    const char   *output  = NULL;
+    const char   *db_path = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "j:c:f:e:Q:o:")) != -1) {
+        switch (opt) {
+            case 'j': threads = strtoul(optarg, NULL, 10); break;
+            case 'c': cycles  = strtoul(optarg, NULL, 10); break;
+            case 'f': frame   = strtoul(optarg, NULL, 10); break;
+            case 'e': if (!find_engine(optarg, &engine)) { optind = argc; } break;
+            case 'Q': db_path = optarg; break;
+            case 'o': output  = optarg; break;
+            default:  optind  = argc; break;
+        }
+    }
+
+    if (optind >= argc || threads == 0 || threads > MAX_THREADS) {
+        fprintf(stderr, "usage: %s [-j threads] [-c cycles] [-f cycles_per_frame] [-e interpreter|threaded]\n"
+                        "       [-Q quirks_db] [-o output] <dir|manifest>\n", argv[0]);
+        return 1;
+    }
+
+    chip8_quirks_db *db = NULL;
+    unsigned int     line;
+    if (db_path != NULL && (db = load_quirks_db(db_path, &line)) == NULL) {
+        fprintf(stderr, "unable to read %s (line %u)\n", db_path, line);
+        return 1;
+    }
+
+    char **paths = NULL;
+    int count = collect_roms(argv[optind], &paths);
+    if (count < 0) {
+        fprintf(stderr, "unable to read ROM list from %s\n", argv[optind]);
+        destroy_quirks_db(db);
+        return 1;
+    }
+
+    // open the output first, a bad path must not throw away the whole run
+    FILE *out = stdout;
+    if (output != NULL && (out = fopen(output, "w")) == NULL) {
+        fprintf(stderr, "unable to open %s for writing\n", output);
+        for (int i = 0; i < count; i++) {
+            free(paths[i]);
+        }
+        free(paths);
+        destroy_quirks_db(db);
+        return 1;
+    }
+
+    pool p;
+    p.jobs    = checked(calloc(count, sizeof(job)));
+    p.deques  = checked(calloc(threads, sizeof(deque)));
+    p.workers = threads;
+    p.cycles  = cycles;
+    p.frame   = frame;
+    p.engine  = engine;
+    p.db      = db;
+
+    for (unsigned int i = 0; i < threads; i++) {
+        pthread_mutex_init(&p.deques[i].lock, NULL);
+        p.deques[i].items = checked(malloc((count + 1) * sizeof(unsigned int)));
+    }
+
+    /* deal the ROMs out round robin */
+    for (int i = 0; i < count; i++) {
+        deque *d = &p.deques[i % threads];
+
+        p.jobs[i].path = paths[i];
+        d->items[d->bottom++] = i;
+    }
+
+    worker *w = checked(calloc(threads, sizeof(worker)));
+    for (unsigned int i = 0; i < threads; i++) {
+        w[i].p  = &p;
+        w[i].id = i;
+        if (pthread_create(&w[i].thread, NULL, run_worker, &w[i]) != 0) {
+            fprintf(stderr, "unable to start worker thread\n");
+            exit(1);
+        }
+    }
+    for (unsigned int i = 0; i < threads; i++) {
+        pthread_join(w[i].thread, NULL);
+    }
+
+    fprintf(out, "rom\tframebuffer_hash\tcycles\twall_ms\tstatus\n");
+    for (int i = 0; i < count; i++) {
+        fprintf(out, "%s\t%016llx\t%lu\t%.3f\t%s\n", p.jobs[i].path,
+                (unsigned long long) p.jobs[i].hash, p.jobs[i].cycles, p.jobs[i].seconds * 1000.0,
+                get_load_error(p.jobs[i].result));
+    }
+
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    for (unsigned int i = 0; i < threads; i++) {
+        pthread_mutex_destroy(&p.deques[i].lock);
+        free(p.deques[i].items);
+    }
+    for (int i = 0; i < count; i++) {
+        free(paths[i]);
+    }
+    free(paths);
+    free(p.jobs);
+    destroy_quirks_db(db);
+    free(p.deques);
+    free(w);
+
+    return 0;
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* Fill paths with the ROMs of a directory (sorted) or of a manifest file
+ * (in order), returns the number of ROMs or -1 on error
+ */
+static int collect_roms(const char *source, char ***paths)
+{
+    struct stat st;
+    int count = 0, capacity = 64;
+
+    if (stat(source, &st) != 0) {
+        return -1;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        DIR *dir = opendir(source);
+        struct dirent *e;
+
+        if (dir == NULL) {
+            return -1;
+        }
+
+        *paths = checked(malloc(capacity * sizeof(char *)));
+
+        while ((e = readdir(dir)) != NULL) {
+            char path[4096];
+            snprintf(path, sizeof(path), "%s/%s", source, e->d_name);
+
+            if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+                continue;
+            }
+            if (count == capacity) {
+                capacity *= 2;
+                *paths = checked(realloc(*paths, capacity * sizeof(char *)));
+            }
+            (*paths)[count++] = checked(strdup(path));
+        }
+
+        closedir(dir);
+        qsort(*paths, count, sizeof(char *), compare_paths);
+    } else {
+        FILE *fp = fopen(source, "r");
+        char line[4096];
+
+        if (fp == NULL) {
+            return -1;
+        }
+
+        *paths = checked(malloc(capacity * sizeof(char *)));
+
+        while (fgets(line, sizeof(line), fp) != NULL) {
+            line[strcspn(line, "\r\n")] = '\0';
+
+            // skip blank lines and comments
+            if (line[0] == '\0' || line[0] == '#') {
+                continue;
+            }
+            if (count == capacity) {
+                capacity *= 2;
+                *paths = checked(realloc(*paths, capacity * sizeof(char *)));
+            }
+            (*paths)[count++] = checked(strdup(line));
+        }
+
+        fclose(fp);
+    }
+
+    return count;
+}
+
+/* Take a job from the bottom of our own deque, -1 if empty */
+static int pop_job(deque *d)
+{
+    int i = -1;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom > d->top) {
+        i = d->items[--d->bottom];
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    return i;
+}
+
+/* Take a job from the top of another worker's deque, -1 if empty */
+static int steal_job(deque *d)
+{
+    int i = -1;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom > d->top) {
+        i = d->items[d->top++];
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    return i;
+}
+
+static void *run_worker(void *arg)
+{
+    worker *w = arg;
+    pool   *p = w->p;
+    chip8  *c = checked(calloc(1, sizeof(chip8)));
+
+    for (;;) {
+        int i = pop_job(&p->deques[w->id]);
+
+        /* out of work, steal from the others starting with our neighbour */
+        for (unsigned int k = 1; i < 0 && k < p->workers; k++) {
+            i = steal_job(&p->deques[(w->id + k) % p->workers]);
+        }
+
+        /* no job is ever added, so empty deques everywhere means done */
+        if (i < 0) {
+            break;
+        }
+
+        run_job(c, p, &p->jobs[i]);
+    }
+
+    finalize(c);
+    free(c);
+
+    return NULL;
+}
+
+static void run_job(chip8 *c, pool *p, job *j)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    initialize(c);
+    set_cycles_per_frame(c, p->frame);
+
+    j->result = load_file(c, j->path);
+    if (j->result == CHIP8_LOAD_OK) {
+        // the machine is reused, the last ROM's quirks go
+        if (p->db != NULL && !apply_rom_quirks(c, p->db)) {
+            set_quirks(c, 0);
+        }
+        set_engine(c, p->engine);
+        run_cycles(c, p->cycles);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    j->hash    = get_display_hash(c);
+    j->cycles  = c->cycles;
+    j->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/* Allocations here are all or nothing, a partial run is of no use */
+static void *checked(void *ptr)
+{
+    if (ptr == NULL) {
+        fprintf(stderr, "unable to allocate the job list\n");
+        exit(1);
+    }
+
+    return ptr;
+}
@@ -0,0 +1,344 @@
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "chip8.h"
+#include "scale.h"
+
+/* chip8-bench, runs a fixed set of workloads headlessly for a fixed number of
+ * instructions and prints the results as JSON, so runs can be compared
+ * between releases.
+ *
+ * usage: chip8-bench [-c cycles] [-r repeats] [-e interpreter|threaded] [-o output] [rom...]
+ *
+ * The workloads are demo.ch8, test_opcode.ch8 and four synthetic stress
+ * ROMs, each built around one opcode class (ALU, draw, call and memory
+ * copy). ROMs given on the command line are benchmarked as well. Every
+ * workload is timed `repeats` times and the fastest run is reported.
+ *
+ * Each workload first runs once untimed to count the instructions of each
+ * class (by high nibble). Runs are deterministic, so the timed runs
+ * execute exactly the same instructions.
+ *
+ * The display scaler (see scale.h) is timed too, ns per whole frame for
+ * every kernel the host supports at scales 1 and 10.
+ */
+
+#define DEFAULT_CYCLES   10000000UL
+#define DEFAULT_REPEATS  3
+
+/* ALU and branch loop */
+static const unsigned char alu_rom[] = {
+    0x60, 0x05,  /* 200: V0 = 05        */
+    0x61, 0x03,  /* 202: V1 = 03        */
+    0x80, 0x14,  /* 204: V0 += V1       */
+    0x80, 0x12,  /* 206: V0 &= V1       */
+    0x70, 0x01,  /* 208: V0 += 01       */
+    0xA3, 0x00,  /* 20A: I = 300        */
+    0xF0, 0x1E,  /* 20C: I += V0        */
+    0x30, 0x00,  /* 20E: skip V0 == 00  */
+    0x41, 0x00,  /* 210: skip V1 != 00  */
+    0x90, 0x10,  /* 212: skip V0 != V1  */
+    0x80, 0x16,  /* 214: V0 = V1 >> 1   */
+    0x12, 0x04   /* 216: jump 204       */
+};
+
+/* Sprites drawn all over the screen, half of the loop is Dxyn */
+static const unsigned char draw_rom[] = {
+    0xA0, 0x50,  /* 200: I = font 0     */
+    0x60, 0x00,  /* 202: V0 = 00        */
+    0x61, 0x00,  /* 204: V1 = 00        */
+    0xD0, 0x15,  /* 206: draw V0, V1, 5 */
+    0x70, 0x03,  /* 208: V0 += 03       */
+    0x71, 0x02,  /* 20A: V1 += 02       */
+    0xD0, 0x15,  /* 20C: draw V0, V1, 5 */
+    0x12, 0x06   /* 20E: jump 206       */
+};
+
+/* Nested subroutine calls */
+static const unsigned char call_rom[] = {
+    0x60, 0x00,  /* 200: V0 = 00        */
+    0x22, 0x08,  /* 202: call 208       */
+    0x12, 0x02,  /* 204: jump 202       */
+    0x00, 0x00,  /* 206:                */
+    0x70, 0x01,  /* 208: V0 += 01       */
+    0x22, 0x0E,  /* 20A: call 20E       */
+    0x00, 0xEE,  /* 20C: return         */
+    0x80, 0x14,  /* 20E: V0 += V1       */
+    0x00, 0xEE   /* 210: return         */
+};
+
+/* Register file stores, loads and BCD through I */
+static const unsigned char memory_rom[] = {
+    0x62, 0x00,  /* 200: V2 = 00        */
+    0xA3, 0x00,  /* 202: I = 300        */
+    0xF2, 0x1E,  /* 204: I += V2        */
+    0xFF, 0x55,  /* 206: store V0..VF   */
+    0xFF, 0x65,  /* 208: load V0..VF    */
+    0xF2, 0x33,  /* 20A: BCD of V2      */
+    0x72, 0x10,  /* 20C: V2 += 10       */
+    0x12, 0x02   /* 20E: jump 202       */
+};
+
+typedef struct workload_t {
+    const char          *name;
+    /* ROM file, NULL for the built-in ROMs */
+    const char          *path;
+    const unsigned char *rom;
+    size_t               size;
+    /* Opcode class the synthetic ROM stresses, NULL otherwise */
+    const char          *stresses;
+} workload;
+
+typedef struct result_t {
+    chip8_load_result status;
+    unsigned long     instructions;
+    unsigned long     classes[16];
+    double            seconds;
+} result;
+
+static chip8_load_result  load_workload   (chip8 *c, const workload *w);
+static void               run_workload    (const workload *w, chip8_engine engine, unsigned long cycles, unsigned int repeats, result *r);
+static void               print_json      (FILE *out, const workload *w, const result *r, int count, chip8_engine engine, unsigned long cycles);
+static void               print_scaler    (FILE *out, unsigned int repeats);
+
+int main(int argc, char **argv)
+{
+    unsigned long cycles  = DEFAULT_CYCLES;
+    unsigned int  repeats = DEFAULT_REPEATS;
+    chip8_engine  engine  = CHIP8_ENGINE_INTERPRETER;
+    const char   *output  = NULL;
+    bool          usage   = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:r:e:o:")) != -1) {
+        switch (opt) {
+            case 'c': cycles  = strtoul(optarg, NULL, 10); break;
+            case 'r': repeats = strtoul(optarg, NULL, 10); break;
+            case 'e': usage  |= !find_engine(optarg, &engine); break;
+            case 'o': output  = optarg; break;
+            default:  usage   = true; break;
+        }
+    }
+
+    if (usage) {
+        fprintf(stderr, "usage: %s [-c cycles] [-r repeats] [-e interpreter|threaded] [-o output] [rom...]\n", argv[0]);
+        return 1;
+    }
+
+    if (repeats == 0) {
+        repeats = 1;
+    }
+
+    const workload builtin[] = {
+        { "demo",        "demo.ch8",        NULL,       0,                  NULL     },
+        { "test_opcode", "test_opcode.ch8", NULL,       0,                  NULL     },
+        { "alu",         NULL,              alu_rom,    sizeof(alu_rom),    "alu"    },
+        { "draw",        NULL,              draw_rom,   sizeof(draw_rom),   "draw"   },
+        { "call",        NULL,              call_rom,   sizeof(call_rom),   "call"   },
+        { "memory",      NULL,              memory_rom, sizeof(memory_rom), "memory" }
+    };
+    int builtins = sizeof(builtin) / sizeof(builtin[0]);
+    int count    = builtins + (argc - optind);
+
+    workload *w = calloc(count, sizeof(workload));
+    result   *r = calloc(count, sizeof(result));
+
+    memcpy(w, builtin, sizeof(builtin));
+    for (int i = builtins; i < count; i++) {
+        w[i].name = argv[optind + i - builtins];
+        w[i].path = argv[optind + i - builtins];
+    }
+
+    for (int i = 0; i < count; i++) {
+        run_workload(&w[i], engine, cycles, repeats, &r[i]);
+    }
+
+    FILE *out = stdout;
+    if (output != NULL && (out = fopen(output, "w")) == NULL) {
+        fprintf(stderr, "unable to open %s for writing\n", output);
+        return 1;
+    }
+
+    print_json(out, w, r, count, engine, cycles);
+    print_scaler(out, repeats);
+
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    free(w);
+    free(r);
+
+    return 0;
+}
+
+static chip8_load_result load_workload(chip8 *c, const workload *w)
+{
+    if (w->path != NULL) {
+        return load_file(c, w->path);
+    }
+
+    return load_rom(c, w->rom, w->size);
+}
+
+static void run_workload(const workload *w, chip8_engine engine, unsigned long cycles, unsigned int repeats, result *r)
+{
+    chip8 *c = calloc(1, sizeof(chip8));
+
+    initialize(c);
+
+    r->status = load_workload(c, w);
+    if (r->status != CHIP8_LOAD_OK) {
+        finalize(c);
+        free(c);
+        return;
+    }
+
+    /* untimed pass one instruction at a time for the opcode mix */
+    while (c->cycles < cycles) {
+        unsigned long before = c->cycles;
+
+        run_cycles(c, 1);
+        r->classes[c->opcode >> 12] += c->cycles - before;
+    }
+    r->instructions = c->cycles;
+
+    for (unsigned int i = 0; i < repeats; i++) {
+        struct timespec start, end;
+
+        finalize(c);
+        initialize(c);
+        load_workload(c, w);
+        set_engine(c, engine);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        run_cycles(c, cycles);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        if (i == 0 || seconds < r->seconds) {
+            r->seconds = seconds;
+        }
+    }
+
+    finalize(c);
+    free(c);
+}
+
+static void print_json(FILE *out, const workload *w, const result *r, int count, chip8_engine engine, unsigned long cycles)
+{
+    static const char hex[] = "0123456789ABCDEF";
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"engine\": \"%s\",\n", get_engine_name(engine));
+    fprintf(out, "  \"cycles\": %lu,\n", cycles);
+    fprintf(out, "  \"workloads\": [\n");
+
+    for (int i = 0; i < count; i++) {
+        const result *ri = &r[i];
+
+        fprintf(out, "    {\n");
+        fprintf(out, "      \"name\": \"%s\",\n", w[i].name);
+        fprintf(out, "      \"status\": \"%s\"", get_load_error(ri->status));
+
+        if (ri->status == CHIP8_LOAD_OK) {
+            double seconds = ri->seconds > 0 ? ri->seconds : 1e-9;
+            unsigned long draws = ri->classes[0xD];
+
+            fprintf(out, ",\n");
+            fprintf(out, "      \"instructions\": %lu,\n", ri->instructions);
+            fprintf(out, "      \"seconds\": %.6f,\n", ri->seconds);
+            fprintf(out, "      \"instructions_per_second\": %.0f,\n", ri->instructions / seconds);
+            fprintf(out, "      \"ns_per_instruction\": %.3f,\n", seconds * 1e9 / ri->instructions);
+            fprintf(out, "      \"draws\": %lu,\n", draws);
+            fprintf(out, "      \"draws_per_second\": %.0f,\n", draws / seconds);
+            fprintf(out, "      \"opcode_mix\": {");
+            for (int k = 0; k < 16; k++) {
+                fprintf(out, "%s\"%c\": %lu", k > 0 ? ", " : " ", hex[k], ri->classes[k]);
+            }
+            fprintf(out, " }");
+        }
+
+        fprintf(out, "\n    }%s\n", i + 1 < count ? "," : "");
+    }
+
+    fprintf(out, "  ],\n");
+
+    /* ns per instruction of each stressed opcode class */
+    fprintf(out, "  \"opcode_classes\": {");
+    bool first = true;
+    for (int i = 0; i < count; i++) {
+        if (w[i].stresses == NULL || r[i].status != CHIP8_LOAD_OK || r[i].instructions == 0) {
+            continue;
+        }
+        fprintf(out, "%s\n    \"%s\": %.3f", first ? "" : ",", w[i].stresses, r[i].seconds * 1e9 / r[i].instructions);
+        first = false;
+    }
+    fprintf(out, "\n  },\n");
+}
+
+/* Fastest of repeats runs of frames conversions, in ns per frame */
+static double time_scaler(chip8_scaler *s, const uint64_t *rows, uint32_t *pixels, unsigned int repeats)
+{
+    const int frames = 2000;
+    double    best   = 0;
+
+    for (unsigned int i = 0; i < repeats; i++) {
+        struct timespec start, end;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int f = 0; f < frames; f++) {
+            scale_frame(s, rows, ALL_ROWS, pixels, s->width * sizeof(uint32_t));
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double ns = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / frames;
+        if (i == 0 || ns < best) {
+            best = ns;
+        }
+    }
+
+    return best;
+}
+
+static void print_scaler(FILE *out, unsigned int repeats)
+{
+    static const unsigned int scales[] = { 1, 10 };
+
+    uint64_t rows[W_HEIGHT];
+    uint64_t bits = 0x9E3779B97F4A7C15ULL;
+
+    // a busy picture, every row different
+    for (int y = 0; y < W_HEIGHT; y++) {
+        bits = bits * 6364136223846793005ULL + 1442695040888963407ULL;
+        rows[y] = bits;
+    }
+
+    fprintf(out, "  \"scaler_ns_per_frame\": {");
+
+    bool first = true;
+    for (chip8_scaler_kernel k = CHIP8_SCALER_SCALAR; k <= CHIP8_SCALER_AVX2; k++) {
+        for (int i = 0; i < 2; i++) {
+            chip8_scaler s;
+
+            init_scaler(&s, CHIP8_VARIANT_CHIP8, scales[i], NULL, 0);
+            if (set_scaler_kernel(&s, k) != k) {
+                free_scaler(&s);
+                continue;
+            }
+
+            uint32_t *pixels = calloc(s.width * s.height, sizeof(uint32_t));
+
+            fprintf(out, "%s\n    \"%s_x%u\": %.0f", first ? "" : ",", get_kernel_name(k), scales[i],
+                    time_scaler(&s, rows, pixels, repeats));
+            first = false;
+
+            free(pixels);
+            free_scaler(&s);
+        }
+    }
+
+    fprintf(out, "\n  }\n");
+    fprintf(out, "}\n");
+}
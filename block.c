@@ -0,0 +1,169 @@
+#include "block.h"
+#include "profile.h"
+#include "trace.h"
+#include "variant.h"
+
+chip8_blocks *create_blocks(void)
+{
+    chip8_blocks *b = calloc(1, sizeof(chip8_blocks));
+    if (b == NULL) {
+        fprintf(stderr, "unable to allocate the block cache\n");
+        exit(1);
+    }
+
+    flush_blocks(b);
+
+    return b;
+}
+
+void destroy_blocks(chip8_blocks *b)
+{
+    free(b);
+}
+
+void flush_blocks(chip8_blocks *b)
+{
+    for (int i = 0; i < MAX_MEMORY; i++) {
+        b->start[i]   = 0;
+        b->length[i]  = 0;
+        b->covered[i] = 0;
+    }
+
+    b->used = 1;
+}
+
+void reset_blocks(chip8_blocks *b)
+{
+    for (int i = 0; i < BLOCK_PAGES; i++) {
+        b->smc[i] = 0;
+    }
+
+    flush_blocks(b);
+}
+
+void invalidate_blocks(chip8_blocks *b, unsigned short addr)
+{
+    if (addr >= MAX_MEMORY || !b->covered[addr]) {
+        return;
+    }
+
+    /* code rewrote itself, leave this page to the interpreter from now on */
+    b->smc[addr >> BLOCK_PAGE_SHIFT] = 1;
+    flush_blocks(b);
+}
+
+/* Instructions after which a block cannot continue */
+static bool ends_block(const chip8_insn *in)
+{
+    chip8_op op = in->op;
+
+    return op == op_00EE || op == op_1nnn || op == op_2nnn || op == op_3xnn
+        || op == op_4xnn || op == op_5xy0 || op == op_9xy0 || op == op_Bnnn
+        || op == op_Dxyn || op == op_Ex9E || op == op_ExA1 || op == op_Fx0A
+        || op == op_Fx33 || op == op_Fx55 || variant_ends_block(op);
+}
+
+/* Translate the block starting at the current PC, returns its length or 0
+ * if the code has to be interpreted
+ */
+static unsigned char translate_block(chip8 *c, chip8_blocks *b)
+{
+    unsigned short pc = c->PC;
+
+    if (pc + 1 >= MAX_MEMORY || b->smc[pc >> BLOCK_PAGE_SHIFT]) {
+        return 0;
+    }
+
+    /* start over once the pool can't hold another full block */
+    if (b->used + BLOCK_MAX_LENGTH > BLOCK_POOL_SIZE) {
+        flush_blocks(b);
+    }
+
+    unsigned short first  = b->used;
+    unsigned char  length = 0;
+
+    while (length < BLOCK_MAX_LENGTH && pc + 1 < MAX_MEMORY && !b->smc[pc >> BLOCK_PAGE_SHIFT]) {
+        const chip8_insn *in = &c->decode[(get_memory_value(c, pc) << 8) | get_memory_value(c, pc + 1)];
+
+        b->code[b->used++] = in;
+        b->covered[pc]     = 1;
+        b->covered[pc + 1] = 1;
+        length++;
+        pc += 2;
+
+        if (ends_block(in)) {
+            break;
+        }
+    }
+
+    b->start[c->PC]  = first;
+    b->length[c->PC] = length;
+
+    return length;
+}
+
+void run_blocks(chip8 *c, unsigned long n)
+{
+    chip8_blocks *b = c->blocks;
+
+    while (n > 0) {
+        unsigned char length = 0;
+
+        /* key waits and delay timer polls are fast-forwarded, not run */
+        unsigned long skipped = skip_idle(c, n);
+        if (skipped > 0) {
+            n -= skipped;
+            continue;
+        }
+
+        if (c->PC < MAX_MEMORY) {
+            length = b->length[c->PC];
+            if (length == 0) {
+                length = translate_block(c, b);
+            }
+        }
+
+        /* no block here, interpret a single instruction */
+        if (length == 0) {
+            execute_instruction(c);
+            n--;
+            continue;
+        }
+
+        if (length > n) {
+            length = n;
+        }
+
+        PROFILE_BLOCK(c, c->PC, length);
+
+        const chip8_insn **code = &b->code[b->start[c->PC]];
+        for (unsigned char i = 0; i < length; i++) {
+            const chip8_insn *in = code[i];
+            unsigned short    pc = c->PC;
+
+            PROFILE_BEGIN(c);
+
+            c->opcode = in->opcode;
+            in->op(c, in);
+
+            PROFILE_END(c, in);
+
+            /* away from a timer tick and with no wait pending the bookkeeping
+             * after an instruction is only the counters
+             */
+            if (c->frame_left > 1 && !c->pause) {
+                c->cycles++;
+                c->frame_left--;
+                c->PC += 2;
+            } else {
+                end_instruction(c);
+            }
+
+            if (c->trace != NULL) {
+                trace_instruction(c->trace, c, pc);
+            }
+        }
+
+        n -= length;
+    }
+}
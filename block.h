@@ -0,0 +1,48 @@
+#ifndef BLOCK_H
+#define BLOCK_H
+
+#include "chip8.h"
+
+/* Basic-block engine
+ *
+ * Straight-line runs of instructions are translated once into threaded code,
+ * a list of pre-decoded instructions run back to back without fetching or
+ * decoding. A block ends after any instruction that changes control flow
+ * (jumps, calls, returns, skips), draws (Dxyn), waits (Fx0A) or stores to
+ * memory (Fx33, Fx55), so every block can assume its code does not change
+ * underneath it. The extended profiles add their own such instructions (see
+ * variant.h), and XO-CHIP code above 4 KB is always interpreted.
+ *
+ * A store that hits translated code flushes all blocks and marks its page
+ * as self-modifying. Code in such pages is run by the interpreter until
+ * reset_blocks, which initialize and load_rom call for the next program.
+ */
+
+#define BLOCK_MAX_LENGTH  64
+#define BLOCK_POOL_SIZE   MAX_MEMORY
+#define BLOCK_PAGE_SHIFT  6
+#define BLOCK_PAGES       (MAX_MEMORY >> BLOCK_PAGE_SHIFT)
+
+typedef struct chip8_blocks_t {
+    /* Start of the block for each address in code, 0 if not translated */
+    unsigned short start[MAX_MEMORY];
+    /* Number of instructions in the block at each address */
+    unsigned char  length[MAX_MEMORY];
+    /* Bytes covered by any translated block */
+    unsigned char  covered[MAX_MEMORY];
+    /* Pages written to while holding translated code */
+    unsigned char  smc[BLOCK_PAGES];
+    /* Threaded code of all blocks, index 0 is unused */
+    const chip8_insn *code[BLOCK_POOL_SIZE];
+    unsigned short used;
+} chip8_blocks;
+
+chip8_blocks *create_blocks      (void);
+void          destroy_blocks     (chip8_blocks *b);
+void          flush_blocks       (chip8_blocks *b);
+/* Flush and forget the self-modifying pages too */
+void          reset_blocks       (chip8_blocks *b);
+void          invalidate_blocks  (chip8_blocks *b, unsigned short addr);
+void          run_blocks         (chip8 *c, unsigned long n);
+
+#endif
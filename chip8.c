@@ -1,4 +1,19 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "chip8.h"
+#include "audio.h"
+#include "block.h"
+#include "frame.h"
+#include "profile.h"
+#include "replay.h"
+#include "trace.h"
+#include "variant.h"
+#include "video.h"
 
 unsigned char fontset[80] = {
     0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
@@ -19,19 +34,136 @@ unsigned char fontset[80] = {
     0xF0, 0x80, 0xF0, 0x80, 0x80  // F
 };
 
+unsigned char bigfont[160] = {
+    0x3C, 0x7E, 0xE7, 0xC3, 0xC3, 0xC3, 0xC3, 0xE7, 0x7E, 0x3C, // 0
+    0x18, 0x38, 0x58, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x3C, // 1
+    0x3E, 0x7F, 0xC3, 0x06, 0x0C, 0x18, 0x30, 0x60, 0xFF, 0xFF, // 2
+    0x3C, 0x7E, 0xC3, 0x03, 0x0E, 0x0E, 0x03, 0xC3, 0x7E, 0x3C, // 3
+    0x06, 0x0E, 0x1E, 0x36, 0x66, 0xC6, 0xFF, 0xFF, 0x06, 0x06, // 4
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFE, 0x03, 0xC3, 0x7E, 0x3C, // 5
+    0x3E, 0x7C, 0xC0, 0xC0, 0xFC, 0xFE, 0xC3, 0xC3, 0x7E, 0x3C, // 6
+    0xFF, 0xFF, 0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x60, 0x60, // 7
+    0x3C, 0x7E, 0xC3, 0xC3, 0x7E, 0x7E, 0xC3, 0xC3, 0x7E, 0x3C, // 8
+    0x3C, 0x7E, 0xC3, 0xC3, 0x7F, 0x3F, 0x03, 0x03, 0x3E, 0x7C, // 9
+    0x3C, 0x7E, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, 0xC3, // A
+    0xFC, 0xFE, 0xC3, 0xC3, 0xFE, 0xFE, 0xC3, 0xC3, 0xFE, 0xFC, // B
+    0x3C, 0x7E, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0x7E, 0x3C, // C
+    0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC, // D
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFC, 0xC0, 0xC0, 0xFF, 0xFF, // E
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFC, 0xC0, 0xC0, 0xC0, 0xC0  // F
+};
+
+/* Memory byte with the memory size as a constant, see run_cycles */
+static inline unsigned char read_byte(chip8 *c, unsigned short addr, unsigned short mask)
+{
+    addr &= mask;
+
+    return (*get_page_slot(c, addr / MEMORY_PAGE_SIZE))->data[addr % MEMORY_PAGE_SIZE];
+}
+
+/* Page slots a machine has, the extended ones have room for all 64 KB */
+static int page_slots(chip8 *c)
+{
+    return c->extended != NULL ? MAX_MEMORY_PAGES : MEMORY_PAGES;
+}
+
 /* Main operations */
+static void clear_rows(chip8 *c)
+{
+    unshare_display(c);
+
+    for (int i = 0; i < W_HEIGHT; i++) {
+        c->display->rows[i] = 0;
+    }
+
+    c->dirty_rows = ALL_ROWS;
+}
+
 void clear_display(chip8 *c)
 {
-    for (int i = 0; i < W_WIDTH * W_HEIGHT; i++) {
-        c->display[i] = 0;
+    if (c->display->planes == NULL) {
+        clear_rows(c);
+        return;
+    }
+
+    unshare_display(c);
+    memset(c->display->planes, 0, PLANES_SIZE);
+    redraw_display(c);
+}
+
+/* Marks every row of the display as changed */
+void redraw_display(chip8 *c)
+{
+    if (c->extended == NULL) {
+        c->dirty_rows = ALL_ROWS;
+    } else {
+        c->extended->dirty_rows = ALL_HIRES_ROWS;
     }
 }
 
 void initialize(chip8 *c)
 {
-    /* Initialize the memory (4096 bytes) */
-    for (int i = 0; i < MAX_MEMORY; i++) {
-        c->memory[i] = 0;
+    /* standalone machines get their memory and instruction cache here,
+     * pooled and forked machines come with their pages attached
+     */
+    bool attached = false;
+    for (int i = 0; i < MEMORY_PAGES; i++) {
+        attached |= c->pages[i] != NULL;
+    }
+
+    /* the machine keeps its profile, a zeroed one is the classic machine */
+    c->memory_mask = c->variant == CHIP8_VARIANT_XOCHIP ? XO_MEMORY - 1 : MAX_MEMORY - 1;
+
+    bool extended = c->variant != CHIP8_VARIANT_CHIP8;
+
+    if (extended && c->extended == NULL) {
+        c->extended = calloc(1, sizeof(chip8_extended));
+
+        if (c->extended == NULL) {
+            fprintf(stderr, "unable to allocate chip-8 memory\n");
+            exit(1);
+        }
+    }
+
+    if (!attached && c->icache == NULL) {
+        c->icache = malloc(get_memory_size(c) * sizeof(*c->icache));
+
+        if (c->icache == NULL) {
+            fprintf(stderr, "unable to allocate chip-8 memory\n");
+            exit(1);
+        }
+    }
+
+    /* Initialize the memory (4096 bytes), shared pages are replaced and
+     * pages past the end of a smaller memory dropped
+     */
+    for (int i = 0; i < page_slots(c); i++) {
+        chip8_page **p = get_page_slot(c, i);
+
+        if ((size_t) i * MEMORY_PAGE_SIZE >= get_memory_size(c)) {
+            release_page(*p);
+            *p = NULL;
+        } else if (*p == NULL || (*p)->refs > 1) {
+            release_page(*p);
+            *p = create_page();
+        } else {
+            memset((*p)->data, 0, MEMORY_PAGE_SIZE);
+        }
+    }
+
+    /* back to the classic machine, its pages are gone already */
+    if (!extended && c->extended != NULL) {
+        free(c->extended);
+        c->extended = NULL;
+    }
+
+    /* a display of the other kind goes when the profile changes */
+    if (c->display != NULL && (c->display->planes != NULL) != extended) {
+        release_display(c->display);
+        c->display = NULL;
+    }
+    if (c->display == NULL) {
+        c->display = create_display(extended);
     }
 
     /* clear the opcode */
@@ -54,145 +186,342 @@ void initialize(chip8 *c)
     set_dt(c, 0);
     set_st(c, 0);
 
+    /* lo-res, drawing to the first plane */
+    c->hires = false;
+    c->plane = 1;
+    memset(c->flags, 0, sizeof(c->flags));
+
     /* clear display */
     clear_display(c);
 
-    /* fontset data is stored at 0x50 */
-    for (int i = 0; i < 80; i++) {
-        c->memory[i + 0x50] = fontset[i];
+    /* fontset data is stored at 0x50, the big digits right after it */
+    write_memory(c, FONT_START, fontset, 80);
+    if (c->variant != CHIP8_VARIANT_CHIP8) {
+        write_memory(c, BIGFONT_START, bigfont, 160);
     }
 
     c->pause = 0;
     c->key_flag = -1;
+
+    /* decode every opcode once, shared by all instances of the profile */
+    build_decode_table(c->variant, c->quirks);
+    c->decode = get_decode_table(c->variant, c->quirks);
+    clear_icache(c);
+    if (c->blocks != NULL) {
+        reset_blocks(c->blocks);
+    }
+
+    c->cycles = 0;
+    set_cycles_per_frame(c, CYCLES_PER_FRAME);
+
+    /* runs are reproducible unless the frontend picks another seed */
+    seed_random(c, 0);
 }
 
-void execute_instruction(chip8 *c)
+void finalize(chip8 *c)
+{
+    set_engine(c, CHIP8_ENGINE_INTERPRETER);
+
+    for (int i = 0; i < page_slots(c); i++) {
+        release_page(*get_page_slot(c, i));
+        *get_page_slot(c, i) = NULL;
+    }
+
+    free(c->extended);
+    c->extended = NULL;
+
+    release_display(c->display);
+    c->display = NULL;
+
+    free(c->icache);
+    c->icache = NULL;
+}
+
+void chip8_fork(chip8 *parent, chip8 *child)
+{
+    /* child must be zeroed or finalized, registers and timers are copied,
+     * memory pages and the display are shared until either side writes
+     */
+    *child = *parent;
+
+    if (parent->extended != NULL) {
+        child->extended = malloc(sizeof(chip8_extended));
+
+        if (child->extended == NULL) {
+            fprintf(stderr, "unable to allocate chip-8 memory\n");
+            exit(1);
+        }
+        *child->extended = *parent->extended;
+    }
+
+    for (int i = 0; i < page_slots(child); i++) {
+        chip8_page *p = *get_page_slot(child, i);
+
+        if (p != NULL) {
+            atomic_fetch_add(&p->refs, 1);
+        }
+    }
+    atomic_fetch_add(&child->display->refs, 1);
+
+    /* caches belong to the parent, the child decodes from its pages */
+    child->icache = NULL;
+    child->engine = CHIP8_ENGINE_INTERPRETER;
+    child->blocks = NULL;
+    child->profile = NULL;
+    child->frame_buffer = NULL;
+    child->replay = NULL;
+    child->trace = NULL;
+    child->video = NULL;
+    child->audio = NULL;
+}
+
+/* Memory pages */
+chip8_page *create_page(void)
+{
+    chip8_page *p = calloc(1, sizeof(chip8_page));
+
+    if (p == NULL) {
+        fprintf(stderr, "unable to allocate chip-8 memory\n");
+        exit(1);
+    }
+
+    atomic_init(&p->refs, 1);
+
+    return p;
+}
+
+void release_page(chip8_page *p)
+{
+    if (p != NULL && atomic_fetch_sub(&p->refs, 1) == 1 && !p->pooled) {
+        free(p);
+    }
+}
+
+/* Give c a private copy of a shared page before writing to it */
+chip8_page *unshare_page(chip8 *c, unsigned int i)
+{
+    chip8_page **slot = get_page_slot(c, i);
+    chip8_page  *p    = *slot;
+
+    if (atomic_load_explicit(&p->refs, memory_order_acquire) > 1) {
+        chip8_page *copy = create_page();
+
+        memcpy(copy->data, p->data, MEMORY_PAGE_SIZE);
+        release_page(p);
+        *slot = p = copy;
+    }
+
+    return p;
+}
+
+chip8_display *create_display(bool planes)
+{
+    chip8_display *d = calloc(1, sizeof(chip8_display) + (planes ? PLANES_SIZE : 0));
+
+    if (d == NULL) {
+        fprintf(stderr, "unable to allocate chip-8 display\n");
+        exit(1);
+    }
+
+    atomic_init(&d->refs, 1);
+    if (planes) {
+        d->planes = (void *) (d + 1);
+    }
+
+    return d;
+}
+
+void release_display(chip8_display *d)
+{
+    if (d != NULL && atomic_fetch_sub(&d->refs, 1) == 1 && !d->pooled) {
+        free(d);
+    }
+}
+
+void unshare_display(chip8 *c)
+{
+    chip8_display *d = c->display;
+
+    if (atomic_load_explicit(&d->refs, memory_order_acquire) > 1) {
+        chip8_display *copy = create_display(d->planes != NULL);
+
+        memcpy(copy->rows, d->rows, sizeof(copy->rows));
+        if (d->planes != NULL) {
+            memcpy(copy->planes, d->planes, PLANES_SIZE);
+        }
+        release_display(d);
+        c->display = copy;
+    }
+}
+
+void set_cycles_per_frame(chip8 *c, unsigned int n)
+{
+    c->cycles_per_frame = n > 0 ? n : 1;
+
+    /* keep the ticks on frame boundaries of the instruction count */
+    c->frame_left = c->cycles_per_frame - c->cycles % c->cycles_per_frame;
+}
+
+void set_variant(chip8 *c, chip8_variant variant)
+{
+    size_t before = get_memory_size(c);
+
+    c->variant = variant < CHIP8_VARIANTS ? variant : CHIP8_VARIANT_CHIP8;
+    c->quirks  = get_default_quirks(c->variant);
+
+    /* the instruction cache has an entry per address */
+    if (c->icache != NULL && get_memory_size(c) != before) {
+        c->icache = realloc(c->icache, get_memory_size(c) * sizeof(*c->icache));
+
+        if (c->icache == NULL) {
+            fprintf(stderr, "unable to allocate chip-8 memory\n");
+            exit(1);
+        }
+    }
+
+    /* blocks are translated from the old decoding and cover 4 KB */
+    if (c->blocks != NULL) {
+        flush_blocks(c->blocks);
+    }
+
+    initialize(c);
+}
+
+void set_quirks(chip8 *c, unsigned int quirks)
+{
+    c->quirks = quirks % CHIP8_QUIRKS;
+
+    build_decode_table(c->variant, c->quirks);
+    c->decode = get_decode_table(c->variant, c->quirks);
+
+    /* both caches point into the old table */
+    clear_icache(c);
+    if (c->blocks != NULL) {
+        flush_blocks(c->blocks);
+    }
+}
+
+/* Decode table, one pre-decoded entry for every possible 16-bit opcode. The
+ * classic one is static, the other profiles and quirk combinations get
+ * theirs on first use, which may come from several threads at once (a batch
+ * of ROMs with their own quirks).
+ */
+static chip8_insn      decode_table[0x10000];
+static chip8_insn     *variant_tables[CHIP8_VARIANTS][CHIP8_QUIRKS] = { { decode_table } };
+static atomic_bool     decode_table_built[CHIP8_VARIANTS][CHIP8_QUIRKS];
+static pthread_mutex_t decode_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void decode_opcode(unsigned short opcode, chip8_insn *in)
 {
-    c->opcode = (c->memory[c->PC] << 8) | c->memory[c->PC + 1];
+    in->opcode = opcode;
+    in->nnn    = opcode & 0x0FFF;
+    in->x      = (opcode & 0x0F00) >> 8;
+    in->y      = (opcode & 0x00F0) >> 4;
+    in->n      = opcode & 0x000F;
+    in->nn     = opcode & 0x00FF;
+    in->op     = op_nop;
 
-    switch(c->opcode & 0xF000) {
+    switch(opcode & 0xF000) {
         case 0x0000: {
             /* 00E0 - clear the display */
-            if (c->opcode & 0xFFFF == 0x00E0) {
-                op_00E0(c);
+            if (opcode == 0x00E0) {
+                in->op = op_00E0;
             }
-            /* 00EE - Return from a subroutine 
-               Not an oftenly used instruction by modern interpreters
-            else if (c->opcode & 0xFFFF == 0x00EE) {
-                op_00EE(c);
+            /* 00EE - Return from a subroutine */
+            else if (opcode == 0x00EE) {
+                in->op = op_00EE;
             }
-            */
             break;
         }
         /* 1nnn - Jump to address NNN */
         case 0x1000: {
-            op_1nnn(c);
+            in->op = op_1nnn;
             break;
         }
         /* 2nnn - Execute subroutine starting at address NNN */
         case 0x2000: {
-            op_2nnn(c);
+            in->op = op_2nnn;
             break;
         }
         /* 3xnn - Skip the following instruction if the value of register VX equals NN */
         case 0x3000: {
-            op_3xnn(c);
+            in->op = op_3xnn;
             break;
         }
         /* 4xnn - Skip the following instruction if the value of register VX is not equal to NN */
         case 0x4000: {
-            op_4xnn(c);
+            in->op = op_4xnn;
             break;
         }
         /* 5xy0 - Skip the following instruction if the value of register VX is equal to the value of register VY */
         case 0x5000: {
-            op_5xy0(c);
+            in->op = op_5xy0;
             break;
         }
         /* 6xnn - Store number NN in register VX */
         case 0x6000: {
-            op_6xnn(c);
+            in->op = op_6xnn;
             break;
         }
         /* 7xnn - Add the value NN to register VX */
         case 0x7000: {
-            op_7xnn(c);
+            in->op = op_7xnn;
             break;
         }
         case 0x8000: {
-            unsigned char a = get_reg_value(c, get_opcode_x(c));
-            unsigned char b = get_reg_value(c, get_opcode_y(c));
-
-            /* 8xy0 - Store the value of register VY in register VX */
-            if (test_opcode(c, 0x000F, 0)) {
-                op_8xy0(c, a, b);
-            }
-            /* 8xy1 - Set VX to VX OR VY */
-            else if (test_opcode(c, 0x000F, 1)) {
-                op_8xy1(c, a, b);
-            }
-            /* 8xy2 - Set VX to VX AND VY */
-            else if (test_opcode(c, 0x000F, 2)) {
-                op_8xy2(c, a, b);
-            }
-            /* 8xy3 - Set VX to VX XOR VY */
-            else if (test_opcode(c, 0x000F, 3)) {
-                op_8xy3(c, a, b);
-            }
-            /* Add the value of register VY to register VX
-             * Set VF to 01 if a carry occurs
-             * Set VF to 00 if a carry does not occur
-             */
-            else if (test_opcode(c, 0x000F, 4)) {
-                op_8xy4(c, a, b);
-            }
-            /* Subtract the value of register VY from register VX
-             * Set VF to 00 if a borrow occurs
-             * Set VF to 01 if a borrow does not occur
-             */
-            else if (test_opcode(c, 0x000F, 5)) {
-                op_8xy5(c, a, b);
-            }
-            /* 8xy6 - Store the value of register VY shifted right one bit in register VX
-             *        Set register VF to the least significant bit prior to the shift
-             */
-            else if (test_opcode(c, 0x000F, 6)) {
-                op_8xy6(c, b);
-            }
-            /* 8xy7 - Set register VX to the value of VY minus VX
-             *        Set VF to 00 if a borrow occurs
-             *        Set VF to 01 if a borrow does not occur
-             */
-            else if (test_opcode(c, 0x000F, 7)) {
-                op_8xy7(c, a, b);
-            }
-            /* 8xyE - Store the value of register VY shifted left one bit in register VX
-             *        Set register VF to the most significant bit prior to the shift
-             */
-            else if (test_opcode(c, 0x000F, 0xE)) {
-                op_8xyE(c, b);
+            switch (in->n) {
+                /* 8xy0 - Store the value of register VY in register VX */
+                case 0x0: in->op = op_8xy0; break;
+                /* 8xy1 - Set VX to VX OR VY */
+                case 0x1: in->op = op_8xy1; break;
+                /* 8xy2 - Set VX to VX AND VY */
+                case 0x2: in->op = op_8xy2; break;
+                /* 8xy3 - Set VX to VX XOR VY */
+                case 0x3: in->op = op_8xy3; break;
+                /* Add the value of register VY to register VX
+                 * Set VF to 01 if a carry occurs
+                 * Set VF to 00 if a carry does not occur
+                 */
+                case 0x4: in->op = op_8xy4; break;
+                /* Subtract the value of register VY from register VX
+                 * Set VF to 00 if a borrow occurs
+                 * Set VF to 01 if a borrow does not occur
+                 */
+                case 0x5: in->op = op_8xy5; break;
+                /* 8xy6 - Store the value of register VY shifted right one bit in register VX
+                 *        Set register VF to the least significant bit prior to the shift
+                 */
+                case 0x6: in->op = op_8xy6; break;
+                /* 8xy7 - Set register VX to the value of VY minus VX
+                 *        Set VF to 00 if a borrow occurs
+                 *        Set VF to 01 if a borrow does not occur
+                 */
+                case 0x7: in->op = op_8xy7; break;
+                /* 8xyE - Store the value of register VY shifted left one bit in register VX
+                 *        Set register VF to the most significant bit prior to the shift
+                 */
+                case 0xE: in->op = op_8xyE; break;
             }
-
             break;
         }
         /* 9xy0 - Skip the following instruction if the value of register VX is not equal to the value of register VY */
         case 0x9000: {
-            op_9xy0(c);
+            in->op = op_9xy0;
             break;
         }
         /* Annn - Store memory address NNN in register I */
         case 0xA000: {
-            op_Annn(c);
+            in->op = op_Annn;
             break;
         }
         /* Bnnn - Jump to address NNN + V0 */
         case 0xB000: {
-            op_Bnnn(c);
+            in->op = op_Bnnn;
             break;
         }
         /* Cxnn - Set VX to a random number with a mask of NN */
         case 0xC000: {
-            op_Cxnn(c);
+            in->op = op_Cxnn;
             break;
         }
         /* Dxyn - DRW Vx, Vy, nibble
@@ -205,148 +534,595 @@ void execute_instruction(chip8 *c)
          * it wraps around to the opposite side of the screen.
          */
         case 0xD000: {
-            op_Dxyn(c);
+            in->op = op_Dxyn;
             break;
         }
         case 0xE000: {
             /* Ex9E - Skip the following instruction if the key corresponding to the hex value currently
              * stored in register VX is pressed */
-            unsigned char a = get_reg_value(c, get_opcode_x(c));
-            if (test_opcode(c, 0x00FF, 0x009E) && get_key_value(c, a)) {
-                op_Ex9E(c);
+            if (in->nn == 0x9E) {
+                in->op = op_Ex9E;
             }
             /* ExA1 - Skip the following instruction if the key corresponding to the hex value currently
              * stored in register VX is not pressed */
-            else if (test_opcode(c, 0x00FF, 0x00A1) && !get_key_value(c, a)) {
-                op_ExA1(c);
+            else if (in->nn == 0xA1) {
+                in->op = op_ExA1;
             }
 
             break;
         }
         case 0xF000: {
-            /* Fx07 - Store the current value of the delay timer in register VX */
-            if (test_opcode(c, 0x000F, 0x0007)) {
-                op_Fx07(c);
-            }
-            /* Fx0A - Wait for a keypress and store the result in register VX */
-            else if (test_opcode(c, 0x000F, 0x000A)) {
-                op_Fx0A(c);
-            }
-            /* Fx15 - Set the delay timer to the value of register VX */
-            else if (test_opcode(c, 0x00FF, 0x0015)) {
-                op_Fx15(c);
-            }
-            /* Fx18 - Set the sound timer to the value of register VX */
-            else if (test_opcode(c, 0x00FF, 0x0018)) {
-                op_Fx18(c);
-            }
-            /* Fx1E - Add the value stored in register VX to register I */
-            else if (test_opcode(c, 0x00FF, 0x001E)) {
-                op_Fx1E(c);
-            }
-            /* Fx29 - Set I to the memory address of the sprite data corresponding to the hexadecimal digit stored in register VX */
-            else if (test_opcode(c, 0x00FF, 0x0029)) {
-                /* fontset starts at 0x50, translate that position by the value of Vx
-                 * multiplied by the sprite width (5 bytes)
-                 */
-                op_Fx29(c);
+            switch (in->nn) {
+                /* Fx07 - Store the current value of the delay timer in register VX */
+                case 0x07: in->op = op_Fx07; break;
+                /* Fx0A - Wait for a keypress and store the result in register VX */
+                case 0x0A: in->op = op_Fx0A; break;
+                /* Fx15 - Set the delay timer to the value of register VX */
+                case 0x15: in->op = op_Fx15; break;
+                /* Fx18 - Set the sound timer to the value of register VX */
+                case 0x18: in->op = op_Fx18; break;
+                /* Fx1E - Add the value stored in register VX to register I */
+                case 0x1E: in->op = op_Fx1E; break;
+                /* Fx29 - Set I to the memory address of the sprite data corresponding to the hexadecimal
+                 * digit stored in register VX */
+                case 0x29: in->op = op_Fx29; break;
+                /* Fx33 - Store the binary-coded decimal equivalent of the value stored in register VX at
+                 * addresses I, I+1, and I+2 */
+                case 0x33: in->op = op_Fx33; break;
+                /* Fx55 - Store the values of registers V0 to VX inclusive in memory starting at address I
+                 *        I is set to I + X + 1 after operation */
+                case 0x55: in->op = op_Fx55; break;
+                /* Fx65 - Fill registers V0 to VX inclusive with the values stored in memory starting at
+                 *        address I, I is set to I + X + 1 after operation */
+                case 0x65: in->op = op_Fx65; break;
             }
-            /* Fx33 - Store the binary-coded decimal equivalent of the value stored in register VX at addresses I, I+1, and I+2 */
-            else if (test_opcode(c, 0x00FF, 0x0033)) {
-                op_Fx33(c);
-            }
-            /* Fx55 - Store the values of registers V0 to VX inclusive in memory starting at address I
-             *        I is set to I + X + 1 after operation */
-            else if (test_opcode(c, 0x00FF, 0x0055)) {
-                op_Fx55(c);
-            }
-            /* Fx65 - Fill registers V0 to VX inclusive with the values stored in memory starting at address I
-             *        I is set to I + X + 1 after operation */
-            else if (test_opcode(c, 0x00FF, 0x0065)) {
-                op_Fx65(c);
+            break;
+        }
+    }
+}
+
+void build_decode_table(chip8_variant variant, unsigned int quirks)
+{
+    /* the release below publishes the entries with the flag */
+    if (atomic_load_explicit(&decode_table_built[variant][quirks], memory_order_acquire)) {
+        return;
+    }
+
+    pthread_mutex_lock(&decode_table_lock);
+
+    chip8_insn **table = &variant_tables[variant][quirks];
+
+    if (!atomic_load_explicit(&decode_table_built[variant][quirks], memory_order_relaxed)) {
+        if (*table == NULL) {
+            *table = malloc(0x10000 * sizeof(chip8_insn));
+
+            if (*table == NULL) {
+                fprintf(stderr, "unable to allocate decode table\n");
+                exit(1);
             }
+        }
 
-            break;
+        for (unsigned int i = 0; i < 0x10000; i++) {
+            decode_variant_opcode(variant, quirks, i, &(*table)[i]);
         }
-        default: {
-            fprintf(stderr, "unrecognized opcode %x\n", c->opcode);
+
+        atomic_store_explicit(&decode_table_built[variant][quirks], true, memory_order_release);
+    }
+
+    pthread_mutex_unlock(&decode_table_lock);
+}
+
+const chip8_insn *get_decoded(unsigned short opcode)
+{
+    return &decode_table[opcode];
+}
+
+const chip8_insn *get_decode_table(chip8_variant variant, unsigned int quirks)
+{
+    return variant_tables[variant][quirks];
+}
+
+/* Instruction cache, maps each address to its decoded instruction */
+void clear_icache(chip8 *c)
+{
+    for (size_t i = 0; c->icache != NULL && i < get_memory_size(c); i++) {
+        c->icache[i] = NULL;
+    }
+
+    /* translated blocks were built from the old decoding */
+    if (c->blocks != NULL) {
+        flush_blocks(c->blocks);
+    }
+}
+
+void invalidate_icache(chip8 *c, unsigned short addr)
+{
+    /* the byte belongs to the instructions starting at addr and addr - 1 */
+    if (c->icache != NULL) {
+        c->icache[addr] = NULL;
+        if (addr > 0) {
+            c->icache[addr - 1] = NULL;
         }
     }
 
+    /* self-modifying code, drop any block covering this byte */
+    if (c->blocks != NULL) {
+        invalidate_blocks(c->blocks, addr);
+    }
+}
+
+/* The memory size and decode table are constants where the caller knows
+ * the profile, see run_cycles
+ */
+static inline __attribute__((always_inline)) const chip8_insn *fetch_from(chip8 *c, unsigned short mask, const chip8_insn *table)
+{
+    /* addresses past the end of memory wrap around */
+    unsigned short pc = c->PC & mask;
+
+    /* pooled and forked machines decode straight from memory */
+    if (c->icache == NULL) {
+        return &table[(read_byte(c, pc, mask) << 8) | read_byte(c, pc + 1, mask)];
+    }
+
+    const chip8_insn *in = c->icache[pc];
+
+    /* decode lazily on the first visit to this address */
+    if (in == NULL) {
+        in = &table[(read_byte(c, pc, mask) << 8) | read_byte(c, pc + 1, mask)];
+        c->icache[pc] = in;
+    }
+
+    return in;
+}
+
+const chip8_insn *fetch_instruction(chip8 *c)
+{
+    return fetch_from(c, c->memory_mask, c->decode);
+}
+
+void execute_instruction(chip8 *c)
+{
+    execute_decoded(c, fetch_instruction(c));
+}
+
+void execute_decoded(chip8 *c, const chip8_insn *in)
+{
+    unsigned short pc = c->PC;
+
+    PROFILE_BEGIN(c);
+
+    c->opcode = in->opcode;
+
+    /* a single indexed jump through the pre-decoded table */
+    in->op(c, in);
+
+    PROFILE_END(c, in);
+
+    end_instruction(c);
+
+    if (c->trace != NULL) {
+        trace_instruction(c->trace, c, pc);
+    }
+}
+
+void end_instruction(chip8 *c)
+{
+    c->cycles++;
+
     if (!c->pause) {
         pc_increment(c);
+    }
 
-        // update timers
-        if (c->DT > 0 && SDL_GetTicks() % 16 == 0) {
-            c->DT--;
-        } else {
-            c->DT = 0;
+    // timers keep running while Fx0A waits for a key
+    if (--c->frame_left == 0) {
+        c->frame_left = c->cycles_per_frame;
+        end_frame(c);
+    }
+}
+
+/* 60 Hz boundary, tells the attached audio whether the tick that ended
+ * sounded, ticks the timers and hands a changed display to the attached
+ * frame buffer, replay and video
+ */
+void end_frame(chip8 *c)
+{
+    PROFILE_FRAME(c);
+
+    if (c->audio != NULL) {
+        push_audio_tick(c->audio, c->ST > 0);
+    }
+
+    tick_timers(c);
+
+    if ((c->frame_buffer == NULL && c->replay == NULL && c->video == NULL) || take_dirty_rows(c) == 0) {
+        return;
+    }
+
+    if (c->frame_buffer != NULL) {
+        publish_frame(c->frame_buffer, c);
+    }
+    if (c->replay != NULL) {
+        replay_frame(c->replay, c);
+    }
+    if (c->video != NULL) {
+        push_video_frame(c->video, c);
+    }
+}
+
+/* One 60 Hz tick, decrements both timers once */
+void tick_timers(chip8 *c)
+{
+    if (c->DT > 0) {
+        c->DT--;
+    }
+
+    if (c->ST > 0) {
+        c->ST--;
+    }
+}
+
+static inline __attribute__((always_inline)) unsigned long skip_idle_in(chip8 *c, unsigned long n, unsigned short mask);
+
+/* Interpreter loop, instantiated once for the classic machine with its
+ * memory size and decode table as constants and once for the extended
+ * profiles, which read them from the machine
+ */
+static inline __attribute__((always_inline)) void interpret(chip8 *c, unsigned long n, unsigned short mask, const chip8_insn *table)
+{
+    for (unsigned long i = 0; i < n; ) {
+        unsigned long skipped = skip_idle_in(c, n - i, mask);
+
+        if (skipped > 0) {
+            i += skipped;
+            continue;
         }
 
-        if (c->ST > 0 && SDL_GetTicks() % 16 == 0) {
-            fprintf(stdout, "\aBeep!\n");
-            c->ST--;
-        } else {
-            c->ST = 0;
+        execute_decoded(c, fetch_from(c, mask, table));
+        i++;
+    }
+}
+
+void run_cycles(chip8 *c, unsigned long n)
+{
+    if (c->engine == CHIP8_ENGINE_THREADED) {
+        run_blocks(c, n);
+        return;
+    }
+
+    /* the classic machine with its own quirks runs with both as constants */
+    if (c->decode == decode_table) {
+        interpret(c, n, MAX_MEMORY - 1, decode_table);
+    } else {
+        interpret(c, n, c->memory_mask, c->decode);
+    }
+}
+
+bool waiting_for_key(chip8 *c)
+{
+    return c->pause && c->key_flag < 0;
+}
+
+void press_key(chip8 *c, unsigned char key)
+{
+    if (c->replay != NULL) {
+        replay_key(c->replay, get_frame(c), key, true);
+    }
+
+    set_key_value(c, key & 0xF, 1);
+
+    /* latched for a pending Fx0A */
+    c->key_flag = key & 0xF;
+}
+
+void release_key(chip8 *c, unsigned char key)
+{
+    if (c->replay != NULL) {
+        replay_key(c->replay, get_frame(c), key, false);
+    }
+
+    set_key_value(c, key & 0xF, 0);
+}
+
+/* Per-instance generator for Cxnn, xorshift64* seeded through splitmix64 so
+ * that every seed, 0 included, gives a usable state
+ */
+void seed_random(chip8 *c, uint64_t seed)
+{
+    uint64_t z = seed + 0x9E3779B97F4A7C15ULL;
+
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z =  z ^ (z >> 31);
+
+    c->rng = z != 0 ? z : 1;
+}
+
+unsigned char next_random(chip8 *c)
+{
+    c->rng ^= c->rng >> 12;
+    c->rng ^= c->rng << 25;
+    c->rng ^= c->rng >> 27;
+
+    return (c->rng * 0x2545F4914F6CDD1DULL) >> 56;
+}
+
+/* Number of 60 Hz frames completed so far */
+unsigned long get_frame(chip8 *c)
+{
+    return c->cycles / c->cycles_per_frame;
+}
+
+/* Account for n instructions that change nothing but the counters */
+static void advance_cycles(chip8 *c, unsigned long n)
+{
+    PROFILE_IDLE(c, n);
+
+    if (c->trace != NULL) {
+        trace_idle(c->trace, c, c->PC, n);
+    }
+
+    while (n > 0) {
+        unsigned long k = n < c->frame_left ? n : c->frame_left;
+
+        c->cycles     += k;
+        c->frame_left -= k;
+        n             -= k;
+
+        if (c->frame_left == 0) {
+            c->frame_left = c->cycles_per_frame;
+            end_frame(c);
         }
     }
 }
 
-/* TODO: fix this shit */
-void load_file(chip8 *c, const char *s)
+/* Where execution resumes after a 1nnn */
+static unsigned short jump_target(const chip8_insn *in)
 {
-    FILE *fp;
+    return in->nnn & (MAX_MEMORY - 1);
+}
 
-    // check for valid file pointer
-    if ((fp = fopen(s, "r")) == NULL) {
-        fprintf(stderr, "unable to open %s for reading\n", s);
-        exit(1);
+static const chip8_insn *decoded_at(chip8 *c, unsigned short addr, unsigned short mask)
+{
+    return &c->decode[(read_byte(c, addr, mask) << 8) | read_byte(c, addr + 1, mask)];
+}
+
+unsigned long skip_idle(chip8 *c, unsigned long n)
+{
+    return skip_idle_in(c, n, c->memory_mask);
+}
+
+static inline __attribute__((always_inline)) unsigned long skip_idle_in(chip8 *c, unsigned long n, unsigned short mask)
+{
+    /* Fx0A with no key pending, only the frontend can end the wait and it
+     * doesn't run before we return
+     */
+    if (waiting_for_key(c)) {
+        advance_cycles(c, n);
+        return n;
     }
 
-    // temporary memory value, file char input
-    unsigned char temp = 0;
-    unsigned char hex  = 0;
+    unsigned short pc = c->PC & mask;
 
-    // base exponent
-    int  counter = 1;
-    set_pc(c, 0x200);
+    /* cheap reject, the poll loop starts with Fx07 */
+    if ((read_byte(c, pc, mask) & 0xF0) != 0xF0 || read_byte(c, pc + 1, mask) != 0x07) {
+        return 0;
+    }
 
-    // iterate over each character
-    while (hex != EOF) {
-        hex = fgetc(fp);
+    const chip8_insn *load = decoded_at(c, pc, mask);
+    const chip8_insn *test = decoded_at(c, pc + 2, mask);
+    const chip8_insn *loop = decoded_at(c, pc + 4, mask);
 
-        if (hex == EOF)
-            break;
+    if (load->op != op_Fx07 || test->x != load->x || loop->op != op_1nnn || jump_target(loop) != pc) {
+        return 0;
+    }
+
+    /* does this iteration jump back, DT can't change before the next tick */
+    bool again;
+    if (test->op == op_3xnn) {
+        again = c->DT != test->nn;
+    } else if (test->op == op_4xnn) {
+        again = c->DT == test->nn;
+    } else {
+        return 0;
+    }
+
+    /* every iteration before the tick ends exactly where it started, skip
+     * them all and leave the one the tick lands in to the interpreter
+     */
+    unsigned long limit      = n < c->frame_left - 1 ? n : c->frame_left - 1;
+    unsigned long iterations = again ? limit / 3 : 0;
+
+    if (iterations == 0) {
+        return 0;
+    }
+
+    set_reg_value(c, load->x, c->DT);
+    c->opcode = loop->opcode;
+    advance_cycles(c, iterations * 3);
+
+    return iterations * 3;
+}
+
+void set_engine(chip8 *c, chip8_engine engine)
+{
+    if (engine == CHIP8_ENGINE_THREADED && c->blocks == NULL) {
+        c->blocks = create_blocks();
+    } else if (engine == CHIP8_ENGINE_INTERPRETER && c->blocks != NULL) {
+        destroy_blocks(c->blocks);
+        c->blocks = NULL;
+    }
+
+    c->engine = engine;
+}
+
+static const char *engine_names[] = { "interpreter", "threaded" };
+static const int   engine_count   = sizeof(engine_names) / sizeof(engine_names[0]);
+
+bool find_engine(const char *name, chip8_engine *engine)
+{
+    for (int i = 0; i < engine_count; i++) {
+        if (strcmp(engine_names[i], name) == 0) {
+            *engine = i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+const char *get_engine_name(chip8_engine engine)
+{
+    return engine < engine_count ? engine_names[engine] : "unknown";
+}
+
+/* Value of a hexadecimal digit, -1 for anything else */
+static int hex_value(unsigned char ch)
+{
+    if (ch >= '0' && ch <= '9') {
+        return ch - '0';
+    }
+
+    ch = tolower(ch);
+    if (ch >= 'a' && ch <= 'f') {
+        return ch - 'a' + 10;
+    }
+
+    return -1;
+}
 
-        printf("%x\n", hex);
-        // if letter or digit
-        if ((hex >= '0' && hex <= '9') || (tolower(hex) >= 'a' && tolower(hex) <= 'f')) {
-            // convert every byte from ASCII to numerical values
-            if (tolower(hex) >= 'a' && tolower(hex) <= 'f') {
-                temp += (tolower(hex) - 'a' + 10) * pow(16.f, counter);
-            } else {
-                temp += ((hex - '0') * pow(16.f, counter));
+/* Legacy ROMs are ASCII hex digits separated by whitespace */
+static bool is_hex_text(const unsigned char *data, size_t size)
+{
+    bool digits = false;
+
+    for (size_t i = 0; i < size; i++) {
+        if (hex_value(data[i]) >= 0) {
+            digits = true;
+        } else if (!isspace(data[i])) {
+            return false;
+        }
+    }
+
+    return digits;
+}
+
+chip8_load_result load_rom(chip8 *c, const unsigned char *data, size_t size)
+{
+    /* XO-CHIP programs may fill all 64 KB */
+    size_t max_program = get_memory_size(c) - PROGRAM_START;
+
+    if (size == 0) {
+        return CHIP8_LOAD_EMPTY;
+    }
+
+    if (is_hex_text(data, size)) {
+        unsigned char program[XO_MEMORY - PROGRAM_START];
+        size_t length = 0;
+        int    high   = -1;
+
+        for (size_t i = 0; i < size; i++) {
+            int nibble = hex_value(data[i]);
+
+            // whitespace between bytes
+            if (nibble < 0) {
+                continue;
             }
+
             // MSB -> LSB (left -> right)
-            counter--;
-
-            // have iterated over at least one byte
-            if (counter == -1) {
-                // printf("%x\n", temp);
-                // reset base exponent
-                counter = 1;
-                // store the program data in memory
-                c->memory[get_pc(c)] = temp;
-                // increment the PC by one b/c we're going one byte at a time
-                set_pc(c, get_pc(c) + 1);
-                // reset the temp memory value
-                temp = 0;
+            if (high < 0) {
+                high = nibble;
+                continue;
             }
+
+            if (length == max_program) {
+                return CHIP8_LOAD_TOO_LARGE;
+            }
+
+            program[length++] = (high << 4) | nibble;
+            high = -1;
+        }
+
+        // a dangling digit is half a byte
+        if (high >= 0) {
+            return CHIP8_LOAD_BAD_HEX;
+        }
+
+        write_memory(c, PROGRAM_START, program, length);
+    } else {
+        if (size > max_program) {
+            return CHIP8_LOAD_TOO_LARGE;
         }
+
+        write_memory(c, PROGRAM_START, data, size);
+    }
+
+    set_pc(c, PROGRAM_START);
+
+    /* the program data replaced whatever was decoded before, and the pages
+     * the last program rewrote are code like any other for this one
+     */
+    clear_icache(c);
+    if (c->blocks != NULL) {
+        reset_blocks(c->blocks);
     }
 
-    set_pc(c, 0x200);
-    fclose(fp);
+    return CHIP8_LOAD_OK;
+}
+
+chip8_load_result load_file(chip8 *c, const char *s)
+{
+    struct stat st;
+    int fd;
+
+    // check for valid file descriptor
+    if ((fd = open(s, O_RDONLY)) < 0) {
+        return CHIP8_LOAD_OPEN;
+    }
+
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return CHIP8_LOAD_READ;
+    }
+
+    if (st.st_size == 0) {
+        close(fd);
+        return CHIP8_LOAD_EMPTY;
+    }
+
+    /* hex text is at most a few bytes per program byte, anything much
+     * larger can't fit the program window in either format
+     */
+    if (st.st_size > (off_t) (get_memory_size(c) - PROGRAM_START) * 16) {
+        close(fd);
+        return CHIP8_LOAD_TOO_LARGE;
+    }
+
+    // map the whole image at once, the loader only reads it front to back
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        return CHIP8_LOAD_READ;
+    }
+
+    chip8_load_result result = load_rom(c, data, st.st_size);
+    munmap(data, st.st_size);
+
+    return result;
+}
+
+const char *get_load_error(chip8_load_result result)
+{
+    switch (result) {
+        case CHIP8_LOAD_OK:        return "ok";
+        case CHIP8_LOAD_OPEN:      return "unable to open file";
+        case CHIP8_LOAD_READ:      return "unable to read file";
+        case CHIP8_LOAD_EMPTY:     return "empty ROM";
+        case CHIP8_LOAD_TOO_LARGE: return "ROM does not fit between 0x200 and the end of memory";
+        case CHIP8_LOAD_BAD_HEX:   return "odd number of hex digits";
+    }
+
+    return "unknown error";
 }
 
 /* Getters */
@@ -355,14 +1131,26 @@ unsigned char  get_reg_value(chip8 *c, unsigned int i)
     return c->V[i]; 
 }
 
-unsigned char  get_addr(chip8 *c)
+unsigned short get_addr(chip8 *c)
 {
     return c->I;
 }
 
 unsigned char  get_addr_value(chip8 *c)
 {
-    return c->memory[get_addr(c)];
+    return get_memory_value(c, get_addr(c));
+}
+
+unsigned char  get_memory_value(chip8 *c, unsigned short addr)
+{
+    return read_byte(c, addr, c->memory_mask);
+}
+
+void read_memory(chip8 *c, unsigned short addr, unsigned char *data, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        data[i] = get_memory_value(c, addr + i);
+    }
 }
 
 unsigned short get_pc(chip8 *c)
@@ -377,12 +1165,75 @@ unsigned short get_sp(chip8 *c)
 
 unsigned short get_stack_top(chip8 *c)
 {
-    return c->stack[c->SP];
+    return c->stack[c->SP & 0xF];
+}
+
+size_t get_memory_size(chip8 *c)
+{
+    return c->variant == CHIP8_VARIANT_XOCHIP ? XO_MEMORY : MAX_MEMORY;
 }
 
+unsigned int get_display_width(chip8 *c)
+{
+    return c->variant == CHIP8_VARIANT_CHIP8 ? W_WIDTH : HIRES_WIDTH;
+}
+
+unsigned int get_display_height(chip8 *c)
+{
+    return c->variant == CHIP8_VARIANT_CHIP8 ? W_HEIGHT : HIRES_HEIGHT;
+}
+
+/* Pixel at x, y, on the extended machines the bit of every plane, plane 1 lowest */
 unsigned char  get_display_value(chip8 *c, unsigned int x, unsigned int y)
 {
-    return c->display[x + y * W_WIDTH];
+    if (c->display->planes == NULL) {
+        return (c->display->rows[y] >> (W_WIDTH - 1 - x)) & 1;
+    }
+
+    unsigned char value = 0;
+
+    for (int p = 0; p < MAX_PLANES; p++) {
+        value |= ((c->display->planes[p][y][x / 64] >> (63 - x % 64)) & 1) << p;
+    }
+
+    return value;
+}
+
+uint64_t take_dirty_rows(chip8 *c)
+{
+    uint64_t rows = c->dirty_rows;
+    c->dirty_rows = 0;
+
+    if (c->extended != NULL) {
+        rows |= c->extended->dirty_rows;
+        c->extended->dirty_rows = 0;
+    }
+
+    return rows;
+}
+
+static uint64_t hash_words(uint64_t hash, const uint64_t *words, size_t n)
+{
+    for (size_t k = 0; k < n; k++) {
+        for (int i = 0; i < 8; i++) {
+            hash ^= (words[k] >> (i * 8)) & 0xFF;
+            hash *= 0x100000001b3ULL;
+        }
+    }
+
+    return hash;
+}
+
+uint64_t get_display_hash(chip8 *c)
+{
+    /* FNV-1a over the packed display rows */
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    if (c->display->planes == NULL) {
+        return hash_words(hash, c->display->rows, W_HEIGHT);
+    }
+
+    return hash_words(hash, &c->display->planes[0][0][0], MAX_PLANES * HIRES_HEIGHT * HIRES_WORDS);
 }
 
 unsigned char *get_keys(chip8 *c)
@@ -392,7 +1243,8 @@ unsigned char *get_keys(chip8 *c)
 
 unsigned char  get_key_value(chip8 *c, unsigned int i)
 {
-    return c->keys[i];
+    /* Ex9E and ExA1 only look at the low nibble of VX */
+    return c->keys[i & 0xF];
 }
 
 unsigned short get_opcode(chip8 *c)
@@ -407,12 +1259,12 @@ unsigned short get_opcode_nnn(chip8 *c)
 
 unsigned char  get_opcode_x(chip8 *c)
 {
-    return c->opcode & 0x0F00 >> 8;
+    return (c->opcode & 0x0F00) >> 8;
 }
 
 unsigned char  get_opcode_y(chip8 *c)
 {
-    return c->opcode & 0x00F0 >> 4;
+    return (c->opcode & 0x00F0) >> 4;
 }
 
 unsigned char  get_opcode_nn(chip8 *c)
@@ -443,7 +1295,28 @@ void set_reg_value(chip8 *c, unsigned int i, unsigned char n)
 
 void set_addr_value(chip8 *c, unsigned char n)
 {
-    c->memory[get_addr(c)] = n;
+    set_memory_value(c, get_addr(c), n);
+}
+
+void set_memory_value(chip8 *c, unsigned short addr, unsigned char n)
+{
+    addr &= c->memory_mask;
+
+    chip8_page *p = unshare_page(c, addr / MEMORY_PAGE_SIZE);
+    p->data[addr % MEMORY_PAGE_SIZE] = n;
+
+    if (c->trace != NULL) {
+        trace_store(c->trace, addr, n);
+    }
+
+    invalidate_icache(c, addr);
+}
+
+void write_memory(chip8 *c, unsigned short addr, const unsigned char *data, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        set_memory_value(c, addr + i, data[i]);
+    }
 }
 
 void set_addr(chip8 *c, unsigned short i)
@@ -461,6 +1334,12 @@ void pc_increment(chip8 *c)
     c->PC += 2;
 }
 
+void jump(chip8 *c, unsigned short addr)
+{
+    /* end_instruction steps past the jump, stop one instruction short */
+    c->PC = (addr - 2) & 0xFFFF;
+}
+
 void sp_increment(chip8 *c)
 {
     c->SP++;
@@ -473,14 +1352,15 @@ void sp_decrement(chip8 *c)
 
 void stack_pop(chip8 *c)
 {
-    c->stack[get_sp(c)] = 0;
+    c->stack[get_sp(c) & 0xF] = 0;
     sp_decrement(c);
 }
 
 void stack_push(chip8 *c, unsigned short n)
 {
     sp_increment(c);
-    c->stack[get_sp(c)] = n;
+    /* the stack has 16 entries, deeper calls wrap around */
+    c->stack[get_sp(c) & 0xF] = n;
 }
 
 void set_key_value(chip8 *c, unsigned int i, unsigned char n)
@@ -500,276 +1380,272 @@ void set_st(chip8 *c, unsigned char n)
 
 bool set_display_value(chip8 *c, unsigned int x, unsigned int y, unsigned char n)
 {
-    unsigned char temp = get_display_value(c, x, y);
-    c->display[x + (y * W_WIDTH)] ^= n;
+    uint64_t pixel = (uint64_t) (n & 1) << (W_WIDTH - 1 - x);
+    uint64_t temp  = c->display->rows[y];
 
-    // pixel got erased
-    if ((temp == 1 && get_display_value(c, x, y) == 0)) {
-        return 1;
-    }
+    unshare_display(c);
+    c->display->rows[y] ^= pixel;
+    c->dirty_rows |= 1u << y;
 
-    return 0;
+    // pixel got erased
+    return (temp & pixel) != 0;
 }
 
 /* Instructions */
-void  op_00E0(chip8 *c)
+void  op_nop(chip8 *c, const chip8_insn *in)
 {
-    clear_display(c);
 }
 
-void  op_00EE(chip8 *c)
+void  op_00E0(chip8 *c, const chip8_insn *in)
+{
+    clear_rows(c);
+}
+
+void  op_00EE(chip8 *c, const chip8_insn *in)
 {
     set_pc(c, get_stack_top(c));
     stack_pop(c);
 }
 
-void  op_1nnn(chip8 *c)
+void  op_1nnn(chip8 *c, const chip8_insn *in)
 {
-    set_pc(c, get_opcode_nnn(c));
+    jump(c, in->nnn);
 }
 
-void  op_2nnn(chip8 *c)
+void  op_2nnn(chip8 *c, const chip8_insn *in)
 {
+    // 00EE returns here and end_instruction steps past the call
     stack_push(c, get_pc(c));
-    set_pc(c, get_opcode_nnn(c));
+    jump(c, in->nnn);
 }
 
-void  op_3xnn(chip8 *c)
+void  op_3xnn(chip8 *c, const chip8_insn *in)
 {
-    if (get_reg_value(c, get_opcode_x(c)) == get_opcode_nn(c)) {
+    if (get_reg_value(c, in->x) == in->nn) {
         pc_increment(c);
     }
 }
 
-void  op_4xnn(chip8 *c)
+void  op_4xnn(chip8 *c, const chip8_insn *in)
 {
-    if (get_reg_value(c, get_opcode_x(c)) != get_opcode_nn(c)) {
+    if (get_reg_value(c, in->x) != in->nn) {
         pc_increment(c);
     }
 }
 
-void  op_5xy0(chip8 *c)
+void  op_5xy0(chip8 *c, const chip8_insn *in)
 {
-    if (get_reg_value(c, get_opcode_x(c)) == get_reg_value(c, get_opcode_y(c))) {
+    if (get_reg_value(c, in->x) == get_reg_value(c, in->y)) {
         pc_increment(c);
     }
 }
 
-void  op_6xnn(chip8 *c)
+void  op_6xnn(chip8 *c, const chip8_insn *in)
 {
-    set_reg_value(c, get_opcode_x(c), get_opcode_nn(c));
+    set_reg_value(c, in->x, in->nn);
 }
 
-void  op_7xnn(chip8 *c)
+void  op_7xnn(chip8 *c, const chip8_insn *in)
 {
-    set_reg_value(c, get_opcode_x(c), get_opcode_nn(c));
+    // no carry flag
+    set_reg_value(c, in->x, get_reg_value(c, in->x) + in->nn);
 }
 
-void  op_8xy0(chip8 *c, unsigned char a, unsigned char b)
+void  op_8xy0(chip8 *c, const chip8_insn *in)
 {
-    set_reg_value(c, get_opcode_x(c), b);
+    set_reg_value(c, in->x, get_reg_value(c, in->y));
 }
 
-void  op_8xy1(chip8 *c, unsigned char a, unsigned char b)
+void  op_8xy1(chip8 *c, const chip8_insn *in)
 {
-    set_reg_value(c, get_opcode_x(c), a | b);
+    set_reg_value(c, in->x, get_reg_value(c, in->x) | get_reg_value(c, in->y));
 }
 
-void  op_8xy2(chip8 *c, unsigned char a, unsigned char b)
+void  op_8xy2(chip8 *c, const chip8_insn *in)
 {
-    set_reg_value(c, get_opcode_x(c), a & b);
+    set_reg_value(c, in->x, get_reg_value(c, in->x) & get_reg_value(c, in->y));
 }
 
-void  op_8xy3(chip8 *c, unsigned char a, unsigned char b)
+void  op_8xy3(chip8 *c, const chip8_insn *in)
 {
-    set_reg_value(c, get_opcode_x(c), a ^ b);
+    set_reg_value(c, in->x, get_reg_value(c, in->x) ^ get_reg_value(c, in->y));
 }
 
-void  op_8xy4(chip8 *c, unsigned char a, unsigned char b)
+void  op_8xy4(chip8 *c, const chip8_insn *in)
 {
-    if (a + b >= 256) {
-        set_reg_value(c, 0xF, 1);
-    } else {
-        set_reg_value(c, 0xF, 0);
-    }
-    set_reg_value(c, get_opcode_x(c), (a + b) % 256);
+    unsigned char a = get_reg_value(c, in->x);
+    unsigned char b = get_reg_value(c, in->y);
+
+    // the flag is written last, it wins when x is F
+    set_reg_value(c, in->x, (a + b) % 256);
+    set_reg_value(c, 0xF, a + b >= 256);
 }
 
-void  op_8xy5(chip8 *c, unsigned char a, unsigned char b)
+void  op_8xy5(chip8 *c, const chip8_insn *in)
 {
-    // check the carry flag
-    if (a < b) {
-        set_reg_value(c, 0xF, 1);
-    } else {
-        set_reg_value(c, 0xF, 0);
-    }
-    set_reg_value(c, get_opcode_x(c), a - b); // set Vx = Vx - Vy
+    unsigned char a = get_reg_value(c, in->x);
+    unsigned char b = get_reg_value(c, in->y);
+
+    set_reg_value(c, in->x, a - b); // set Vx = Vx - Vy
+    set_reg_value(c, 0xF, a >= b);  // VF is 1 when there is no borrow
 }
 
-void  op_8xy6(chip8 *c, unsigned char n)
+void  op_8xy6(chip8 *c, const chip8_insn *in)
 {
-    if (n & 0x1 == 1) {
-        set_reg_value(c, 0xF, 1);
-    } else {
-        set_reg_value(c, 0xF, 0);
-    }
+    unsigned char n = get_reg_value(c, in->y);
 
-    set_reg_value(c, get_opcode_x(c), n >> 1);
+    set_reg_value(c, in->x, n >> 1);
+    set_reg_value(c, 0xF, n & 0x01);
 }
 
-void  op_8xy7(chip8 *c, unsigned char a, unsigned char b)
+void  op_8xy7(chip8 *c, const chip8_insn *in)
 {
-    if (b < a) {
-        set_reg_value(c, 0xF, 1);
-    } else {
-        set_reg_value(c, 0xF, 0);
-    }
+    unsigned char a = get_reg_value(c, in->x);
+    unsigned char b = get_reg_value(c, in->y);
 
-    set_reg_value(c, get_opcode_x(c), b - a);
+    set_reg_value(c, in->x, b - a);
+    set_reg_value(c, 0xF, b >= a);
 }
 
-void  op_8xyE(chip8 *c, unsigned char n)
+void  op_8xyE(chip8 *c, const chip8_insn *in)
 {
-    if (n & 0x80 == 1) {
-        set_reg_value(c, 0x000F, 1);
-    } else {
-        set_reg_value(c, 0x000F, 0);
-    }
+    unsigned char n = get_reg_value(c, in->y);
 
-    set_reg_value(c, get_opcode_x(c), n << 1);
+    set_reg_value(c, in->x, n << 1);
+    set_reg_value(c, 0xF, (n & 0x80) != 0);
 }
 
-void  op_9xy0(chip8 *c)
+void  op_9xy0(chip8 *c, const chip8_insn *in)
 {
-    if (get_reg_value(c, get_opcode_x(c)) != get_reg_value(c, get_opcode_y(c))) {
+    if (get_reg_value(c, in->x) != get_reg_value(c, in->y)) {
         pc_increment(c);
     }
 }
 
-void  op_Annn(chip8 *c)
+void  op_Annn(chip8 *c, const chip8_insn *in)
 {
-    set_addr(c, get_opcode_nnn(c));
+    set_addr(c, in->nnn);
 }
 
-void  op_Bnnn(chip8 *c)
+void  op_Bnnn(chip8 *c, const chip8_insn *in)
 {
-    set_pc(c, get_opcode_nnn(c) + get_reg_value(c, 0));
+    jump(c, in->nnn + get_reg_value(c, 0));
 }
 
-void  op_Cxnn(chip8 *c)
+void  op_Cxnn(chip8 *c, const chip8_insn *in)
 {
-    unsigned char n = rand() % 256;
-    set_reg_value(c, get_opcode_x(c), n & get_opcode_nn(c));
+    set_reg_value(c, in->x, next_random(c) & in->nn);
 }
 
-void  op_Dxyn(chip8 *c)
+void  op_Dxyn(chip8 *c, const chip8_insn *in)
 {
-    unsigned char n = c->opcode & 0xF;
-    unsigned char x = get_reg_value(c, get_opcode_x(c));
-    unsigned char y = get_reg_value(c, get_opcode_y(c));
+    unsigned int x = get_reg_value(c, in->x) % W_WIDTH;
+    unsigned int y = get_reg_value(c, in->y) % W_HEIGHT;
+    uint64_t erased = 0;
 
-    unsigned char pos_x[8] = {
-         x,
-        (x + 1) % (W_WIDTH * W_HEIGHT),
-        (x + 2) % (W_WIDTH * W_HEIGHT),
-        (x + 3) % (W_WIDTH * W_HEIGHT),
-        (x + 4) % (W_WIDTH * W_HEIGHT),
-        (x + 5) % (W_WIDTH * W_HEIGHT),
-        (x + 6) % (W_WIDTH * W_HEIGHT),
-        (x + 7) % (W_WIDTH * W_HEIGHT)
-    };
+    // a forked machine gets its own display on its first draw
+    unshare_display(c);
 
     // iterate over n-bytes of the sprite in memory
-    for (int i = get_addr(c); i < get_addr(c) + n; i++) {
-        // char sprite_data = ;
-        unsigned char sprite_data = c->memory[i];
-        bool collision = 0;
+    for (int i = 0; i < in->n; i++) {
+        // the width of a sprite is always 8 bits in Chip-8, leftmost pixel in the top bit
+        uint64_t sprite = (uint64_t) read_byte(c, get_addr(c) + i, MAX_MEMORY - 1) << (W_WIDTH - 8);
+
+        // move the sprite to column x, pixels past the right edge wrap around
+        if (x != 0) {
+            sprite = (sprite >> x) | (sprite << (W_WIDTH - x));
+        }
 
-        // the width of a fontset sprite is always 8 bits in Chip-8
-        collision |= set_display_value(c, pos_x[0], y, (sprite_data & 0x80) >> 7); 
-        collision |= set_display_value(c, pos_x[1], y, (sprite_data & 0x40) >> 6);
-        collision |= set_display_value(c, pos_x[2], y, (sprite_data & 0x20) >> 5);
-        collision |= set_display_value(c, pos_x[3], y, (sprite_data & 0x10) >> 4);
-        collision |= set_display_value(c, pos_x[4], y, (sprite_data & 0x08) >> 3);
-        collision |= set_display_value(c, pos_x[5], y, (sprite_data & 0x04) >> 2);
-        collision |= set_display_value(c, pos_x[6], y, (sprite_data & 0x02) >> 1);
-        collision |= set_display_value(c, pos_x[7], y, (sprite_data & 0x01));
+        uint64_t *row = &c->display->rows[(y + i) % W_HEIGHT];
 
-        set_reg_value(c, 0xF, collision);
+        erased |= *row & sprite;
+        *row   ^= sprite;
 
-        y = (y + 1) % (W_WIDTH * W_HEIGHT);
+        // only rows that actually changed need to be presented again
+        if (sprite != 0) {
+            c->dirty_rows |= 1u << ((y + i) % W_HEIGHT);
+        }
     }
+
+    set_reg_value(c, 0xF, erased != 0);
 }
 
-void  op_Ex9E(chip8 *c)
+void  op_Ex9E(chip8 *c, const chip8_insn *in)
 {
-    pc_increment(c);
+    if (get_key_value(c, get_reg_value(c, in->x))) {
+        pc_increment(c);
+    }
 }
 
-void  op_ExA1(chip8 *c)
+void  op_ExA1(chip8 *c, const chip8_insn *in)
 {
-    pc_increment(c);
+    if (!get_key_value(c, get_reg_value(c, in->x))) {
+        pc_increment(c);
+    }
 }
 
-void  op_Fx07(chip8 *c)
+void  op_Fx07(chip8 *c, const chip8_insn *in)
 {
-    set_reg_value(c, get_opcode_x(c), get_dt(c));
+    set_reg_value(c, in->x, get_dt(c));
 }
 
-void  op_Fx0A(chip8 *c)
+void  op_Fx0A(chip8 *c, const chip8_insn *in)
 {
     c->pause = 1;
 
-    if (c->pause && c->key_flag > 0) {
-        set_reg_value(c, get_opcode_x(c), c->key_flag);
+    if (c->pause && c->key_flag >= 0) {
+        set_reg_value(c, in->x, c->key_flag);
         c->pause    =  0;
         c->key_flag = -1;
     }
 }
 
-void  op_Fx15(chip8 *c)
+void  op_Fx15(chip8 *c, const chip8_insn *in)
 {
-    set_dt(c, get_reg_value(c, get_opcode_x(c)));
+    set_dt(c, get_reg_value(c, in->x));
 }
 
-void  op_Fx18(chip8 *c)
+void  op_Fx18(chip8 *c, const chip8_insn *in)
 {
-    set_st(c, get_reg_value(c, get_opcode_x(c)));
+    set_st(c, get_reg_value(c, in->x));
 }
 
-void  op_Fx1E(chip8 *c)
+void  op_Fx1E(chip8 *c, const chip8_insn *in)
 {
-    unsigned short sum = get_reg_value(c, get_opcode_x(c)) + get_addr(c);
+    unsigned short sum = get_reg_value(c, in->x) + get_addr(c);
 
     set_addr(c, sum);
 }
 
-void  op_Fx29(chip8 *c)
+void  op_Fx29(chip8 *c, const chip8_insn *in)
 {
-    set_addr(c, 0x50 + get_reg_value(c, get_opcode_x(c)) * 5);
+    /* fontset starts at 0x50, translate that position by the value of Vx
+     * multiplied by the sprite width (5 bytes)
+     */
+    set_addr(c, FONT_START + get_reg_value(c, in->x) * 5);
 }
 
-void  op_Fx33(chip8 *c)
+void  op_Fx33(chip8 *c, const chip8_insn *in)
 {
-    unsigned char value = get_reg_value(c, get_opcode_x(c));
+    unsigned char value = get_reg_value(c, in->x);
 
-    c->memory[get_addr(c)]     = (value / 100) % 10;
-    c->memory[get_addr(c) + 1] = (value / 10) % 10;
-    c->memory[get_addr(c) + 2] = (value) % 10;
+    set_memory_value(c, get_addr(c),     (value / 100) % 10);
+    set_memory_value(c, get_addr(c) + 1, (value / 10) % 10);
+    set_memory_value(c, get_addr(c) + 2, (value) % 10);
 }
 
-void  op_Fx55(chip8 *c)
+void  op_Fx55(chip8 *c, const chip8_insn *in)
 {
-    for (int i = 0; i <= get_opcode_x(c); i++) {
-        c->memory[get_addr(c) + i] = get_reg_value(c, i);
+    for (int i = 0; i <= in->x; i++) {
+        set_memory_value(c, get_addr(c) + i, get_reg_value(c, i));
     }
-    set_addr(c, get_addr(c) + get_opcode_x(c) + 1);
+    set_addr(c, get_addr(c) + in->x + 1);
 }
 
-void  op_Fx65(chip8 *c)
+void  op_Fx65(chip8 *c, const chip8_insn *in)
 {
-    for (int i = 0; i <= get_opcode_x(c); i++) {
-        set_reg_value(c, i, c->memory[get_addr(c) + i]);
+    for (int i = 0; i <= in->x; i++) {
+        set_reg_value(c, i, read_byte(c, get_addr(c) + i, MAX_MEMORY - 1));
     }
-    set_addr(c, get_addr(c) + get_opcode_x(c) + 1);
+    set_addr(c, get_addr(c) + in->x + 1);
 }
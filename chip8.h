@@ -1,24 +1,168 @@
 #ifndef CHIP8_H
 #define CHIP8_H
 
-#include <math.h>
 #include <ctype.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
-#include <SDL2/SDL.h>
+#include <stdint.h>
+#include <stdatomic.h>
 
 #define MAX_MEMORY 4096
 #define W_WIDTH      64
 #define W_HEIGHT     32
 
-/* Fontset data */
+/* SUPER-CHIP and XO-CHIP display, 128x64 in up to two bit planes */
+#define HIRES_WIDTH   128
+#define HIRES_HEIGHT  64
+#define HIRES_WORDS   (HIRES_WIDTH / 64)
+#define MAX_PLANES    2
+#define PLANES_SIZE   (MAX_PLANES * HIRES_HEIGHT * HIRES_WORDS * sizeof(uint64_t))
+
+/* XO-CHIP memory, the whole 16-bit address space */
+#define XO_MEMORY  65536
+
+/* Bit mask with one bit per display row */
+#define ALL_ROWS        ((uint32_t) ((1ULL << W_HEIGHT) - 1))
+#define ALL_HIRES_ROWS  UINT64_MAX
+
+/* Memory is split into pages that forked machines share until written */
+#define MEMORY_PAGE_SIZE  256
+#define MEMORY_PAGES      (MAX_MEMORY / MEMORY_PAGE_SIZE)
+#define MAX_MEMORY_PAGES  (XO_MEMORY / MEMORY_PAGE_SIZE)
+
+/* Programs are loaded at 0x200 and may fill memory up to 0xFFF */
+#define PROGRAM_START  0x200
+#define MAX_PROGRAM    (MAX_MEMORY - PROGRAM_START)
+
+/* Fontset data, the 8x10 digits of SUPER-CHIP and XO-CHIP follow it */
 extern unsigned char fontset[];
+extern unsigned char bigfont[];
+
+#define FONT_START     0x50
+#define BIGFONT_START  0xA0
+
+/* Instructions executed per 60 Hz timer tick, 600 instructions a second */
+#define CYCLES_PER_FRAME  10
 
+struct chip8_t;
+struct chip8_insn_t;
+struct chip8_blocks_t;
+struct chip8_profile_t;
+struct chip8_frame_buffer_t;
+struct chip8_replay_t;
+struct chip8_trace_t;
+struct chip8_video_t;
+struct chip8_audio_t;
+
+/* Execution engines, selectable at runtime with set_engine */
+typedef enum chip8_engine_t {
+    /* fetch, decode and execute one instruction at a time */
+    CHIP8_ENGINE_INTERPRETER,
+    /* run translated basic blocks as threaded code, see block.h */
+    CHIP8_ENGINE_THREADED
+} chip8_engine;
+
+/* Machine profiles, selectable at runtime with set_variant. The extended
+ * machines decode through their own tables (see variant.h), so the classic
+ * one runs exactly the instruction set it always did.
+ */
+typedef enum chip8_variant_t {
+    /* the original 64x32 machine with 4 KB of memory */
+    CHIP8_VARIANT_CHIP8 = 0,
+    /* SUPER-CHIP 1.1, 128x64 hi-res, scrolling, 16x16 sprites, big font */
+    CHIP8_VARIANT_SCHIP,
+    /* XO-CHIP, SUPER-CHIP plus 64 KB of memory and two bit planes */
+    CHIP8_VARIANT_XOCHIP,
+    CHIP8_VARIANTS
+} chip8_variant;
+
+/* Behaviours ROMs disagree on, each bit moves one away from the classic
+ * machine. Every profile starts out with its own (see get_default_quirks)
+ * and set_quirks picks another combination, which gets a decode table of
+ * its own so the handlers never test them.
+ */
+typedef enum chip8_quirk_t {
+    /* 8xy6 8xyE shift VX in place rather than VY into VX */
+    CHIP8_QUIRK_SHIFT      = 0x01,
+    /* Fx55 Fx65 leave I alone rather than moving it past the last register */
+    CHIP8_QUIRK_LOAD_STORE = 0x02,
+    /* Bnnn jumps to xnn + VX rather than nnn + V0 */
+    CHIP8_QUIRK_JUMP       = 0x04,
+    /* Dxyn clips sprites at the edges rather than wrapping them around */
+    CHIP8_QUIRK_CLIP       = 0x08,
+    CHIP8_QUIRKS           = 0x10
+} chip8_quirk;
+
+/* Result of loading a ROM, see get_load_error for a description */
+typedef enum chip8_load_result_t {
+    CHIP8_LOAD_OK = 0,
+    CHIP8_LOAD_OPEN,
+    CHIP8_LOAD_READ,
+    CHIP8_LOAD_EMPTY,
+    CHIP8_LOAD_TOO_LARGE,
+    CHIP8_LOAD_BAD_HEX
+} chip8_load_result;
+
+/* Instruction handler, operands come pre-extracted from the decode table */
+typedef void (*chip8_op)(struct chip8_t *c, const struct chip8_insn_t *in);
+
+/* Pre-decoded instruction */
+typedef struct chip8_insn_t {
+    /* Handler for this opcode */
+    chip8_op       op;
+    /* Raw opcode and its operand fields */
+    unsigned short opcode;
+    unsigned short nnn;
+    unsigned char  x, y, n, nn;
+} chip8_insn;
+
+/* Reference counted page of memory, copied before a shared page is written */
+typedef struct chip8_page_t {
+    atomic_uint   refs;
+    /* Part of a batch pool, never freed on its own */
+    bool          pooled;
+    unsigned char data[MEMORY_PAGE_SIZE];
+} chip8_page;
+
+/* Reference counted display, one 64-bit word per row, leftmost pixel in the
+ * top bit, copied before a shared display is drawn to. The extended machines
+ * draw to planes instead, always at 128x64 (lo-res pixels are 2x2), two
+ * words per row with the left half first. The planes follow the display in
+ * the same allocation, a classic display has none.
+ */
+typedef struct chip8_display_t {
+    atomic_uint refs;
+    bool        pooled;
+    uint64_t    rows[W_HEIGHT];
+    uint64_t  (*planes)[HIRES_HEIGHT][HIRES_WORDS];
+} chip8_display;
+
+/* What only the extended machines need, kept off the machine so a classic
+ * one stays the size it always was
+ */
+typedef struct chip8_extended_t {
+    /* XO-CHIP memory past the first 4 KB, NULL on SUPER-CHIP */
+    chip8_page *pages[MAX_MEMORY_PAGES - MEMORY_PAGES];
+    /* Rows changed since the frontend last took them, bit y for row y */
+    uint64_t    dirty_rows;
+} chip8_extended;
+
+/* A machine must be zeroed (calloc) before its first initialize, which
+ * allocates the memory pages, display and instruction cache unless they were
+ * attached beforehand (see batch.h and chip8_fork). finalize releases
+ * whatever initialize and set_engine allocated. A zeroed machine is the
+ * classic one, set_variant switches profiles and initializes it again,
+ * which adds or drops the extended state and display planes.
+ * Quirks are kept across initialize, set_variant resets them to the
+ * profile's.
+ */
 typedef struct chip8_t {
-    /* Initialize the memory (4096 bytes) */
-    unsigned char memory[MAX_MEMORY];
+    /* Memory (4096 bytes) as 16 pages, private or shared with forks, the
+     * rest of XO-CHIP's is in extended
+     */
+    chip8_page *pages[MEMORY_PAGES];
     /* Variable for storing the current opcode (2 bytes) */
     unsigned short opcode;
     /* 16 8-bit general purpose registers, last register is the instruction flag */
@@ -35,27 +179,143 @@ typedef struct chip8_t {
     unsigned char keys[16];
     /* Delay and sound timer */
     unsigned char DT, ST;
-    /* Display */
-    unsigned char display[W_WIDTH * W_HEIGHT];
+    /* Display, private or shared with forks */
+    chip8_display *display;
+    /* Rows changed since the frontend last took them, bit y for row y, the
+     * extended machines' are in extended
+     */
+    uint32_t dirty_rows;
 
     char pause;
     char key_flag;
+
+    /* Number of instructions executed since initialize */
+    unsigned long cycles;
+    /* State of the Cxnn random number generator, see seed_random */
+    uint64_t rng;
+    /* Instructions per timer tick and how many are left until the next one,
+     * the timers follow the instruction count so runs stay deterministic
+     */
+    unsigned int cycles_per_frame;
+    unsigned int frame_left;
+
+    /* Machine profile, its quirks, its memory size less one and the decode
+     * table of the two
+     */
+    chip8_variant      variant;
+    unsigned char      quirks;
+    unsigned short     memory_mask;
+    const chip8_insn  *decode;
+    /* Extended machines, hi-res mode, planes drawn to (XO-CHIP) and the
+     * flag registers of Fx75/Fx85
+     */
+    bool           hires;
+    unsigned char  plane;
+    unsigned char  flags[16];
+    /* Their memory past 4 KB and display rows, NULL on the classic machine */
+    chip8_extended *extended;
+
+    /* Instruction cache, decoded instruction per address, NULL until the
+     * address is first executed or after a store touches its bytes. Only
+     * standalone machines have one.
+     */
+    const chip8_insn **icache;
+
+    /* Selected engine and the translated blocks of the threaded engine */
+    chip8_engine engine;
+    struct chip8_blocks_t *blocks;
+
+    /* Attached profile, only fed when built with CHIP8_PROFILE */
+    struct chip8_profile_t *profile;
+    /* Attached frame handoff, takes the dirty rows at every 60 Hz boundary
+     * (as do an attached replay and video)
+     */
+    struct chip8_frame_buffer_t *frame_buffer;
+    /* Attached replay, records or checks key events and frame hashes */
+    struct chip8_replay_t *replay;
+    /* Attached instruction trace */
+    struct chip8_trace_t *trace;
+    /* Attached video export, gets the changed frames like the frame handoff */
+    struct chip8_video_t *video;
+    /* Attached sound timer audio, told at every 60 Hz boundary whether ST ran */
+    struct chip8_audio_t *audio;
 } chip8;
 
+/* Where memory page i is kept, the pages past 4 KB are on the extended side.
+ * Reads masked to 4 KB never take the second branch, the compiler drops it.
+ */
+static inline chip8_page **get_page_slot(chip8 *c, unsigned int i)
+{
+    return i < MEMORY_PAGES ? &c->pages[i] : &c->extended->pages[i - MEMORY_PAGES];
+}
+
 /* Main operations */
 void  clear_display        (chip8 *c);
 void  initialize           (chip8 *c);
+void  finalize             (chip8 *c);
+void  chip8_fork           (chip8 *parent, chip8 *child);
 void  execute_instruction  (chip8 *c);
-void  load_file            (chip8 *c, const char *s);
+void  execute_decoded      (chip8 *c, const chip8_insn *in);
+void  end_instruction      (chip8 *c);
+void  run_cycles           (chip8 *c, unsigned long n);
+unsigned long skip_idle    (chip8 *c, unsigned long n);
+bool  waiting_for_key      (chip8 *c);
+void  press_key            (chip8 *c, unsigned char key);
+void  release_key          (chip8 *c, unsigned char key);
+unsigned long get_frame    (chip8 *c);
+void  seed_random          (chip8 *c, uint64_t seed);
+unsigned char next_random  (chip8 *c);
+void  set_engine           (chip8 *c, chip8_engine engine);
+/* interpreter or threaded, false for any other name */
+bool  find_engine          (const char *name, chip8_engine *engine);
+const char *get_engine_name (chip8_engine engine);
+void  end_frame            (chip8 *c);
+void  tick_timers          (chip8 *c);
+void  set_cycles_per_frame (chip8 *c, unsigned int n);
+void  set_variant          (chip8 *c, chip8_variant variant);
+/* Any combination of chip8_quirk, takes effect from the next instruction */
+void  set_quirks           (chip8 *c, unsigned int quirks);
+unsigned int get_default_quirks (chip8_variant variant);
+void  redraw_display       (chip8 *c);
+
+/* Loading, accepts raw binary images and the legacy ASCII hex format */
+chip8_load_result  load_file       (chip8 *c, const char *s);
+chip8_load_result  load_rom        (chip8 *c, const unsigned char *data, size_t size);
+const char        *get_load_error  (chip8_load_result result);
+
+/* Copy-on-write pages and display */
+chip8_page     *create_page      (void);
+void            release_page     (chip8_page *p);
+chip8_page     *unshare_page     (chip8 *c, unsigned int i);
+/* with the planes of the extended machines or without */
+chip8_display  *create_display   (bool planes);
+void            release_display  (chip8_display *d);
+void            unshare_display  (chip8 *c);
+
+/* Decoding */
+void              decode_opcode       (unsigned short opcode, chip8_insn *in);
+void              build_decode_table  (chip8_variant variant, unsigned int quirks);
+const chip8_insn *get_decoded         (unsigned short opcode);
+const chip8_insn *get_decode_table    (chip8_variant variant, unsigned int quirks);
+const chip8_insn *fetch_instruction   (chip8 *c);
+void              clear_icache        (chip8 *c);
+void              invalidate_icache   (chip8 *c, unsigned short addr);
 
 /* Getters */
 unsigned char    get_reg_value     (chip8 *c, unsigned int i);
-unsigned char    get_addr          (chip8 *c);
+unsigned short   get_addr          (chip8 *c);
 unsigned char    get_addr_value    (chip8 *c);
+unsigned char    get_memory_value  (chip8 *c, unsigned short addr);
+void             read_memory       (chip8 *c, unsigned short addr, unsigned char *data, size_t n);
 unsigned short   get_pc            (chip8 *c);
 unsigned short   get_sp            (chip8 *c);
 unsigned short   get_stack_top     (chip8 *c);
+size_t           get_memory_size   (chip8 *c);
+unsigned int     get_display_width (chip8 *c);
+unsigned int     get_display_height(chip8 *c);
 unsigned char    get_display_value (chip8 *c, unsigned int x, unsigned int y);
+uint64_t         get_display_hash  (chip8 *c);
+uint64_t         take_dirty_rows   (chip8 *c);
 unsigned char   *get_keys          (chip8 *c);
 unsigned char    get_key_value     (chip8 *c, unsigned int i);
 unsigned short   get_opcode        (chip8 *c);
@@ -70,9 +330,12 @@ bool             test_opcode       (chip8 *c, unsigned int bitmask, unsigned int
 /* Setters */
 void  set_reg_value      (chip8 *c, unsigned int i, unsigned char n);
 void  set_addr_value     (chip8 *c, unsigned char n);
+void  set_memory_value   (chip8 *c, unsigned short addr, unsigned char n);
+void  write_memory       (chip8 *c, unsigned short addr, const unsigned char *data, size_t n);
 void  set_addr           (chip8 *c, unsigned short i);
 void  set_pc             (chip8 *c, unsigned short n);
 void  pc_increment       (chip8 *c);
+void  jump               (chip8 *c, unsigned short addr);
 void  sp_increment       (chip8 *c);
 void  sp_decrement       (chip8 *c);
 void  stack_pop          (chip8 *c);
@@ -83,39 +346,40 @@ void  set_st             (chip8 *c, unsigned char n);
 bool  set_display_value  (chip8 *c, unsigned int x, unsigned int y, unsigned char n);
 
 /* Instructions */
-void  op_00E0(chip8 *c);
-void  op_00EE(chip8 *c);
-void  op_1nnn(chip8 *c);
-void  op_2nnn(chip8 *c);
-void  op_3xnn(chip8 *c);
-void  op_4xnn(chip8 *c);
-void  op_5xy0(chip8 *c);
-void  op_6xnn(chip8 *c);
-void  op_7xnn(chip8 *c);
-void  op_8xy0(chip8 *c, unsigned char a, unsigned char b);
-void  op_8xy1(chip8 *c, unsigned char a, unsigned char b);
-void  op_8xy2(chip8 *c, unsigned char a, unsigned char b);
-void  op_8xy3(chip8 *c, unsigned char a, unsigned char b);
-void  op_8xy4(chip8 *c, unsigned char a, unsigned char b);
-void  op_8xy5(chip8 *c, unsigned char a, unsigned char b);
-void  op_8xy6(chip8 *c, unsigned char n);
-void  op_8xy7(chip8 *c, unsigned char a, unsigned char b);
-void  op_8xyE(chip8 *c, unsigned char n);
-void  op_9xy0(chip8 *c);
-void  op_Annn(chip8 *c);
-void  op_Bnnn(chip8 *c);
-void  op_Cxnn(chip8 *c);
-void  op_Dxyn(chip8 *c);
-void  op_Ex9E(chip8 *c);
-void  op_ExA1(chip8 *c);
-void  op_Fx07(chip8 *c);
-void  op_Fx0A(chip8 *c);
-void  op_Fx15(chip8 *c);
-void  op_Fx18(chip8 *c);
-void  op_Fx1E(chip8 *c);
-void  op_Fx29(chip8 *c);
-void  op_Fx33(chip8 *c);
-void  op_Fx55(chip8 *c);
-void  op_Fx65(chip8 *c);
+void  op_nop (chip8 *c, const chip8_insn *in);
+void  op_00E0(chip8 *c, const chip8_insn *in);
+void  op_00EE(chip8 *c, const chip8_insn *in);
+void  op_1nnn(chip8 *c, const chip8_insn *in);
+void  op_2nnn(chip8 *c, const chip8_insn *in);
+void  op_3xnn(chip8 *c, const chip8_insn *in);
+void  op_4xnn(chip8 *c, const chip8_insn *in);
+void  op_5xy0(chip8 *c, const chip8_insn *in);
+void  op_6xnn(chip8 *c, const chip8_insn *in);
+void  op_7xnn(chip8 *c, const chip8_insn *in);
+void  op_8xy0(chip8 *c, const chip8_insn *in);
+void  op_8xy1(chip8 *c, const chip8_insn *in);
+void  op_8xy2(chip8 *c, const chip8_insn *in);
+void  op_8xy3(chip8 *c, const chip8_insn *in);
+void  op_8xy4(chip8 *c, const chip8_insn *in);
+void  op_8xy5(chip8 *c, const chip8_insn *in);
+void  op_8xy6(chip8 *c, const chip8_insn *in);
+void  op_8xy7(chip8 *c, const chip8_insn *in);
+void  op_8xyE(chip8 *c, const chip8_insn *in);
+void  op_9xy0(chip8 *c, const chip8_insn *in);
+void  op_Annn(chip8 *c, const chip8_insn *in);
+void  op_Bnnn(chip8 *c, const chip8_insn *in);
+void  op_Cxnn(chip8 *c, const chip8_insn *in);
+void  op_Dxyn(chip8 *c, const chip8_insn *in);
+void  op_Ex9E(chip8 *c, const chip8_insn *in);
+void  op_ExA1(chip8 *c, const chip8_insn *in);
+void  op_Fx07(chip8 *c, const chip8_insn *in);
+void  op_Fx0A(chip8 *c, const chip8_insn *in);
+void  op_Fx15(chip8 *c, const chip8_insn *in);
+void  op_Fx18(chip8 *c, const chip8_insn *in);
+void  op_Fx1E(chip8 *c, const chip8_insn *in);
+void  op_Fx29(chip8 *c, const chip8_insn *in);
+void  op_Fx33(chip8 *c, const chip8_insn *in);
+void  op_Fx55(chip8 *c, const chip8_insn *in);
+void  op_Fx65(chip8 *c, const chip8_insn *in);
 
 #endif
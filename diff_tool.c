@@ -0,0 +1,402 @@
+#include <string.h>
+#include <unistd.h>
+
+#include "chip8.h"
+#include "quirks.h"
+#include "reference.h"
+#include "variant.h"
+
+/* chip8-diff, runs an engine in lockstep with the reference executor (see
+ * reference.h) and compares registers, stack, timers, memory and display
+ * after every instruction. Stops each ROM at its first divergence and prints
+ * the instruction that caused it along with both states.
+ *
+ * usage: chip8-diff [-M chip8|schip|xochip] [-q quirks] [-e interpreter|threaded] [-c cycles]
+ *                   [-f cycles_per_frame] [-k step] [-n random_roms] [-S seed] [rom ...]
+ *
+ * -M and -q pick the machine profile and the quirks (see chip8_quirk) both
+ * sides run, the profile's own quirks unless -q is given.
+ *
+ * -n adds that many random programs to the ROMs given. The keypad is driven
+ * by the same seeded generator for both machines, so Fx0A waits end and the
+ * key skips take both branches.
+ *
+ * -k runs the engine that many instructions at a time (never across a frame
+ * boundary) so the threaded engine runs whole blocks and the idle skipping
+ * kicks in. A step that diverges is rerun from a fork one instruction at a
+ * time to find the instruction at fault.
+ *
+ * Exits with 1 if any ROM diverged.
+ */
+
+#define DEFAULT_CYCLES  100000UL
+#define RANDOM_SIZE     MAX_PROGRAM
+
+typedef struct options_t {
+    chip8_variant variant;
+    unsigned int  quirks;
+    chip8_engine  engine;
+    unsigned long cycles;
+    unsigned int  frame;
+    unsigned int  step;
+    uint64_t      seed;
+} options;
+
+static uint64_t next_seed     (uint64_t *state);
+static void     random_program(uint64_t *state, chip8_variant variant, unsigned char *data, size_t size);
+static bool     run_rom       (const options *o, const char *name, const unsigned char *data, size_t size, uint64_t seed);
+static bool     compare       (chip8 *c, chip8_ref *r, char *field, size_t size);
+static void     dump_machines (chip8 *c, chip8_ref *r);
+
+int main(int argc, char **argv)
+{
+    options o = { CHIP8_VARIANT_CHIP8, 0, CHIP8_ENGINE_INTERPRETER, DEFAULT_CYCLES, CYCLES_PER_FRAME, 1, 0 };
+    unsigned int randoms = 0;
+    const char  *quirks  = NULL;
+    bool         usage   = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "M:q:e:c:f:k:n:S:")) != -1) {
+        switch (opt) {
+            case 'M': usage |= !find_variant(optarg, &o.variant); break;
+            case 'q': quirks   = optarg; break;
+            case 'e': usage |= !find_engine(optarg, &o.engine); break;
+            case 'c': o.cycles = strtoul(optarg, NULL, 10); break;
+            case 'f': o.frame  = strtoul(optarg, NULL, 10); break;
+            case 'k': o.step   = strtoul(optarg, NULL, 10); break;
+            case 'n': randoms  = strtoul(optarg, NULL, 10); break;
+            case 'S': o.seed   = strtoull(optarg, NULL, 0); break;
+            default:  usage    = true; optind = argc; break;
+        }
+    }
+
+    o.quirks = get_default_quirks(o.variant);
+    if (quirks != NULL) {
+        usage |= !parse_quirks(quirks, &o.quirks);
+    }
+
+    if (usage || (optind == argc && randoms == 0) || o.frame == 0 || o.step == 0) {
+        fprintf(stderr, "usage: %s [-M chip8|schip|xochip] [-q quirks] [-e interpreter|threaded] [-c cycles]\n"
+                        "       [-f cycles_per_frame] [-k step] [-n random_roms] [-S seed] [rom ...]\n", argv[0]);
+        return 1;
+    }
+
+    uint64_t state = o.seed;
+    unsigned int failed = 0;
+
+    for (int i = optind; i < argc; i++) {
+        FILE *fp = fopen(argv[i], "rb");
+        unsigned char data[XO_MEMORY - PROGRAM_START];
+
+        if (fp == NULL) {
+            fprintf(stderr, "unable to open %s\n", argv[i]);
+            failed++;
+            continue;
+        }
+
+        size_t size = fread(data, 1, sizeof(data), fp);
+        fclose(fp);
+
+        failed += !run_rom(&o, argv[i], data, size, next_seed(&state));
+    }
+
+    for (unsigned int i = 0; i < randoms; i++) {
+        unsigned char data[RANDOM_SIZE];
+        char name[32];
+
+        random_program(&state, o.variant, data, sizeof(data));
+        snprintf(name, sizeof(name), "random-%u", i);
+
+        failed += !run_rom(&o, name, data, sizeof(data), next_seed(&state));
+    }
+
+    printf("%u of %u ROMs diverged\n", failed, argc - optind + randoms);
+
+    return failed > 0;
+}
+
+/* splitmix64, seeds for the programs, the keypad and Cxnn */
+static uint64_t next_seed(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+
+    return z ^ (z >> 31);
+}
+
+/* Instructions of the extended profiles with the bits left random, random
+ * bytes hardly ever hit them (F000 is one word in 65536). 00FD is left out,
+ * it would end the program.
+ */
+static const unsigned short extended_ops[][2] = {
+    { 0x00C0, 0x000F }, { 0x00D0, 0x000F }, { 0x00FB, 0x0000 }, { 0x00FC, 0x0000 },
+    { 0x00FE, 0x0000 }, { 0x00FF, 0x0000 }, { 0xD000, 0x0FF0 }, { 0xD000, 0x0FFF },
+    { 0x5002, 0x0FF0 }, { 0x5003, 0x0FF0 }, { 0xF000, 0x0000 }, { 0xF001, 0x0F00 },
+    { 0xF030, 0x0F00 }, { 0xF075, 0x0F00 }, { 0xF085, 0x0F00 }, { 0x00E0, 0x0000 }
+};
+
+/* Random bytes, for the extended profiles with about one word in four
+ * replaced by one of their instructions
+ */
+static void random_program(uint64_t *state, chip8_variant variant, unsigned char *data, size_t size)
+{
+    for (size_t i = 0; i < size; i += 8) {
+        uint64_t bits = next_seed(state);
+        memcpy(&data[i], &bits, 8);
+    }
+
+    if (variant == CHIP8_VARIANT_CHIP8) {
+        return;
+    }
+
+    for (size_t i = 0; i + 1 < size; i += 2) {
+        uint64_t bits = next_seed(state);
+
+        if ((bits & 3) != 0) {
+            continue;
+        }
+
+        const unsigned short *op = extended_ops[(bits >> 8) & 0xF];
+        unsigned short opcode = op[0] | ((bits >> 16) & op[1]);
+
+        data[i]     = opcode >> 8;
+        data[i + 1] = opcode & 0xFF;
+    }
+}
+
+/* Same key event for both machines, about one every eight frames */
+static void drive_keys(chip8 *c, chip8_ref *r, uint64_t *keys)
+{
+    uint64_t bits = next_seed(keys);
+
+    if ((bits & 7) != 0) {
+        return;
+    }
+
+    unsigned char key = (bits >> 8) & 0xF;
+
+    if (r->keys[key]) {
+        release_key(c, key);
+        release_reference_key(r, key);
+    } else {
+        press_key(c, key);
+        press_reference_key(r, key);
+    }
+}
+
+static void report(const char *name, chip8 *c, chip8_ref *r, unsigned short pc, unsigned short opcode, const char *field)
+{
+    printf("%s: diverged at instruction %lu, PC %03x opcode %04x, %s differs\n",
+           name, r->cycles, pc, opcode, field);
+    dump_machines(c, r);
+}
+
+static bool run_rom(const options *o, const char *name, const unsigned char *data, size_t size, uint64_t seed)
+{
+    chip8    *c = calloc(1, sizeof(chip8));
+    chip8     saved = { 0 };
+    chip8_ref r, saved_r;
+    char      field[64];
+    bool      ok = true;
+
+    set_variant(c, o->variant);
+    set_quirks(c, o->quirks);
+    set_cycles_per_frame(c, o->frame);
+
+    chip8_load_result result = load_rom(c, data, size);
+    if (result != CHIP8_LOAD_OK) {
+        fprintf(stderr, "unable to load %s: %s\n", name, get_load_error(result));
+        finalize(c);
+        free(c);
+        return false;
+    }
+
+    set_engine(c, o->engine);
+    seed_random(c, seed);
+
+    /* the reference starts from the image the core loaded, hex ROMs included */
+    size_t        length = get_memory_size(c) - PROGRAM_START;
+    unsigned char image[XO_MEMORY - PROGRAM_START];
+    read_memory(c, PROGRAM_START, image, length);
+
+    reset_reference(&r, o->variant, o->quirks, image, length);
+    r.cycles_per_frame = o->frame;
+    seed_reference(&r, seed);
+
+    uint64_t keys = seed;
+
+    while (r.cycles < o->cycles) {
+        if (r.cycles % o->frame == 0) {
+            drive_keys(c, &r, &keys);
+        }
+
+        unsigned long left = o->frame - r.cycles % o->frame;
+        unsigned long n    = o->step;
+
+        if (n > left) {
+            n = left;
+        }
+        if (n > o->cycles - r.cycles) {
+            n = o->cycles - r.cycles;
+        }
+
+        unsigned short pc     = r.PC % r.memory_size;
+        unsigned short opcode = (r.memory[pc] << 8) | r.memory[(pc + 1) % r.memory_size];
+
+        if (n > 1) {
+            chip8_fork(c, &saved);
+            saved_r = r;
+        }
+
+        run_cycles(c, n);
+        for (unsigned long i = 0; i < n; i++) {
+            step_reference(&r);
+        }
+
+        if (compare(c, &r, field, sizeof(field))) {
+            if (n > 1) {
+                finalize(&saved);
+                memset(&saved, 0, sizeof(saved));
+            }
+            continue;
+        }
+
+        ok = false;
+
+        if (n > 1) {
+            /* rerun the step one instruction at a time */
+            finalize(c);
+            *c = saved;
+            memset(&saved, 0, sizeof(saved));
+            set_engine(c, o->engine);
+            r = saved_r;
+
+            for (unsigned long i = 0; i < n; i++) {
+                pc     = r.PC % r.memory_size;
+                opcode = (r.memory[pc] << 8) | r.memory[(pc + 1) % r.memory_size];
+
+                run_cycles(c, 1);
+                step_reference(&r);
+
+                if (!compare(c, &r, field, sizeof(field))) {
+                    break;
+                }
+            }
+        }
+
+        report(name, c, &r, pc, opcode, field);
+        break;
+    }
+
+    if (ok) {
+        printf("%s: %lu instructions ok\n", name, r.cycles);
+    }
+
+    finalize(c);
+    free(c);
+
+    return ok;
+}
+
+/* false and the name of the first field that differs */
+static bool compare(chip8 *c, chip8_ref *r, char *field, size_t size)
+{
+    for (int i = 0; i < 16; i++) {
+        if (c->V[i] != r->V[i]) {
+            snprintf(field, size, "V%X", i);
+            return false;
+        }
+    }
+
+    if (c->I != r->I)   { snprintf(field, size, "I");  return false; }
+    if (c->PC != r->PC) { snprintf(field, size, "PC"); return false; }
+    if (c->SP != r->SP) { snprintf(field, size, "SP"); return false; }
+    if (c->DT != r->DT) { snprintf(field, size, "DT"); return false; }
+    if (c->ST != r->ST) { snprintf(field, size, "ST"); return false; }
+
+    for (int i = 0; i < 16; i++) {
+        if (c->stack[i] != r->stack[i]) {
+            snprintf(field, size, "stack[%d]", i);
+            return false;
+        }
+        if (c->keys[i] != r->keys[i]) {
+            snprintf(field, size, "key %X", i);
+            return false;
+        }
+    }
+
+    if ((c->pause != 0) != r->waiting) { snprintf(field, size, "Fx0A wait"); return false; }
+    if (c->key_flag != r->key)         { snprintf(field, size, "Fx0A key");  return false; }
+    if (c->rng != r->rng)              { snprintf(field, size, "random state"); return false; }
+    if (c->cycles != r->cycles)        { snprintf(field, size, "cycle count"); return false; }
+
+    /* a page at a time, the byte is only looked for once a page differs */
+    for (unsigned int i = 0; i < r->memory_size / MEMORY_PAGE_SIZE; i++) {
+        const unsigned char *page = &r->memory[i * MEMORY_PAGE_SIZE];
+        const unsigned char *data = (*get_page_slot(c, i))->data;
+
+        if (memcmp(data, page, MEMORY_PAGE_SIZE) == 0) {
+            continue;
+        }
+        for (int j = 0; j < MEMORY_PAGE_SIZE; j++) {
+            if (data[j] != page[j]) {
+                snprintf(field, size, "memory at %03x", i * MEMORY_PAGE_SIZE + j);
+                return false;
+            }
+        }
+    }
+
+    if (r->variant == CHIP8_VARIANT_CHIP8) {
+        for (int y = 0; y < W_HEIGHT; y++) {
+            if (c->display->rows[y] != r->rows[y]) {
+                snprintf(field, size, "display row %d", y);
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    if (c->hires != r->hires) { snprintf(field, size, "hi-res mode"); return false; }
+    if (c->plane != r->plane) { snprintf(field, size, "planes");      return false; }
+
+    for (int i = 0; i < 16; i++) {
+        if (c->flags[i] != r->flags[i]) {
+            snprintf(field, size, "flag register %X", i);
+            return false;
+        }
+    }
+
+    for (int p = 0; p < MAX_PLANES; p++) {
+        for (int y = 0; y < HIRES_HEIGHT; y++) {
+            for (int x = 0; x < HIRES_WIDTH; x++) {
+                uint64_t word = c->display->planes[p][y][x / 64];
+
+                if (((word >> (63 - x % 64)) & 1) != r->pixels[p][y][x]) {
+                    snprintf(field, size, "plane %d row %d", p, y);
+                    return false;
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+static void dump_machines(chip8 *c, chip8_ref *r)
+{
+    printf("            PC   I    SP DT ST V0 V1 V2 V3 V4 V5 V6 V7 V8 V9 VA VB VC VD VE VF\n");
+
+    printf("  engine    %03x  %03x  %02x %02x %02x", c->PC, c->I, c->SP, c->DT, c->ST);
+    for (int i = 0; i < 16; i++) {
+        printf(" %02x", c->V[i]);
+    }
+
+    printf("\n  reference %03x  %03x  %02x %02x %02x", r->PC, r->I, r->SP, r->DT, r->ST);
+    for (int i = 0; i < 16; i++) {
+        printf(" %02x", r->V[i]);
+    }
+    printf("\n");
+}
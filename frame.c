@@ -0,0 +1,83 @@
+#include <string.h>
+
+#include "frame.h"
+
+void init_frame_buffer(chip8_frame_buffer *fb)
+{
+    memset(fb->frames, 0, sizeof(fb->frames));
+
+    fb->back  = 0;
+    atomic_init(&fb->middle, 1);
+    fb->front = 2;
+}
+
+void attach_frame_buffer(chip8 *c, chip8_frame_buffer *fb)
+{
+    c->frame_buffer = fb;
+
+    /* the first boundary publishes the whole display */
+    redraw_display(c);
+}
+
+void copy_display(chip8_frame *f, chip8 *c)
+{
+    f->variant = c->variant;
+
+    if (c->display->planes == NULL) {
+        memcpy(f->rows, c->display->rows, sizeof(f->rows));
+    } else {
+        memcpy(f->planes, c->display->planes, sizeof(f->planes));
+    }
+}
+
+uint64_t compare_frames(const chip8_frame *a, const chip8_frame *b)
+{
+    uint64_t changed = 0;
+
+    if (a->variant != b->variant) {
+        return ALL_HIRES_ROWS;
+    }
+
+    if (a->variant == CHIP8_VARIANT_CHIP8) {
+        for (int y = 0; y < W_HEIGHT; y++) {
+            if (a->rows[y] != b->rows[y]) {
+                changed |= 1ULL << y;
+            }
+        }
+        return changed;
+    }
+
+    for (int y = 0; y < HIRES_HEIGHT; y++) {
+        for (int p = 0; p < MAX_PLANES; p++) {
+            if (memcmp(a->planes[p][y], b->planes[p][y], sizeof(a->planes[p][y])) != 0) {
+                changed |= 1ULL << y;
+            }
+        }
+    }
+
+    return changed;
+}
+
+void publish_frame(chip8_frame_buffer *fb, chip8 *c)
+{
+    chip8_frame *f = &fb->frames[fb->back];
+
+    copy_display(f, c);
+    f->number = get_frame(c);
+
+    /* the release makes the rows visible before the index */
+    unsigned int old = atomic_exchange_explicit(&fb->middle, fb->back | FRAME_FRESH, memory_order_acq_rel);
+    fb->back = old & ~FRAME_FRESH;
+}
+
+const chip8_frame *acquire_frame(chip8_frame_buffer *fb)
+{
+    if ((atomic_load_explicit(&fb->middle, memory_order_relaxed) & FRAME_FRESH) == 0) {
+        return NULL;
+    }
+
+    unsigned int old = atomic_exchange_explicit(&fb->middle, fb->front, memory_order_acq_rel);
+    fb->front = old & ~FRAME_FRESH;
+
+    return &fb->frames[fb->front];
+}
@@ -0,0 +1,57 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include "chip8.h"
+
+/* Frame handoff
+ *
+ * Triple buffer between the thread running a machine and a thread reading
+ * its display. Once attached, the core copies the display into the back
+ * buffer at every 60 Hz boundary where it changed and swaps it with the
+ * middle one. The reader swaps the middle buffer with its front buffer
+ * whenever a new frame is waiting.
+ *
+ * Each side only ever touches its own buffer plus one atomic exchange, so
+ * the reader always sees a complete frame (never one half way through a
+ * Dxyn) and neither thread waits for the other. A reader that falls behind
+ * just skips to the newest frame.
+ */
+
+#define FRAME_FRESH  4
+
+typedef struct chip8_frame_t {
+    /* The display of the machine's profile, rows on the classic machine
+     * and planes on the extended ones
+     */
+    chip8_variant variant;
+    uint64_t      rows[W_HEIGHT];
+    uint64_t      planes[MAX_PLANES][HIRES_HEIGHT][HIRES_WORDS];
+    /* Frame number it was published at, see get_frame */
+    unsigned long number;
+} chip8_frame;
+
+typedef struct chip8_frame_buffer_t {
+    chip8_frame   frames[3];
+    /* Buffer in the middle, with FRAME_FRESH set until the reader takes it */
+    _Alignas(64) atomic_uint middle;
+    /* Buffer the core writes, only used by the machine's thread */
+    _Alignas(64) unsigned int back;
+    /* Buffer the reader holds, only used by the reader's thread */
+    _Alignas(64) unsigned int front;
+} chip8_frame_buffer;
+
+void                init_frame_buffer    (chip8_frame_buffer *fb);
+void                attach_frame_buffer  (chip8 *c, chip8_frame_buffer *fb);
+/* Writer side, called by the core, publishes the current display */
+void                publish_frame        (chip8_frame_buffer *fb, chip8 *c);
+/* Reader side, newest complete frame or NULL if nothing new was published */
+const chip8_frame  *acquire_frame        (chip8_frame_buffer *fb);
+
+/* Copies the display of c into f, only the part its profile uses */
+void                copy_display         (chip8_frame *f, chip8 *c);
+/* Rows that differ between two frames, bit y for row y, all of them if the
+ * profiles differ
+ */
+uint64_t            compare_frames       (const chip8_frame *a, const chip8_frame *b);
+
+#endif
@@ -0,0 +1,391 @@
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "chip8.h"
+#include "audio.h"
+#include "profile.h"
+#include "quirks.h"
+#include "replay.h"
+#include "state.h"
+#include "trace.h"
+#include "variant.h"
+#include "video.h"
+
+/* Headless chip-8 frontend, runs a ROM for a fixed number of instructions
+ * without any video context and dumps the final machine state.
+ *
+ * usage: chip8-headless [-M chip8|schip|xochip] [-q quirks] [-Q quirks_db] [-e interpreter|threaded]
+ *                       [-f cycles_per_frame] [-S seed] [-p profile] [-t trace [-z]]
+ *                       [-v video [-x scale] [-P palette]] [-a audio]
+ *                       [-r state] [-s state] [-w replay | -R replay] <rom> [cycles]
+ *
+ * -M picks the machine profile the ROM is written for (see variant.h),
+ * the classic chip-8 by default. -Q looks the ROM up in a quirks database
+ * (see quirks.h) and -q sets the quirks outright, none or a list such as
+ * shift,loadstore. Otherwise the profile's own quirks apply.
+ *
+ * -f sets how many instructions run per 60 Hz timer tick, -S seeds the
+ * random number generator, -r resumes from a save state of the same ROM
+ * before running, -s writes one after running. -p writes an execution
+ * profile, as JSON if the name ends in .json and as folded stacks otherwise
+ * (needs a build with PROFILE=1). -t logs every instruction to a trace
+ * file (see trace.h), compressed with -z, chip8-trace prints it.
+ *
+ * -v writes every 60 Hz frame of the display to a video (see video.h), its
+ * format picked by the extension: .ppm, .y4m, .gif or .png. -x scales it up
+ * (4 by default) and -P picks one of the palettes in scale.h.
+ *
+ * -a renders the sound timer to a WAV file (see audio.h), or with -a null
+ * only counts the ticks it ran for. Either way the count goes to stderr.
+ *
+ * -w records the run as a replay, -R plays a replay back instead of running
+ * for a number of cycles and checks every frame against it.
+ */
+
+#define DEFAULT_CYCLES 100000
+#define DEFAULT_SCALE  4
+
+void dump_state   (chip8 *c);
+bool read_state   (chip8 *c, const char *path, const unsigned char *base);
+bool write_state  (chip8 *c, const char *path, const unsigned char *base);
+bool write_profile(chip8_profile *p, const char *path);
+bool check_replay (chip8 *c, const char *path);
+
+int main(int argc, char **argv)
+{
+    chip8_engine engine  = CHIP8_ENGINE_INTERPRETER;
+    const char  *restore = NULL;
+    const char  *save    = NULL;
+    const char  *profile = NULL;
+    const char  *record  = NULL;
+    const char  *play    = NULL;
+    const char  *trace   = NULL;
+    bool         compress = false;
+    const char  *video   = NULL;
+    unsigned int scale   = DEFAULT_SCALE;
+    const char  *palette = NULL;
+    const char  *audio   = NULL;
+    unsigned int frame   = CYCLES_PER_FRAME;
+    uint64_t     seed    = 0;
+    const char  *machine = "chip8";
+    const char  *quirks  = NULL;
+    const char  *db_path = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "M:q:Q:e:f:S:p:t:zv:x:P:a:r:s:w:R:")) != -1) {
+        switch (opt) {
+            case 'M': machine = optarg; break;
+            case 'q': quirks  = optarg; break;
+            case 'Q': db_path = optarg; break;
+            case 'e': if (!find_engine(optarg, &engine)) { optind = argc; } break;
+            case 'f': frame   = strtoul(optarg, NULL, 10); break;
+            case 'S': seed    = strtoull(optarg, NULL, 0); break;
+            case 'p': profile = optarg; break;
+            case 't': trace   = optarg; break;
+            case 'z': compress = true; break;
+            case 'v': video   = optarg; break;
+            case 'x': scale   = strtoul(optarg, NULL, 10); break;
+            case 'P': palette = optarg; break;
+            case 'a': audio   = optarg; break;
+            case 'r': restore = optarg; break;
+            case 's': save    = optarg; break;
+            case 'w': record  = optarg; break;
+            case 'R': play    = optarg; break;
+            default:  optind  = argc; break;
+        }
+    }
+
+    /* replays always start from a freshly loaded ROM */
+    if (optind >= argc || (record != NULL && play != NULL) || ((record != NULL || play != NULL) && restore != NULL)) {
+        fprintf(stderr, "usage: %s [-M chip8|schip|xochip] [-q quirks] [-Q quirks_db] [-e interpreter|threaded]\n"
+                        "       [-f cycles_per_frame] [-S seed] [-p profile] [-t trace [-z]]\n"
+                        "       [-v video [-x scale] [-P palette]] [-a audio]\n"
+                        "       [-r state] [-s state] [-w replay | -R replay] <rom> [cycles]\n", argv[0]);
+        return 1;
+    }
+
+    chip8_variant variant;
+    if (!find_variant(machine, &variant)) {
+        fprintf(stderr, "unknown machine %s, use chip8, schip or xochip\n", machine);
+        return 1;
+    }
+    unsigned int forced = 0;
+    if (quirks != NULL && !parse_quirks(quirks, &forced)) {
+        fprintf(stderr, "unknown quirks %s, use none or a list of shift, loadstore, jump and clip\n", quirks);
+        return 1;
+    }
+    chip8_quirks_db *db = NULL;
+    if (db_path != NULL) {
+        unsigned int line;
+        if ((db = load_quirks_db(db_path, &line)) == NULL) {
+            if (line > 0) {
+                fprintf(stderr, "%s:%u: malformed quirks entry\n", db_path, line);
+            } else {
+                fprintf(stderr, "unable to read %s\n", db_path);
+            }
+            return 1;
+        }
+    }
+
+    chip8_video_format format;
+    if (video != NULL && !get_video_format(video, &format)) {
+        fprintf(stderr, "unknown video format %s, use .ppm, .y4m, .gif or .png\n", video);
+        return 1;
+    }
+    if (palette != NULL && find_palette(palette) == NULL) {
+        fprintf(stderr, "unknown palette %s\n", palette);
+        return 1;
+    }
+
+    unsigned long cycles = DEFAULT_CYCLES;
+    if (optind + 1 < argc) {
+        cycles = strtoul(argv[optind + 1], NULL, 10);
+    }
+
+    chip8 *c = calloc(1, sizeof(chip8));
+
+    initialize(c);
+    set_variant(c, variant);
+    set_cycles_per_frame(c, frame);
+
+    chip8_load_result result = load_file(c, argv[optind]);
+    if (result != CHIP8_LOAD_OK) {
+        fprintf(stderr, "unable to load %s: %s\n", argv[optind], get_load_error(result));
+        finalize(c);
+        free(c);
+        destroy_quirks_db(db);
+        return 1;
+    }
+
+    /* the ROM's entry in the database, then whatever -q asks for */
+    if (db != NULL && !apply_rom_quirks(c, db)) {
+        fprintf(stderr, "%016llx not in %s, using the profile's quirks\n", (unsigned long long) get_program_hash(c), db_path);
+    }
+    if (quirks != NULL) {
+        set_quirks(c, forced);
+    }
+    destroy_quirks_db(db);
+
+    seed_random(c, seed);
+
+    /* states only store how memory differs from the freshly loaded ROM */
+    static unsigned char base[XO_MEMORY];
+    read_memory(c, 0, base, get_memory_size(c));
+
+    bool ok = restore == NULL || read_state(c, restore, base);
+
+    chip8_profile *p = NULL;
+    if (profile != NULL) {
+#ifndef CHIP8_PROFILE
+        fprintf(stderr, "built without CHIP8_PROFILE, %s will be empty\n", profile);
+#endif
+        p = create_profile();
+        attach_profile(c, p);
+    }
+
+    chip8_replay *r = NULL;
+    if (record != NULL) {
+        r = create_replay();
+        start_recording(c, r, seed);
+    }
+
+    chip8_trace *t = NULL;
+    if (trace != NULL && ok) {
+        t = open_trace(trace, compress);
+        if (t == NULL) {
+            fprintf(stderr, "unable to create %s\n", trace);
+            ok = false;
+        } else {
+            attach_trace(c, t);
+        }
+    }
+
+    chip8_video *v = NULL;
+    if (video != NULL && ok) {
+        v = open_video(video, variant, scale, palette != NULL ? find_palette(palette) : NULL);
+        chip8_video_format format;
+
+        if (v == NULL && get_video_format(video, &format) && format == CHIP8_VIDEO_APNG) {
+            fprintf(stderr, "unable to create %s, animated PNG needs a seekable file\n", video);
+            ok = false;
+        } else if (v == NULL) {
+            fprintf(stderr, "unable to create %s\n", video);
+            ok = false;
+        } else {
+            attach_video(c, v);
+        }
+    }
+
+    chip8_audio *a = NULL;
+    if (audio != NULL && ok) {
+        bool null = strcmp(audio, "null") == 0;
+
+        a = open_audio(null ? CHIP8_AUDIO_NULL : CHIP8_AUDIO_WAV, audio, AUDIO_RATE);
+        if (a == NULL) {
+            fprintf(stderr, "unable to create %s\n", audio);
+            ok = false;
+        } else {
+            attach_audio(c, a);
+        }
+    }
+
+    if (ok) {
+        set_engine(c, engine);
+
+        if (play != NULL) {
+            ok = check_replay(c, play);
+        } else {
+            run_cycles(c, cycles);
+        }
+
+        dump_state(c);
+
+        ok = ok && (save == NULL || write_state(c, save, base));
+        ok = ok && (p == NULL || write_profile(p, profile));
+    }
+
+    if (r != NULL) {
+        stop_recording(c);
+
+        chip8_replay_result saved = save_replay(r, record);
+        if (saved != CHIP8_REPLAY_OK) {
+            fprintf(stderr, "unable to save %s: %s\n", record, get_replay_error(saved));
+            ok = false;
+        }
+    }
+
+    if (!close_trace(t)) {
+        fprintf(stderr, "unable to write %s\n", trace);
+        ok = false;
+    }
+
+    if (!close_video(v, get_frame(c))) {
+        fprintf(stderr, "unable to write %s\n", video);
+        ok = false;
+    }
+
+    if (a != NULL) {
+        fprintf(stderr, "audio: %lu ticks, %lu with the tone on\n", a->ticks_seen, a->tone_ticks);
+    }
+    if (!close_audio(a)) {
+        fprintf(stderr, "unable to write %s\n", audio);
+        ok = false;
+    }
+
+    finalize(c);
+    free(c);
+    destroy_profile(p);
+    destroy_replay(r);
+
+    return ok ? 0 : 1;
+}
+
+bool read_state(chip8 *c, const char *path, const unsigned char *base)
+{
+    unsigned char buf[STATE_MAX_SIZE];
+    FILE *fp;
+
+    if ((fp = fopen(path, "rb")) == NULL) {
+        fprintf(stderr, "unable to open %s for reading\n", path);
+        return false;
+    }
+
+    size_t size = fread(buf, 1, sizeof(buf), fp);
+    fclose(fp);
+
+    chip8_state_result result = chip8_load_state(c, buf, size, base);
+    if (result != CHIP8_STATE_OK) {
+        fprintf(stderr, "unable to restore %s: %s\n", path, get_state_error(result));
+        return false;
+    }
+
+    return true;
+}
+
+bool write_state(chip8 *c, const char *path, const unsigned char *base)
+{
+    unsigned char buf[STATE_MAX_SIZE];
+    FILE *fp;
+
+    size_t size = chip8_save_state(c, buf, sizeof(buf), base);
+
+    if ((fp = fopen(path, "wb")) == NULL || fwrite(buf, 1, size, fp) != size) {
+        fprintf(stderr, "unable to write %s\n", path);
+        if (fp != NULL) {
+            fclose(fp);
+        }
+        return false;
+    }
+
+    fclose(fp);
+
+    return true;
+}
+
+bool write_profile(chip8_profile *p, const char *path)
+{
+    FILE *fp;
+    size_t length = strlen(path);
+
+    if ((fp = fopen(path, "w")) == NULL) {
+        fprintf(stderr, "unable to write %s\n", path);
+        return false;
+    }
+
+    if (length >= 5 && strcmp(path + length - 5, ".json") == 0) {
+        write_profile_json(p, fp);
+    } else {
+        write_profile_folded(p, fp);
+    }
+
+    fclose(fp);
+
+    return true;
+}
+
+bool check_replay(chip8 *c, const char *path)
+{
+    chip8_replay *r = create_replay();
+    unsigned long frame = 0;
+    struct timespec start, end;
+
+    chip8_replay_result result = load_replay(r, path);
+
+    if (result == CHIP8_REPLAY_OK) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        result = play_replay(c, r, &frame);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+    }
+
+    if (result == CHIP8_REPLAY_OK) {
+        double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+        fprintf(stderr, "replay ok: %lu frames, %u key events in %.3f ms\n", r->frames, r->event_count, ms);
+    } else if (result == CHIP8_REPLAY_DIVERGED) {
+        fprintf(stderr, "replay diverged at frame %lu of %lu\n", frame, r->frames);
+    } else {
+        fprintf(stderr, "unable to play %s: %s\n", path, get_replay_error(result));
+    }
+
+    destroy_replay(r);
+
+    return result == CHIP8_REPLAY_OK;
+}
+
+void dump_state(chip8 *c)
+{
+    printf("cycles %lu\n", c->cycles);
+    printf("PC %03x I %03x SP %x DT %02x ST %02x\n", c->PC, c->I, c->SP, c->DT, c->ST);
+
+    for (int i = 0; i < 16; i++) {
+        printf("V%X %02x%c", i, c->V[i], (i % 8 == 7) ? '\n' : ' ');
+    }
+
+    // the display as text, '+' and '@' for the second plane and both
+    for (unsigned int y = 0; y < get_display_height(c); y++) {
+        for (unsigned int x = 0; x < get_display_width(c); x++) {
+            putchar(".#+@"[get_display_value(c, x, y) & 3]);
+        }
+        putchar('\n');
+    }
+}
@@ -0,0 +1,62 @@
+#include "input.h"
+
+void init_input(chip8_input *q)
+{
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+}
+
+bool push_key_event(chip8_input *q, unsigned long frame, unsigned char key, bool pressed)
+{
+    unsigned int head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+
+    if (head - tail == INPUT_RING_SIZE) {
+        return false;
+    }
+
+    chip8_key_event *e = &q->events[head % INPUT_RING_SIZE];
+    e->frame   = frame;
+    e->key     = key;
+    e->pressed = pressed;
+
+    /* publish the slot only once it is filled in */
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+
+    return true;
+}
+
+unsigned int apply_key_events(chip8_input *q, chip8 *c, unsigned long frame)
+{
+    unsigned int tail  = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    unsigned int head  = atomic_load_explicit(&q->head, memory_order_acquire);
+    unsigned int count = 0;
+
+    while (tail != head) {
+        const chip8_key_event *e = &q->events[tail % INPUT_RING_SIZE];
+
+        /* events stay queued until their frame comes */
+        if (e->frame > frame) {
+            break;
+        }
+
+        if (e->pressed) {
+            press_key(c, e->key);
+        } else {
+            release_key(c, e->key);
+        }
+
+        tail++;
+        count++;
+    }
+
+    /* hand the slots back to the producer */
+    atomic_store_explicit(&q->tail, tail, memory_order_release);
+
+    return count;
+}
+
+bool input_pending(chip8_input *q)
+{
+    return atomic_load_explicit(&q->head, memory_order_acquire) != atomic_load_explicit(&q->tail, memory_order_relaxed);
+}
@@ -0,0 +1,41 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#include "chip8.h"
+
+/* Input queue
+ *
+ * Single-producer single-consumer ring of key events between a frontend
+ * thread and the thread running the machine. Neither side ever blocks or
+ * takes a lock: the producer only moves head, the consumer only moves tail.
+ *
+ * Every event is stamped with the emulated frame it takes effect in. The
+ * consumer applies events at frame boundaries only, so a ROM sees the same
+ * input at the same instruction no matter how the host threads are
+ * scheduled, and input lags the frontend by at most one frame.
+ */
+
+#define INPUT_RING_SIZE  256
+
+typedef struct chip8_key_event_t {
+    /* Frame the event is applied at, see get_frame */
+    unsigned long frame;
+    unsigned char key;
+    bool          pressed;
+} chip8_key_event;
+
+typedef struct chip8_input_t {
+    chip8_key_event events[INPUT_RING_SIZE];
+    /* Next slot to write and next slot to read, on separate cache lines */
+    _Alignas(64) atomic_uint head;
+    _Alignas(64) atomic_uint tail;
+} chip8_input;
+
+void          init_input        (chip8_input *q);
+/* Producer side, returns false and drops the event if the ring is full */
+bool          push_key_event    (chip8_input *q, unsigned long frame, unsigned char key, bool pressed);
+/* Consumer side, applies every event due at or before frame, returns how many */
+unsigned int  apply_key_events  (chip8_input *q, chip8 *c, unsigned long frame);
+bool          input_pending     (chip8_input *q);
+
+#endif
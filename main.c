@@ -1,10 +1,23 @@
 #include <SDL2/SDL.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "chip8.h"
+#include "audio.h"
+#include "frame.h"
+#include "input.h"
+#include "quirks.h"
+#include "replay.h"
+#include "scale.h"
+#include "trace.h"
+#include "variant.h"
 
-const int SCREEN_SCALE = 10;
-const int SCREEN_WIDTH = 640;
-const int SCREEN_HEIGHT = 320;
+/* Window pixels per chip-8 pixel unless -x is given, half of it for the
+ * 128x64 display of the extended profiles
+ */
+#define SCREEN_SCALE 10
 
 const int hex_keypad[16] = {
     SDLK_COMMA,
@@ -25,109 +38,424 @@ const int hex_keypad[16] = {
     SDLK_SLASH
 };
 
-void game_loop(SDL_Window *, SDL_Surface *, SDL_Rect *, chip8 *);
+/* Frames per second of the scheduler and the timers */
+#define FRAME_RATE 60
+
+/* State shared between the frontend thread and the emulation thread */
+typedef struct emulator_t {
+    chip8        *c;
+    int           unthrottled;
+    atomic_int    running;
+    /* Frame the emulation thread is running, stamps new key events */
+    atomic_ulong  frame;
+    chip8_input   input;
+    /* Posted on every key event, wakes an emulation thread idle in Fx0A */
+    SDL_sem      *wake;
+    /* Completed frames, published by the core at every 60 Hz boundary */
+    chip8_frame_buffer frames;
+} emulator;
+
+void game_loop(SDL_Renderer *, SDL_Texture *, chip8_scaler *, uint32_t *, emulator *);
+static int  emulation_thread(void *);
+static void upload_rows(SDL_Texture *, chip8_scaler *, uint32_t *, const chip8_frame *, uint64_t);
+static void audio_callback(void *, Uint8 *, int);
+static uint64_t monotonic_ns(void);
+static void wait_until(uint64_t);
 
 int main(int argc, char **argv)
 {
+    unsigned int frame       = CYCLES_PER_FRAME;
+    int          unthrottled = 0;
+    const char  *rom         = "demo.ch8";
+    const char  *record      = NULL;
+    const char  *trace       = NULL;
+    bool         compress    = false;
+    unsigned int scale       = 0;
+    const char  *machine     = "chip8";
+    const char  *quirks      = NULL;
+    const char  *db_path     = NULL;
+    const char  *palette     = "mono";
+    unsigned int persistence = 0;
+    int          mute        = 0;
+    // a new game every run unless a seed is given
+    uint64_t     seed        = time(NULL);
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:uS:w:t:zx:P:g:mM:q:Q:")) != -1) {
+        switch (opt) {
+            case 'f': frame       = strtoul(optarg, NULL, 10); break;
+            case 'u': unthrottled = 1; break;
+            case 'S': seed        = strtoull(optarg, NULL, 0); break;
+            case 'w': record      = optarg; break;
+            case 't': trace       = optarg; break;
+            case 'z': compress    = true; break;
+            case 'x': scale       = strtoul(optarg, NULL, 10); break;
+            case 'P': palette     = optarg; break;
+            case 'g': persistence = strtoul(optarg, NULL, 10); break;
+            case 'm': mute        = 1; break;
+            case 'M': machine     = optarg; break;
+            case 'q': quirks      = optarg; break;
+            case 'Q': db_path     = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-f cycles_per_frame] [-u] [-S seed] [-w replay] [-t trace [-z]]\n"
+                                "       [-x scale] [-P palette] [-g persistence] [-m]\n"
+                                "       [-M chip8|schip|xochip] [-q quirks] [-Q quirks_db] [rom]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    chip8_variant variant;
+    if (!find_variant(machine, &variant)) {
+        fprintf(stderr, "unknown machine %s\n", machine);
+        return 1;
+    }
+    if (scale == 0) {
+        scale = variant == CHIP8_VARIANT_CHIP8 ? SCREEN_SCALE : SCREEN_SCALE / 2;
+    }
+
+    // quirks from the database, -q overrides them
+    unsigned int forced = 0;
+    if (quirks != NULL && !parse_quirks(quirks, &forced)) {
+        fprintf(stderr, "unknown quirks %s\n", quirks);
+        return 1;
+    }
+    unsigned int     line;
+    chip8_quirks_db *db = NULL;
+    if (db_path != NULL && (db = load_quirks_db(db_path, &line)) == NULL) {
+        fprintf(stderr, "unable to read %s (line %u)\n", db_path, line);
+        return 1;
+    }
+
+    // the picture is drawn at window size, the renderer only copies it
+    chip8_scaler scaler;
+    if (find_palette(palette) == NULL) {
+        fprintf(stderr, "unknown palette %s, one of:", palette);
+        for (int i = 0; i < palette_count; i++) {
+            fprintf(stderr, " %s", palettes[i].name);
+        }
+        fprintf(stderr, "\n");
+        return 1;
+    }
+    if (!init_scaler(&scaler, variant, scale, find_palette(palette), persistence)) {
+        fprintf(stderr, "scale must be between 1 and %d\n", SCALE_MAX);
+        return 1;
+    }
+
+    // window sized picture the scaler draws into before it goes to the texture
+    uint32_t *pixels = calloc(scaler.width * scaler.height, sizeof(uint32_t));
+    if (pixels == NULL) {
+        fprintf(stderr, "unable to allocate the window picture\n");
+        exit(1);
+    }
+    if (optind < argc) {
+        rom = argv[optind];
+    }
+
     chip8 *c = calloc(1, sizeof(chip8));
 
     initialize(c);
-    load_file(c, "demo.ch8");
+    set_variant(c, variant);
+    set_cycles_per_frame(c, frame);
 
-    for (int i = 0x200; i < 0x200 + 202; i++) {
-        printf("%x\n", c->memory[i]);
+    chip8_load_result result = load_file(c, rom);
+    if (result != CHIP8_LOAD_OK) {
+        fprintf(stderr, "unable to load %s: %s\n", rom, get_load_error(result));
+        finalize(c);
+        free(c);
+        free_scaler(&scaler);
+        free(pixels);
+        return 1;
     }
 
-    SDL_Window* window = NULL;
-    SDL_Surface* screen_surface = NULL;
+    if (db != NULL && !apply_rom_quirks(c, db)) {
+        fprintf(stderr, "%016llx not in %s\n", (unsigned long long) get_program_hash(c), db_path);
+    }
+    if (quirks != NULL) {
+        set_quirks(c, forced);
+    }
+    destroy_quirks_db(db);
 
-    // simulated chip-8 display
-    SDL_Rect display_rects[W_WIDTH * W_HEIGHT];
-    int x = 0, y = 0;
-    for (int i = 0; i < W_WIDTH * W_HEIGHT; i++) {
-        display_rects[i].x = x;
-        display_rects[i].y = y;
-        display_rects[i].w = 10;
-        display_rects[i].h = 10;
+    // the whole session goes to the replay, from the first instruction on
+    chip8_replay *replay = NULL;
+    if (record != NULL) {
+        replay = create_replay();
+        start_recording(c, replay, seed);
+    } else {
+        seed_random(c, seed);
+    }
 
-        if ((10 * (i + 1)) % 640 == 0) {
-            y += 10;
+    // every instruction goes to the trace, written out by its own thread
+    chip8_trace *t = NULL;
+    if (trace != NULL) {
+        t = open_trace(trace, compress);
+        if (t == NULL) {
+            fprintf(stderr, "unable to create %s\n", trace);
+        } else {
+            attach_trace(c, t);
         }
-        x = (10 * (i + 1)) % 640;
     }
 
-    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER) < 0) {
+    SDL_Window   *window   = NULL;
+    SDL_Renderer *renderer = NULL;
+    SDL_Texture  *texture  = NULL;
+
+    chip8_audio       *audio  = NULL;
+    SDL_AudioDeviceID  device = 0;
+
+    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER | (mute ? 0 : SDL_INIT_AUDIO)) < 0) {
         printf("SDL could not initialize! SDL_Error: %s\n", SDL_GetError());
     } else {
-        window = SDL_CreateWindow("Chip-8 Display", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, SCREEN_WIDTH, SCREEN_HEIGHT, SDL_WINDOW_SHOWN);
+        window = SDL_CreateWindow("Chip-8 Display", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, scaler.width, scaler.height, SDL_WINDOW_SHOWN);
         if (window == NULL) {
             printf("Window could not be created! SDL_Error: %s\n", SDL_GetError());
         } else {
-            game_loop(window, screen_surface, display_rects, c);
+            // the scaler fills a window sized texture, the renderer copies it 1:1
+            renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+            if (renderer != NULL) {
+                texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, scaler.width, scaler.height);
+            }
+
+            if (texture == NULL) {
+                printf("Renderer could not be created! SDL_Error: %s\n", SDL_GetError());
+            } else {
+                emulator e = { .c = c, .unthrottled = unthrottled };
+
+                atomic_init(&e.running, 1);
+                atomic_init(&e.frame, 0);
+                init_input(&e.input);
+                init_frame_buffer(&e.frames);
+                attach_frame_buffer(c, &e.frames);
+                e.wake = SDL_CreateSemaphore(0);
+
+                // the sound timer plays through the device's callback, a
+                // missing device just leaves the machine silent
+                if (!mute) {
+                    SDL_AudioSpec want = { 0 };
+
+                    audio = open_audio(CHIP8_AUDIO_DEVICE, NULL, AUDIO_RATE);
+
+                    want.freq     = AUDIO_RATE;
+                    want.format   = AUDIO_S16SYS;
+                    want.channels = 1;
+                    want.samples  = 512;
+                    want.callback = audio_callback;
+                    want.userdata = audio;
+
+                    device = SDL_OpenAudioDevice(NULL, 0, &want, NULL, 0);
+                    if (device == 0) {
+                        printf("Audio could not be opened! SDL_Error: %s\n", SDL_GetError());
+                    } else {
+                        attach_audio(c, audio);
+                        SDL_PauseAudioDevice(device, 0);
+                    }
+                }
+
+                // the machine runs on its own thread, this one handles input and video
+                SDL_Thread *thread = SDL_CreateThread(emulation_thread, "chip8", &e);
+                if (thread == NULL) {
+                    printf("Emulation thread could not be created! SDL_Error: %s\n", SDL_GetError());
+                } else {
+                    game_loop(renderer, texture, &scaler, pixels, &e);
+
+                    atomic_store(&e.running, 0);
+                    SDL_SemPost(e.wake);
+                    SDL_WaitThread(thread, NULL);
+                }
+                SDL_DestroySemaphore(e.wake);
+
+                if (device != 0) {
+                    SDL_CloseAudioDevice(device);
+                }
+                close_audio(audio);
+            }
         }
     }
 
+    if (texture != NULL) {
+        SDL_DestroyTexture(texture);
+    }
+    if (renderer != NULL) {
+        SDL_DestroyRenderer(renderer);
+    }
     SDL_DestroyWindow(window);
     SDL_Quit();
 
+    free_scaler(&scaler);
+    free(pixels);
+
+    if (replay != NULL) {
+        stop_recording(c);
+
+        chip8_replay_result saved = save_replay(replay, record);
+        if (saved != CHIP8_REPLAY_OK) {
+            fprintf(stderr, "unable to save %s: %s\n", record, get_replay_error(saved));
+        }
+        destroy_replay(replay);
+    }
+
+    if (!close_trace(t)) {
+        fprintf(stderr, "unable to write %s\n", trace);
+    }
+
+    finalize(c);
     free(c);
 
     return 0;
 }
 
-void game_loop(SDL_Window *window, SDL_Surface *screen_surface, SDL_Rect *display_rects, chip8 *c)
+void game_loop(SDL_Renderer *renderer, SDL_Texture *texture, chip8_scaler *scaler, uint32_t *pixels, emulator *emu)
 {
-    // screen surface from initialized window structure
-    screen_surface = SDL_GetWindowSurface(window);
-
-    // black background color
-    SDL_FillRect(screen_surface, NULL, SDL_MapRGB(screen_surface->format, 0x00, 0x00, 0x00));
-    
     int quit = 0;
+    // the first frame always has to be shown
+    int expose = 1;
+
+    // the frame on screen, the first one compares against a blank display
+    chip8_frame shown = { 0 };
 
     SDL_Event e;
 
     // begin game loop
     while (!quit) {
+        // sleep in the event queue until input arrives or the next frame is due
+        int events = SDL_WaitEventTimeout(&e, 1000 / FRAME_RATE);
+
         // sdl event queue
-        while (SDL_PollEvent( &e ) != 0) {
+        while (events) {
             // quit
             if(e.type == SDL_QUIT) {
                 quit = 1;
-            // keyboard I/O
-            } else if (e.type == SDL_KEYDOWN) {
+            // window shown again or resized, the old frame is gone
+            } else if (e.type == SDL_WINDOWEVENT) {
+                expose = 1;
+            // keyboard I/O, auto-repeat isn't a new press
+            } else if ((e.type == SDL_KEYDOWN && !e.key.repeat) || e.type == SDL_KEYUP) {
+                // hexadecimal key mapping (key -> index/value)
+                /* "7" => 1, "8" => 2, "9" => 3, "u" => 4, "i" => 5, "o" => 6, "j" => 7,
+                 * "k" => 8, "l" => 9, "," => 0, "m" => A, "." => B, "0" => C, "p" => D,
+                 * ";" => E, "/" => F
+                 */
                 for (int i = 0; i < 16; i++) {
-                    c->keys[i]  = 0;
-                    c->key_flag = -1;
-
-                    // hexadecimal key mapping (key -> index/value)
-                    /* "7" => 1, "8" => 2, "9" => 3, "u" => 4, "i" => 5, "o" => 6, "j" => 7,
-                     * "k" => 8, "l" => 9, "," => 0, "m" => A, "." => B, "0" => C, "p" => D,
-                     * ";" => E, "/" => F
-                     */
                     if (e.key.keysym.sym == hex_keypad[i]) {
-                        c->keys[i]  = 1;
-                        c->key_flag = i;
+                        // takes effect at the start of the next emulated frame
+                        unsigned long frame = atomic_load(&emu->frame) + 1;
 
+                        if (push_key_event(&emu->input, frame, i, e.type == SDL_KEYDOWN)) {
+                            SDL_SemPost(emu->wake);
+                        }
                         break;
                     }
                 }
             }
+
+            events = SDL_PollEvent(&e);
         }
 
-        // execute the chip-8 interpreter
-        execute_instruction(c);
+        // take the newest completed frame, if any, and see which rows it changes
+        const chip8_frame *frame = acquire_frame(&emu->frames);
+        uint64_t dirty = 0;
 
-        // draw monochrome chip-8 display
-        for (int i = 0; i < W_WIDTH * W_HEIGHT; i++) {
-            if (c->display[i] == 1) {
-                SDL_FillRect(screen_surface, &display_rects[i], SDL_MapRGB(screen_surface->format, 255, 255, 255));
-            } else {
-                SDL_FillRect(screen_surface, &display_rects[i], SDL_MapRGB(screen_surface->format, 0, 0, 0));
-            }
+        if (frame != NULL) {
+            dirty = compare_frames(frame, &shown);
+            shown = *frame;
+        }
+
+        // rows still fading out are redrawn every tick until they settle
+        if (dirty != 0 || expose || scaler->fading != 0) {
+            // only the rows written since the last frame go to the texture
+            upload_rows(texture, scaler, pixels, &shown, expose ? ALL_HIRES_ROWS : dirty);
+
+            SDL_RenderCopy(renderer, texture, NULL, NULL);
+            SDL_RenderPresent(renderer);
+            expose = 0;
+        }
+    }
+}
+
+/* Emulation thread, runs one frame of instructions per 60 Hz tick. Key
+ * events are applied between frames only.
+ */
+static int emulation_thread(void *data)
+{
+    emulator *emu = data;
+    chip8    *c   = emu->c;
+
+    // frame deadlines in CLOCK_MONOTONIC nanoseconds
+    uint64_t period     = 1000000000 / FRAME_RATE;
+    uint64_t next_frame = monotonic_ns() + period;
+
+    while (atomic_load(&emu->running)) {
+        // waiting for a key with both timers stopped, nothing changes until
+        // the next key event so sleep until the frontend posts one
+        if (!emu->unthrottled && waiting_for_key(c) && c->DT == 0 && c->ST == 0 && !input_pending(&emu->input)) {
+            SDL_SemWait(emu->wake);
+            next_frame = monotonic_ns() + period;
+        }
+
+        unsigned long frame = get_frame(c);
+
+        atomic_store(&emu->frame, frame);
+        apply_key_events(&emu->input, c, frame);
+
+        // one frame worth of instructions, the core ticks the timers and
+        // publishes the display at its end
+        run_cycles(c, c->cycles_per_frame);
+
+        if (!emu->unthrottled) {
+            wait_until(next_frame);
         }
 
-        // draw rects to the surface
-        SDL_UpdateWindowSurface( window );
+        // more than a frame behind (e.g. the host was suspended), don't try to catch up
+        uint64_t now = monotonic_ns();
+        next_frame += period;
+        if (now > next_frame) {
+            next_frame = now + period;
+        }
+    }
+
+    return 0;
+}
+
+/* Scale the dirty display rows and copy their span into the streaming texture */
+static void upload_rows(SDL_Texture *texture, chip8_scaler *scaler, uint32_t *pixels, const chip8_frame *f, uint64_t dirty)
+{
+    size_t   pitch = scaler->width * sizeof(uint32_t);
+    uint64_t drawn = scale_display(scaler, f, dirty, pixels, pitch);
+
+    if (drawn == 0) {
+        return;
+    }
+
+    int first = __builtin_ctzll(drawn) * scaler->scale;
+    int last  = (64 - __builtin_clzll(drawn)) * scaler->scale;
+
+    SDL_Rect span = { 0, first, scaler->width, last - first };
+    SDL_UpdateTexture(texture, &span, (char *) pixels + first * pitch, pitch);
+}
+
+/* Device callback, runs on SDL's audio thread */
+static void audio_callback(void *data, Uint8 *stream, int length)
+{
+    render_audio(data, (int16_t *) stream, length / sizeof(int16_t));
+}
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return (uint64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+/* Sleep until a CLOCK_MONOTONIC deadline. An absolute deadline doesn't drift
+ * with the time spent running the frame, and the kernel's timer slack is
+ * far below a frame, so there is nothing left to spin for.
+ */
+static void wait_until(uint64_t deadline)
+{
+    struct timespec t = { deadline / 1000000000, deadline % 1000000000 };
+
+    // restarted if a signal interrupts it, a deadline in the past returns at once
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL) == EINTR) {
     }
 }
@@ -0,0 +1,215 @@
+#include <pthread.h>
+#include <string.h>
+
+#include "profile.h"
+
+/* Handler and name of every family, in chip8_family order */
+static const struct {
+    chip8_op    op;
+    const char *name;
+} families[FAMILY_COUNT] = {
+    { op_nop,  "op_nop"  }, { op_00E0, "op_00E0" }, { op_00EE, "op_00EE" },
+    { op_1nnn, "op_1nnn" }, { op_2nnn, "op_2nnn" }, { op_3xnn, "op_3xnn" },
+    { op_4xnn, "op_4xnn" }, { op_5xy0, "op_5xy0" }, { op_6xnn, "op_6xnn" },
+    { op_7xnn, "op_7xnn" }, { op_8xy0, "op_8xy0" }, { op_8xy1, "op_8xy1" },
+    { op_8xy2, "op_8xy2" }, { op_8xy3, "op_8xy3" }, { op_8xy4, "op_8xy4" },
+    { op_8xy5, "op_8xy5" }, { op_8xy6, "op_8xy6" }, { op_8xy7, "op_8xy7" },
+    { op_8xyE, "op_8xyE" }, { op_9xy0, "op_9xy0" }, { op_Annn, "op_Annn" },
+    { op_Bnnn, "op_Bnnn" }, { op_Cxnn, "op_Cxnn" }, { op_Dxyn, "op_Dxyn" },
+    { op_Ex9E, "op_Ex9E" }, { op_ExA1, "op_ExA1" }, { op_Fx07, "op_Fx07" },
+    { op_Fx0A, "op_Fx0A" }, { op_Fx15, "op_Fx15" }, { op_Fx18, "op_Fx18" },
+    { op_Fx1E, "op_Fx1E" }, { op_Fx29, "op_Fx29" }, { op_Fx33, "op_Fx33" },
+    { op_Fx55, "op_Fx55" }, { op_Fx65, "op_Fx65" }
+};
+
+/* Family of every opcode, built from the decode table on first use. Batch
+ * workers may create their profiles at the same time, like the decode
+ * tables the first one builds it under the lock and the flag publishes it.
+ */
+static unsigned char   family_table[0x10000];
+static atomic_bool     family_table_built;
+static pthread_mutex_t family_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void build_family_table(void)
+{
+    if (atomic_load_explicit(&family_table_built, memory_order_acquire)) {
+        return;
+    }
+
+    pthread_mutex_lock(&family_table_lock);
+
+    if (!atomic_load_explicit(&family_table_built, memory_order_relaxed)) {
+        build_decode_table(CHIP8_VARIANT_CHIP8, 0);
+
+        for (unsigned int i = 0; i < 0x10000; i++) {
+            chip8_op op = get_decoded(i)->op;
+
+            for (int f = 0; f < FAMILY_COUNT; f++) {
+                if (families[f].op == op) {
+                    family_table[i] = f;
+                    break;
+                }
+            }
+        }
+
+        atomic_store_explicit(&family_table_built, true, memory_order_release);
+    }
+
+    pthread_mutex_unlock(&family_table_lock);
+}
+
+chip8_profile *create_profile(void)
+{
+    chip8_profile *p = calloc(1, sizeof(chip8_profile));
+
+    if (p == NULL) {
+        fprintf(stderr, "unable to allocate profile\n");
+        exit(1);
+    }
+
+    build_family_table();
+
+    return p;
+}
+
+void destroy_profile(chip8_profile *p)
+{
+    free(p);
+}
+
+void attach_profile(chip8 *c, chip8_profile *p)
+{
+    c->profile = p;
+}
+
+const char *get_family_name(chip8_family family)
+{
+    return family < FAMILY_COUNT ? families[family].name : "unknown";
+}
+
+void profile_instruction(chip8_profile *p, unsigned short pc, const chip8_insn *in, uint64_t ticks)
+{
+    unsigned char family = family_table[in->opcode];
+
+    pc &= MAX_MEMORY - 1;
+
+    p->op_count[family]++;
+    p->op_ticks[family] += ticks;
+    p->pc_count[pc]++;
+    p->pc_ticks[pc] += ticks;
+    p->pc_family[pc] = family;
+
+    if (family == FAMILY_Dxyn) {
+        p->draws++;
+        p->frame_draws++;
+    }
+}
+
+void profile_block(chip8_profile *p, unsigned short pc, unsigned char length)
+{
+    p->block_count[pc & (MAX_MEMORY - 1)]++;
+    p->block_insns[pc & (MAX_MEMORY - 1)] += length;
+}
+
+void profile_frame(chip8_profile *p)
+{
+    if (p->frame_draws > p->max_frame_draws) {
+        p->max_frame_draws = p->frame_draws;
+    }
+
+    p->frames++;
+    p->frame_draws = 0;
+}
+
+void profile_idle(chip8_profile *p, unsigned long n)
+{
+    p->idle += n;
+}
+
+/* Indices of the PROFILE_TOP largest values, returns how many are non-zero */
+static int top_addresses(const unsigned long *values, unsigned short *top)
+{
+    int count = 0;
+
+    for (unsigned int addr = 0; addr < MAX_MEMORY; addr++) {
+        if (values[addr] == 0) {
+            continue;
+        }
+
+        /* insertion into the sorted top list */
+        int i = count < PROFILE_TOP ? count++ : PROFILE_TOP;
+        while (i > 0 && values[top[i - 1]] < values[addr]) {
+            if (i < PROFILE_TOP) {
+                top[i] = top[i - 1];
+            }
+            i--;
+        }
+        if (i < PROFILE_TOP) {
+            top[i] = addr;
+        }
+    }
+
+    return count;
+}
+
+void write_profile_json(chip8_profile *p, FILE *out)
+{
+    unsigned long instructions = 0;
+    for (int f = 0; f < FAMILY_COUNT; f++) {
+        instructions += p->op_count[f];
+    }
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"instructions\": %lu,\n", instructions);
+    fprintf(out, "  \"idle_instructions\": %lu,\n", p->idle);
+    fprintf(out, "  \"frames\": %lu,\n", p->frames);
+    fprintf(out, "  \"draws\": %lu,\n", p->draws);
+    fprintf(out, "  \"draws_per_frame\": %.3f,\n", p->frames > 0 ? (double) p->draws / p->frames : 0.0);
+    fprintf(out, "  \"max_draws_per_frame\": %lu,\n", p->max_frame_draws);
+
+    fprintf(out, "  \"families\": [");
+    bool first = true;
+    for (int f = 0; f < FAMILY_COUNT; f++) {
+        if (p->op_count[f] == 0) {
+            continue;
+        }
+        fprintf(out, "%s\n    { \"name\": \"%s\", \"count\": %lu, \"ticks\": %llu }", first ? "" : ",",
+                families[f].name, p->op_count[f], (unsigned long long) p->op_ticks[f]);
+        first = false;
+    }
+    fprintf(out, "\n  ],\n");
+
+    unsigned short top[PROFILE_TOP];
+    int count = top_addresses(p->pc_count, top);
+
+    fprintf(out, "  \"hot_addresses\": [");
+    for (int i = 0; i < count; i++) {
+        unsigned short a = top[i];
+        fprintf(out, "%s\n    { \"pc\": \"0x%03X\", \"family\": \"%s\", \"count\": %lu, \"ticks\": %llu }", i > 0 ? "," : "",
+                a, families[p->pc_family[a]].name, p->pc_count[a], (unsigned long long) p->pc_ticks[a]);
+    }
+    fprintf(out, "\n  ],\n");
+
+    count = top_addresses(p->block_insns, top);
+
+    fprintf(out, "  \"hot_blocks\": [");
+    for (int i = 0; i < count; i++) {
+        unsigned short a = top[i];
+        fprintf(out, "%s\n    { \"pc\": \"0x%03X\", \"entries\": %lu, \"instructions\": %lu }", i > 0 ? "," : "",
+                a, p->block_count[a], p->block_insns[a]);
+    }
+    fprintf(out, "\n  ]\n");
+    fprintf(out, "}\n");
+}
+
+void write_profile_folded(chip8_profile *p, FILE *out)
+{
+    /* one stack per address, chip8;family;address weighted by host ticks */
+    for (unsigned int addr = 0; addr < MAX_MEMORY; addr++) {
+        if (p->pc_count[addr] == 0) {
+            continue;
+        }
+        fprintf(out, "chip8;%s;0x%03X %llu\n", families[p->pc_family[addr]].name, addr,
+                (unsigned long long) p->pc_ticks[addr]);
+    }
+}
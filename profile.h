@@ -0,0 +1,107 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <time.h>
+
+#include "chip8.h"
+
+/* Execution profiler
+ *
+ * Counts executions and host ticks per opcode family and per address, block
+ * entries of the threaded engine, instructions skipped while idle and draw
+ * calls per 60 Hz frame. A profile is attached to a machine with
+ * attach_profile and dumped as JSON or as folded stacks for flamegraph.pl.
+ *
+ * The hooks are only compiled in with -DCHIP8_PROFILE (make PROFILE=1).
+ * Without it the PROFILE_* macros expand to nothing and an attached profile
+ * simply stays empty.
+ */
+
+#define PROFILE_TOP  16
+
+/* Opcode families, one per instruction handler */
+typedef enum chip8_family_t {
+    FAMILY_NOP = 0,
+    FAMILY_00E0, FAMILY_00EE, FAMILY_1nnn, FAMILY_2nnn, FAMILY_3xnn, FAMILY_4xnn,
+    FAMILY_5xy0, FAMILY_6xnn, FAMILY_7xnn, FAMILY_8xy0, FAMILY_8xy1, FAMILY_8xy2,
+    FAMILY_8xy3, FAMILY_8xy4, FAMILY_8xy5, FAMILY_8xy6, FAMILY_8xy7, FAMILY_8xyE,
+    FAMILY_9xy0, FAMILY_Annn, FAMILY_Bnnn, FAMILY_Cxnn, FAMILY_Dxyn, FAMILY_Ex9E,
+    FAMILY_ExA1, FAMILY_Fx07, FAMILY_Fx0A, FAMILY_Fx15, FAMILY_Fx18, FAMILY_Fx1E,
+    FAMILY_Fx29, FAMILY_Fx33, FAMILY_Fx55, FAMILY_Fx65,
+    FAMILY_COUNT
+} chip8_family;
+
+typedef struct chip8_profile_t {
+    /* Executions and host ticks per opcode family */
+    unsigned long op_count[FAMILY_COUNT];
+    uint64_t      op_ticks[FAMILY_COUNT];
+    /* Executions, host ticks and family of the last opcode per address */
+    unsigned long pc_count[MAX_MEMORY];
+    uint64_t      pc_ticks[MAX_MEMORY];
+    unsigned char pc_family[MAX_MEMORY];
+    /* Entries and instructions run per threaded block start */
+    unsigned long block_count[MAX_MEMORY];
+    unsigned long block_insns[MAX_MEMORY];
+    /* Instructions fast-forwarded by skip_idle */
+    unsigned long idle;
+    /* Timer ticks seen and draw calls, in total and in the current frame */
+    unsigned long frames;
+    unsigned long draws;
+    unsigned long frame_draws;
+    unsigned long max_frame_draws;
+} chip8_profile;
+
+chip8_profile *create_profile        (void);
+void           destroy_profile       (chip8_profile *p);
+void           attach_profile        (chip8 *c, chip8_profile *p);
+void           write_profile_json    (chip8_profile *p, FILE *out);
+void           write_profile_folded  (chip8_profile *p, FILE *out);
+const char    *get_family_name       (chip8_family family);
+
+/* Recording, called through the macros below */
+void  profile_instruction  (chip8_profile *p, unsigned short pc, const chip8_insn *in, uint64_t ticks);
+void  profile_block        (chip8_profile *p, unsigned short pc, unsigned char length);
+void  profile_frame        (chip8_profile *p);
+void  profile_idle         (chip8_profile *p, unsigned long n);
+
+/* Host timestamp, TSC where available */
+static inline uint64_t profile_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t) t.tv_sec * 1000000000ULL + t.tv_nsec;
+#endif
+}
+
+#ifdef CHIP8_PROFILE
+
+#define PROFILE_BEGIN(c) \
+    unsigned short profile_pc    = (c)->PC; \
+    uint64_t       profile_start = (c)->profile != NULL ? profile_ticks() : 0
+
+#define PROFILE_END(c, in) \
+    do { if ((c)->profile != NULL) profile_instruction((c)->profile, profile_pc, (in), profile_ticks() - profile_start); } while (0)
+
+#define PROFILE_BLOCK(c, pc, length) \
+    do { if ((c)->profile != NULL) profile_block((c)->profile, (pc), (length)); } while (0)
+
+#define PROFILE_FRAME(c) \
+    do { if ((c)->profile != NULL) profile_frame((c)->profile); } while (0)
+
+#define PROFILE_IDLE(c, n) \
+    do { if ((c)->profile != NULL) profile_idle((c)->profile, (n)); } while (0)
+
+#else
+
+#define PROFILE_BEGIN(c)
+#define PROFILE_END(c, in)            do { } while (0)
+#define PROFILE_BLOCK(c, pc, length)  do { } while (0)
+#define PROFILE_FRAME(c)              do { } while (0)
+#define PROFILE_IDLE(c, n)            do { } while (0)
+
+#endif
+
+#endif
@@ -0,0 +1,188 @@
+#include <string.h>
+
+#include "quirks.h"
+
+#define QUIRKS_LINE_SIZE 256
+
+static const struct {
+    const char  *name;
+    chip8_quirk  quirk;
+} quirk_names[] = {
+    { "shift",     CHIP8_QUIRK_SHIFT      },
+    { "loadstore", CHIP8_QUIRK_LOAD_STORE },
+    { "jump",      CHIP8_QUIRK_JUMP       },
+    { "clip",      CHIP8_QUIRK_CLIP       }
+};
+
+bool parse_quirks(const char *names, unsigned int *quirks)
+{
+    unsigned int result = 0;
+
+    if (strcmp(names, "none") == 0) {
+        *quirks = 0;
+        return true;
+    }
+
+    while (*names != '\0') {
+        size_t length = strcspn(names, ",");
+        bool   found  = false;
+
+        for (size_t i = 0; i < sizeof(quirk_names) / sizeof(quirk_names[0]); i++) {
+            if (strlen(quirk_names[i].name) == length && strncmp(quirk_names[i].name, names, length) == 0) {
+                result |= quirk_names[i].quirk;
+                found   = true;
+            }
+        }
+
+        if (!found) {
+            return false;
+        }
+
+        names += length;
+        names += *names == ',';
+    }
+
+    *quirks = result;
+
+    return true;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+    uint64_t x = ((const chip8_rom_quirks *) a)->hash;
+    uint64_t y = ((const chip8_rom_quirks *) b)->hash;
+
+    return (x > y) - (x < y);
+}
+
+/* One line of the database, true for an entry, false for a comment or a
+ * blank line. Anything else sets bad.
+ */
+static bool parse_line(char *line, chip8_rom_quirks *entry, bool *bad)
+{
+    char *comment = strchr(line, '#');
+    char  hash[QUIRKS_LINE_SIZE], names[QUIRKS_LINE_SIZE], rest;
+
+    if (comment != NULL) {
+        *comment = '\0';
+    }
+
+    int fields = sscanf(line, "%255s %255s %c", hash, names, &rest);
+
+    if (fields <= 0) {
+        return false;
+    }
+
+    char *end;
+    entry->hash = strtoull(hash, &end, 16);
+
+    *bad = fields != 2 || strlen(hash) != 16 || *end != '\0' || !parse_quirks(names, &entry->quirks);
+
+    return !*bad;
+}
+
+chip8_quirks_db *load_quirks_db(const char *path, unsigned int *bad_line)
+{
+    FILE *fp = fopen(path, "r");
+
+    *bad_line = 0;
+
+    if (fp == NULL) {
+        return NULL;
+    }
+
+    chip8_quirks_db *db = calloc(1, sizeof(chip8_quirks_db));
+    size_t capacity = 0;
+    char   line[QUIRKS_LINE_SIZE];
+
+    if (db == NULL) {
+        fprintf(stderr, "unable to allocate quirks database\n");
+        exit(1);
+    }
+
+    for (unsigned int number = 1; fgets(line, sizeof(line), fp) != NULL; number++) {
+        chip8_rom_quirks entry;
+        bool bad = false;
+
+        if (!parse_line(line, &entry, &bad)) {
+            if (bad) {
+                *bad_line = number;
+                fclose(fp);
+                destroy_quirks_db(db);
+                return NULL;
+            }
+            continue;
+        }
+
+        if (db->count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            db->entries = realloc(db->entries, capacity * sizeof(chip8_rom_quirks));
+
+            if (db->entries == NULL) {
+                fprintf(stderr, "unable to allocate quirks database\n");
+                exit(1);
+            }
+        }
+
+        db->entries[db->count++] = entry;
+    }
+
+    fclose(fp);
+
+    qsort(db->entries, db->count, sizeof(chip8_rom_quirks), compare_entries);
+
+    return db;
+}
+
+void destroy_quirks_db(chip8_quirks_db *db)
+{
+    if (db == NULL) {
+        return;
+    }
+
+    free(db->entries);
+    free(db);
+}
+
+bool find_rom_quirks(const chip8_quirks_db *db, uint64_t hash, unsigned int *quirks)
+{
+    chip8_rom_quirks key = { hash, 0 };
+    const chip8_rom_quirks *entry = bsearch(&key, db->entries, db->count, sizeof(chip8_rom_quirks), compare_entries);
+
+    if (entry == NULL) {
+        return false;
+    }
+
+    *quirks = entry->quirks;
+
+    return true;
+}
+
+uint64_t get_program_hash(chip8 *c)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    size_t   end  = get_memory_size(c);
+
+    while (end > PROGRAM_START && get_memory_value(c, end - 1) == 0) {
+        end--;
+    }
+
+    for (size_t i = PROGRAM_START; i < end; i++) {
+        hash = (hash ^ get_memory_value(c, i)) * 0x100000001B3ULL;
+    }
+
+    return hash;
+}
+
+bool apply_rom_quirks(chip8 *c, const chip8_quirks_db *db)
+{
+    unsigned int quirks;
+
+    if (!find_rom_quirks(db, get_program_hash(c), &quirks)) {
+        return false;
+    }
+
+    set_quirks(c, quirks);
+
+    return true;
+}
@@ -0,0 +1,46 @@
+#ifndef QUIRKS_H
+#define QUIRKS_H
+
+#include "chip8.h"
+
+/* Per-ROM quirks
+ *
+ * A quirks database maps ROMs to the quirks they expect (see chip8_quirk).
+ * ROMs are keyed by get_program_hash, taken right after the ROM is loaded.
+ * The database is a text file, one ROM per line:
+ *
+ *   # comment
+ *   <hash, 16 hex digits>  <quirks>
+ *
+ * where quirks is none or a comma separated list of shift, loadstore, jump
+ * and clip. Entries are sorted once loaded, so a lookup is a binary search.
+ */
+
+typedef struct chip8_rom_quirks_t {
+    uint64_t     hash;
+    unsigned int quirks;
+} chip8_rom_quirks;
+
+typedef struct chip8_quirks_db_t {
+    chip8_rom_quirks *entries;
+    size_t            count;
+} chip8_quirks_db;
+
+/* NULL if the file can't be read or a line is malformed, bad_line is then
+ * that line's number or 0 for an unreadable file
+ */
+chip8_quirks_db  *load_quirks_db     (const char *path, unsigned int *bad_line);
+void              destroy_quirks_db  (chip8_quirks_db *db);
+bool              find_rom_quirks    (const chip8_quirks_db *db, uint64_t hash, unsigned int *quirks);
+
+/* FNV-1a of the program area up to its last non-zero byte, so a ROM hashes
+ * the same on every profile
+ */
+uint64_t          get_program_hash   (chip8 *c);
+/* Sets the quirks db has for the loaded ROM, false if it has none */
+bool              apply_rom_quirks   (chip8 *c, const chip8_quirks_db *db);
+
+/* none, or names separated by commas, false for an unknown name */
+bool              parse_quirks       (const char *names, unsigned int *quirks);
+
+#endif
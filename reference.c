@@ -0,0 +1,393 @@
+#include <string.h>
+
+#include "reference.h"
+
+void reset_reference(chip8_ref *r, chip8_variant variant, unsigned int quirks,
+                     const unsigned char *program, size_t size)
+{
+    memset(r, 0, sizeof(*r));
+
+    r->variant     = variant;
+    r->quirks      = quirks;
+    r->memory_size = variant == CHIP8_VARIANT_XOCHIP ? XO_MEMORY : MAX_MEMORY;
+
+    size_t max_program = r->memory_size - PROGRAM_START;
+
+    memcpy(&r->memory[0x50], fontset, 80);
+    if (variant != CHIP8_VARIANT_CHIP8) {
+        memcpy(&r->memory[0xA0], bigfont, 160);
+    }
+    memcpy(&r->memory[PROGRAM_START], program, size < max_program ? size : max_program);
+
+    r->PC    = PROGRAM_START;
+    r->key   = -1;
+    r->plane = 1;
+    r->cycles_per_frame = CYCLES_PER_FRAME;
+
+    seed_reference(r, 0);
+}
+
+void seed_reference(chip8_ref *r, uint64_t seed)
+{
+    uint64_t z = seed + 0x9E3779B97F4A7C15ULL;
+
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z =  z ^ (z >> 31);
+
+    r->rng = z != 0 ? z : 1;
+}
+
+static unsigned char random_byte(chip8_ref *r)
+{
+    r->rng ^= r->rng >> 12;
+    r->rng ^= r->rng << 25;
+    r->rng ^= r->rng >> 27;
+
+    return (r->rng * 0x2545F4914F6CDD1DULL) >> 56;
+}
+
+void press_reference_key(chip8_ref *r, unsigned char key)
+{
+    r->keys[key & 0xF] = 1;
+    r->key = key & 0xF;
+}
+
+void release_reference_key(chip8_ref *r, unsigned char key)
+{
+    r->keys[key & 0xF] = 0;
+}
+
+static unsigned char peek(chip8_ref *r, unsigned int addr)
+{
+    return r->memory[addr % r->memory_size];
+}
+
+static void poke(chip8_ref *r, unsigned int addr, unsigned char value)
+{
+    r->memory[addr % r->memory_size] = value;
+}
+
+static bool quirk(chip8_ref *r, chip8_quirk q)
+{
+    return (r->quirks & q) != 0;
+}
+
+/* Plot one sprite pixel, true if it erased a lit one */
+static bool plot(chip8_ref *r, unsigned int x, unsigned int y)
+{
+    uint64_t bit = 1ULL << (W_WIDTH - 1 - x % W_WIDTH);
+    uint64_t *row = &r->rows[y % W_HEIGHT];
+    bool erased = (*row & bit) != 0;
+
+    *row ^= bit;
+
+    return erased;
+}
+
+/* Extended profiles from here on, sizes are in pixels of the display */
+static void clear_planes(chip8_ref *r, unsigned char planes)
+{
+    for (int p = 0; p < MAX_PLANES; p++) {
+        if (planes & (1 << p)) {
+            memset(r->pixels[p], 0, sizeof(r->pixels[p]));
+        }
+    }
+}
+
+/* What leaves the display is lost, what comes in is blank */
+static void scroll(chip8_ref *r, int dx, int dy)
+{
+    int size = r->hires ? 1 : 2;
+
+    dx *= size;
+    dy *= size;
+
+    for (int p = 0; p < MAX_PLANES; p++) {
+        if ((r->plane & (1 << p)) == 0) {
+            continue;
+        }
+
+        unsigned char old[HIRES_HEIGHT][HIRES_WIDTH];
+        memcpy(old, r->pixels[p], sizeof(old));
+
+        for (int y = 0; y < HIRES_HEIGHT; y++) {
+            for (int x = 0; x < HIRES_WIDTH; x++) {
+                int from_x = x - dx, from_y = y - dy;
+                bool inside = from_x >= 0 && from_x < HIRES_WIDTH && from_y >= 0 && from_y < HIRES_HEIGHT;
+
+                r->pixels[p][y][x] = inside ? old[from_y][from_x] : 0;
+            }
+        }
+    }
+}
+
+/* Dxyn of the extended profiles, one sprite per selected plane one after
+ * the other in memory, 16x16 for Dxy0. SUPER-CHIP in hi-res sets VF to the
+ * rows that collided plus the rows cut off at the bottom.
+ */
+static void draw_extended(chip8_ref *r, unsigned char vx, unsigned char vy, unsigned char n)
+{
+    unsigned int   size   = r->hires ? 1 : 2;
+    unsigned int   width  = HIRES_WIDTH / size;
+    unsigned int   height = HIRES_HEIGHT / size;
+    unsigned int   bytes  = n == 0 ? 2 : 1;
+    unsigned int   lines  = n == 0 ? 16 : n;
+    unsigned int   px     = vx % width;
+    unsigned int   py     = vy % height;
+    bool           clip   = quirk(r, CHIP8_QUIRK_CLIP);
+    unsigned short addr   = r->I;
+    unsigned int   hit = 0, clipped = 0;
+
+    for (int p = 0; p < MAX_PLANES; p++) {
+        if ((r->plane & (1 << p)) == 0) {
+            continue;
+        }
+
+        for (unsigned int i = 0; i < lines; i++) {
+            unsigned int bits = peek(r, addr);
+            bool collided = false;
+
+            if (bytes == 2) {
+                bits = bits << 8 | peek(r, addr + 1);
+            }
+            addr += bytes;
+
+            if (clip && py + i >= height) {
+                clipped++;
+                continue;
+            }
+
+            for (unsigned int b = 0; b < bytes * 8; b++) {
+                unsigned int x = px + b, y = py + i;
+
+                if ((bits & (1u << (bytes * 8 - 1 - b))) == 0 || (clip && x >= width)) {
+                    continue;
+                }
+
+                // a pixel of the current mode is size by size display pixels
+                for (unsigned int dy = 0; dy < size; dy++) {
+                    for (unsigned int dx = 0; dx < size; dx++) {
+                        unsigned char *pixel = &r->pixels[p][y % height * size + dy][x % width * size + dx];
+
+                        collided |= *pixel;
+                        *pixel   ^= 1;
+                    }
+                }
+            }
+
+            hit += collided;
+        }
+    }
+
+    if (r->variant == CHIP8_VARIANT_SCHIP && r->hires) {
+        r->V[0xF] = hit + clipped;
+    } else {
+        r->V[0xF] = hit != 0;
+    }
+}
+
+/* Skips step over the whole of F000 nnnn on XO-CHIP */
+static void skip(chip8_ref *r)
+{
+    if (r->variant == CHIP8_VARIANT_XOCHIP && peek(r, r->PC) == 0xF0 && peek(r, r->PC + 1) == 0x00) {
+        r->PC += 2;
+    }
+    r->PC += 2;
+}
+
+void step_reference(chip8_ref *r)
+{
+    unsigned short opcode = (peek(r, r->PC) << 8) | peek(r, r->PC + 1);
+    unsigned short nnn = opcode & 0x0FFF;
+    unsigned char  nn  = opcode & 0x00FF;
+    unsigned char  n   = opcode & 0x000F;
+    unsigned char  x   = (opcode >> 8) & 0xF;
+    unsigned char  y   = (opcode >> 4) & 0xF;
+    unsigned char *V   = r->V;
+    bool extended = r->variant != CHIP8_VARIANT_CHIP8;
+    bool xo       = r->variant == CHIP8_VARIANT_XOCHIP;
+
+    r->PC += 2;
+
+    switch (opcode >> 12) {
+        case 0x0:
+            if (opcode == 0x00E0 && extended) {
+                clear_planes(r, r->plane);
+            } else if (opcode == 0x00E0) {
+                memset(r->rows, 0, sizeof(r->rows));
+            } else if (opcode == 0x00EE) {
+                // the stack holds the call, return to the instruction after it
+                r->PC = r->stack[r->SP & 0xF] + 2;
+                r->stack[r->SP & 0xF] = 0;
+                r->SP--;
+            } else if (extended && (opcode & 0xFFF0) == 0x00C0 && n != 0) {
+                scroll(r, 0, n);
+            } else if (xo && (opcode & 0xFFF0) == 0x00D0 && n != 0) {
+                scroll(r, 0, -n);
+            } else if (extended && opcode == 0x00FB) {
+                scroll(r, 4, 0);
+            } else if (extended && opcode == 0x00FC) {
+                scroll(r, -4, 0);
+            } else if (extended && opcode == 0x00FD) {
+                // exit, the machine stays put
+                r->PC -= 2;
+            } else if (extended && (opcode == 0x00FE || opcode == 0x00FF)) {
+                r->hires = opcode == 0x00FF;
+
+                // XO-CHIP clears every plane when the resolution changes
+                if (xo) {
+                    clear_planes(r, 3);
+                }
+            }
+            break;
+        case 0x1:
+            r->PC = nnn;
+            break;
+        case 0x2:
+            r->SP++;
+            r->stack[r->SP & 0xF] = r->PC - 2;
+            r->PC = nnn;
+            break;
+        case 0x3:
+            if (V[x] == nn) skip(r);
+            break;
+        case 0x4:
+            if (V[x] != nn) skip(r);
+            break;
+        case 0x5:
+            if (xo && n == 2) {
+                // VX to VY, counting down if x > y, I stays
+                for (int i = 0; i <= abs(x - y); i++) {
+                    poke(r, r->I + i, V[x <= y ? x + i : x - i]);
+                }
+            } else if (xo && n == 3) {
+                for (int i = 0; i <= abs(x - y); i++) {
+                    V[x <= y ? x + i : x - i] = peek(r, r->I + i);
+                }
+            } else if (V[x] == V[y]) {
+                skip(r);
+            }
+            break;
+        case 0x6:
+            V[x] = nn;
+            break;
+        case 0x7:
+            V[x] += nn;
+            break;
+        case 0x8: {
+            unsigned char a = V[x], b = V[y];
+            unsigned char s = quirk(r, CHIP8_QUIRK_SHIFT) ? a : b;
+
+            switch (n) {
+                case 0x0: V[x] = b; break;
+                case 0x1: V[x] = a | b; break;
+                case 0x2: V[x] = a & b; break;
+                case 0x3: V[x] = a ^ b; break;
+                case 0x4: V[x] = a + b; V[0xF] = a + b > 0xFF; break;
+                case 0x5: V[x] = a - b; V[0xF] = a >= b; break;
+                case 0x6: V[x] = s >> 1; V[0xF] = s & 1; break;
+                case 0x7: V[x] = b - a; V[0xF] = b >= a; break;
+                case 0xE: V[x] = s << 1; V[0xF] = s >> 7; break;
+            }
+            break;
+        }
+        case 0x9:
+            if (V[x] != V[y]) skip(r);
+            break;
+        case 0xA:
+            r->I = nnn;
+            break;
+        case 0xB:
+            r->PC = nnn + V[quirk(r, CHIP8_QUIRK_JUMP) ? x : 0];
+            break;
+        case 0xC:
+            V[x] = random_byte(r) & nn;
+            break;
+        case 0xD: {
+            if (extended) {
+                draw_extended(r, V[x], V[y], n);
+                break;
+            }
+
+            unsigned int px = V[x] % W_WIDTH;
+            unsigned int py = V[y] % W_HEIGHT;
+            bool clip = quirk(r, CHIP8_QUIRK_CLIP);
+            bool erased = false;
+
+            for (unsigned int i = 0; i < n; i++) {
+                unsigned char sprite = peek(r, r->I + i);
+
+                for (unsigned int b = 0; b < 8; b++) {
+                    if (clip && (px + b >= W_WIDTH || py + i >= W_HEIGHT)) {
+                        continue;
+                    }
+                    if (sprite & (0x80 >> b)) {
+                        erased |= plot(r, px + b, py + i);
+                    }
+                }
+            }
+            V[0xF] = erased;
+            break;
+        }
+        case 0xE:
+            if (nn == 0x9E && r->keys[V[x] & 0xF]) skip(r);
+            else if (nn == 0xA1 && !r->keys[V[x] & 0xF]) skip(r);
+            break;
+        case 0xF:
+            if (xo && opcode == 0xF000) {
+                // the address is the next word
+                r->I = peek(r, r->PC) << 8 | peek(r, r->PC + 1);
+                r->PC += 2;
+                break;
+            }
+
+            switch (nn) {
+                case 0x01: if (xo) r->plane = x & 3; break;
+                case 0x07: V[x] = r->DT; break;
+                case 0x0A:
+                    if (r->key >= 0) {
+                        V[x] = r->key;
+                        r->key = -1;
+                        r->waiting = false;
+                    } else {
+                        // run it again until a key comes in
+                        r->waiting = true;
+                        r->PC -= 2;
+                    }
+                    break;
+                case 0x15: r->DT = V[x]; break;
+                case 0x18: r->ST = V[x]; break;
+                case 0x1E: r->I += V[x]; break;
+                case 0x29: r->I = 0x50 + V[x] * 5; break;
+                case 0x30: if (extended) r->I = 0xA0 + (V[x] & 0xF) * 10; break;
+                case 0x33:
+                    poke(r, r->I,     V[x] / 100);
+                    poke(r, r->I + 1, V[x] / 10 % 10);
+                    poke(r, r->I + 2, V[x] % 10);
+                    break;
+                case 0x55:
+                    for (unsigned int i = 0; i <= x; i++) {
+                        poke(r, r->I + i, V[i]);
+                    }
+                    if (!quirk(r, CHIP8_QUIRK_LOAD_STORE)) r->I += x + 1;
+                    break;
+                case 0x65:
+                    for (unsigned int i = 0; i <= x; i++) {
+                        V[i] = peek(r, r->I + i);
+                    }
+                    if (!quirk(r, CHIP8_QUIRK_LOAD_STORE)) r->I += x + 1;
+                    break;
+                case 0x75: if (extended) memcpy(r->flags, V, x + 1); break;
+                case 0x85: if (extended) memcpy(V, r->flags, x + 1); break;
+            }
+            break;
+    }
+
+    r->cycles++;
+
+    if (r->cycles % r->cycles_per_frame == 0) {
+        if (r->DT > 0) r->DT--;
+        if (r->ST > 0) r->ST--;
+    }
+}
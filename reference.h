@@ -0,0 +1,70 @@
+#ifndef REFERENCE_H
+#define REFERENCE_H
+
+#include "chip8.h"
+
+/* Reference executor
+ *
+ * A second CHIP-8 implementation kept as plain as possible: flat memory, a
+ * flat display, one switch over the opcode, no caches, no sharing and no
+ * fast paths. It increments PC at fetch like the textbook interpreters do,
+ * the core increments after the instruction, so control flow is checked
+ * against an independent model rather than a copy of the same code.
+ *
+ * Everything else follows the rules of the core: the timers tick once every
+ * cycles_per_frame instructions, Fx0A takes the last key pressed since the
+ * previous Fx0A, the stack holds the address of each call and wraps after
+ * 16 entries, sprites wrap around the screen, 8xy6 and 8xyE shift VY, Fx55
+ * and Fx65 advance I, and Cxnn draws from the same generator as seed_random.
+ * The quirks given to reset_reference change those four the way chip8_quirk
+ * describes.
+ *
+ * The extended profiles (see variant.h) keep a byte per pixel of each plane
+ * at 128x64 and plot, scroll and clip one pixel at a time, where the core
+ * shifts whole rows.
+ *
+ * Only chip8-diff links it in, it is not part of libchip8.
+ */
+
+typedef struct chip8_ref_t {
+    chip8_variant  variant;
+    unsigned int   quirks;
+    unsigned int   memory_size;
+    unsigned char  memory[XO_MEMORY];
+    unsigned char  V[16];
+    unsigned short I;
+    unsigned short PC;
+    unsigned char  SP;
+    unsigned short stack[16];
+    unsigned char  keys[16];
+    unsigned char  DT, ST;
+    uint64_t       rows[W_HEIGHT];
+
+    /* Extended profiles, the planes, hi-res mode, the planes drawn to and
+     * the flag registers
+     */
+    unsigned char  pixels[MAX_PLANES][HIRES_HEIGHT][HIRES_WIDTH];
+    bool           hires;
+    unsigned char  plane;
+    unsigned char  flags[16];
+
+    /* Fx0A is waiting, and the key it will take, -1 for none */
+    bool           waiting;
+    int            key;
+
+    unsigned long  cycles;
+    unsigned int   cycles_per_frame;
+    uint64_t       rng;
+} chip8_ref;
+
+/* Start over as the given profile with a program image loaded at
+ * PROGRAM_START
+ */
+void  reset_reference        (chip8_ref *r, chip8_variant variant, unsigned int quirks,
+                              const unsigned char *program, size_t size);
+void  seed_reference         (chip8_ref *r, uint64_t seed);
+void  step_reference         (chip8_ref *r);
+void  press_reference_key    (chip8_ref *r, unsigned char key);
+void  release_reference_key  (chip8_ref *r, unsigned char key);
+
+#endif
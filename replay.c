@@ -0,0 +1,373 @@
+#include <string.h>
+
+#include "replay.h"
+
+chip8_replay *create_replay(void)
+{
+    chip8_replay *r = calloc(1, sizeof(chip8_replay));
+
+    if (r == NULL) {
+        fprintf(stderr, "unable to allocate replay\n");
+        exit(1);
+    }
+
+    return r;
+}
+
+void destroy_replay(chip8_replay *r)
+{
+    if (r == NULL) {
+        return;
+    }
+
+    free(r->events);
+    free(r->hashes);
+    free(r);
+}
+
+/* FNV-1a over the program area, then the profile and quirks if they aren't
+ * the classic ones so classic replays keep their hash
+ */
+static uint64_t get_rom_hash(chip8 *c)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    int      size = get_memory_size(c);
+
+    for (int i = PROGRAM_START; i < size; i++) {
+        hash = (hash ^ get_memory_value(c, i)) * 0x100000001B3ULL;
+    }
+    if (c->variant != CHIP8_VARIANT_CHIP8) {
+        hash = (hash ^ c->variant) * 0x100000001B3ULL;
+    }
+    if (c->quirks != get_default_quirks(c->variant)) {
+        hash = (hash ^ (0x100 | c->quirks)) * 0x100000001B3ULL;
+    }
+
+    return hash;
+}
+
+static void reset_replay(chip8_replay *r, chip8 *c)
+{
+    r->last_hash   = get_display_hash(c);
+    r->next_hash   = 0;
+    r->diverged    = false;
+    r->diverged_at = 0;
+}
+
+void start_recording(chip8 *c, chip8_replay *r, uint64_t seed)
+{
+    r->seed             = seed;
+    r->cycles_per_frame = c->cycles_per_frame;
+    r->rom_hash         = get_rom_hash(c);
+    r->frames           = 0;
+    r->event_count      = 0;
+    r->hash_count       = 0;
+    r->verifying        = false;
+
+    seed_random(c, seed);
+    reset_replay(r, c);
+
+    c->replay = r;
+}
+
+void stop_recording(chip8 *c)
+{
+    if (c->replay == NULL) {
+        return;
+    }
+
+    c->replay->frames = get_frame(c);
+    c->replay = NULL;
+}
+
+void replay_key(chip8_replay *r, unsigned long frame, unsigned char key, bool pressed)
+{
+    if (r->verifying) {
+        return;
+    }
+
+    if (r->event_count == r->event_capacity) {
+        unsigned int     capacity = r->event_capacity ? r->event_capacity * 2 : 256;
+        chip8_key_event *events   = realloc(r->events, capacity * sizeof(chip8_key_event));
+
+        if (events == NULL) {
+            fprintf(stderr, "unable to allocate replay events\n");
+            exit(1);
+        }
+        r->events         = events;
+        r->event_capacity = capacity;
+    }
+
+    chip8_key_event *e = &r->events[r->event_count++];
+    e->frame   = frame;
+    e->key     = key & 0xF;
+    e->pressed = pressed;
+}
+
+static void add_hash(chip8_replay *r, unsigned long frame, uint64_t hash)
+{
+    if (r->hash_count == r->hash_capacity) {
+        unsigned int      capacity = r->hash_capacity ? r->hash_capacity * 2 : 1024;
+        chip8_frame_hash *hashes   = realloc(r->hashes, capacity * sizeof(chip8_frame_hash));
+
+        if (hashes == NULL) {
+            fprintf(stderr, "unable to allocate replay hashes\n");
+            exit(1);
+        }
+        r->hashes        = hashes;
+        r->hash_capacity = capacity;
+    }
+
+    r->hashes[r->hash_count].frame = frame;
+    r->hashes[r->hash_count].hash  = hash;
+    r->hash_count++;
+}
+
+void replay_frame(chip8_replay *r, chip8 *c)
+{
+    uint64_t hash = get_display_hash(c);
+
+    /* rows were drawn but the picture is the same */
+    if (hash == r->last_hash) {
+        return;
+    }
+    r->last_hash = hash;
+
+    unsigned long frame = get_frame(c);
+
+    if (!r->verifying) {
+        add_hash(r, frame, hash);
+        return;
+    }
+
+    if (r->diverged) {
+        return;
+    }
+
+    const chip8_frame_hash *expected = r->next_hash < r->hash_count ? &r->hashes[r->next_hash] : NULL;
+
+    if (expected == NULL || expected->frame != frame || expected->hash != hash) {
+        r->diverged    = true;
+        r->diverged_at = expected != NULL && expected->frame < frame ? expected->frame : frame;
+        return;
+    }
+
+    r->next_hash++;
+}
+
+chip8_replay_result play_replay(chip8 *c, chip8_replay *r, unsigned long *frame)
+{
+    if (get_rom_hash(c) != r->rom_hash) {
+        return CHIP8_REPLAY_WRONG_ROM;
+    }
+
+    set_cycles_per_frame(c, r->cycles_per_frame);
+    seed_random(c, r->seed);
+
+    r->verifying = true;
+    reset_replay(r, c);
+    c->replay = r;
+
+    unsigned int e = 0;
+
+    for (unsigned long f = get_frame(c); f < r->frames && !r->diverged; f++) {
+        /* the same place the frontend applied them, at the start of a frame */
+        for (; e < r->event_count && r->events[e].frame <= f; e++) {
+            if (r->events[e].pressed) {
+                press_key(c, r->events[e].key);
+            } else {
+                release_key(c, r->events[e].key);
+            }
+        }
+
+        run_cycles(c, c->cycles_per_frame);
+    }
+
+    c->replay = NULL;
+    r->verifying = false;
+
+    /* the display stopped changing before the recording did */
+    if (!r->diverged && r->next_hash < r->hash_count) {
+        r->diverged    = true;
+        r->diverged_at = r->hashes[r->next_hash].frame;
+    }
+
+    if (frame != NULL) {
+        *frame = r->diverged ? r->diverged_at : r->frames;
+    }
+
+    return r->diverged ? CHIP8_REPLAY_DIVERGED : CHIP8_REPLAY_OK;
+}
+
+/* File format helpers */
+static void put_u32(FILE *fp, uint32_t v)
+{
+    for (int i = 0; i < 4; i++) {
+        fputc((v >> (i * 8)) & 0xFF, fp);
+    }
+}
+
+static void put_u64(FILE *fp, uint64_t v)
+{
+    for (int i = 0; i < 8; i++) {
+        fputc((v >> (i * 8)) & 0xFF, fp);
+    }
+}
+
+static void put_varint(FILE *fp, uint64_t v)
+{
+    while (v >= 0x80) {
+        fputc((v & 0x7F) | 0x80, fp);
+        v >>= 7;
+    }
+    fputc(v, fp);
+}
+
+static uint64_t get_uint(FILE *fp, int bytes, bool *truncated)
+{
+    uint64_t v = 0;
+
+    for (int i = 0; i < bytes; i++) {
+        int b = fgetc(fp);
+        if (b == EOF) {
+            *truncated = true;
+            return 0;
+        }
+        v |= (uint64_t) b << (i * 8);
+    }
+
+    return v;
+}
+
+static uint64_t get_varint(FILE *fp, bool *truncated)
+{
+    uint64_t v = 0;
+
+    for (int shift = 0; shift < 64; shift += 7) {
+        int b = fgetc(fp);
+        if (b == EOF) {
+            *truncated = true;
+            return 0;
+        }
+        v |= (uint64_t) (b & 0x7F) << shift;
+        if ((b & 0x80) == 0) {
+            break;
+        }
+    }
+
+    return v;
+}
+
+chip8_replay_result save_replay(chip8_replay *r, const char *path)
+{
+    FILE *fp = fopen(path, "wb");
+
+    if (fp == NULL) {
+        return CHIP8_REPLAY_OPEN;
+    }
+
+    fwrite("C8RP", 1, 4, fp);
+    fputc(REPLAY_VERSION, fp);
+    put_u32(fp, r->cycles_per_frame);
+    put_u64(fp, r->seed);
+    put_u64(fp, r->rom_hash);
+    put_varint(fp, r->frames);
+    put_varint(fp, r->event_count);
+    put_varint(fp, r->hash_count);
+
+    unsigned long last = 0;
+    for (unsigned int i = 0; i < r->event_count; i++) {
+        put_varint(fp, r->events[i].frame - last);
+        fputc(r->events[i].key | (r->events[i].pressed << 7), fp);
+        last = r->events[i].frame;
+    }
+
+    last = 0;
+    for (unsigned int i = 0; i < r->hash_count; i++) {
+        put_varint(fp, r->hashes[i].frame - last);
+        put_u64(fp, r->hashes[i].hash);
+        last = r->hashes[i].frame;
+    }
+
+    bool failed = ferror(fp);
+
+    if (fclose(fp) != 0 || failed) {
+        return CHIP8_REPLAY_WRITE;
+    }
+
+    return CHIP8_REPLAY_OK;
+}
+
+chip8_replay_result load_replay(chip8_replay *r, const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    char magic[4];
+    bool truncated = false;
+
+    if (fp == NULL) {
+        return CHIP8_REPLAY_OPEN;
+    }
+
+    if (fread(magic, 1, 4, fp) != 4 || memcmp(magic, "C8RP", 4) != 0) {
+        fclose(fp);
+        return CHIP8_REPLAY_BAD_MAGIC;
+    }
+    if (fgetc(fp) != REPLAY_VERSION) {
+        fclose(fp);
+        return CHIP8_REPLAY_BAD_VERSION;
+    }
+
+    r->cycles_per_frame = get_uint(fp, 4, &truncated);
+    r->seed             = get_uint(fp, 8, &truncated);
+    r->rom_hash         = get_uint(fp, 8, &truncated);
+    r->frames           = get_varint(fp, &truncated);
+
+    unsigned int events = get_varint(fp, &truncated);
+    unsigned int hashes = get_varint(fp, &truncated);
+
+    r->event_count = 0;
+    r->hash_count  = 0;
+    r->verifying   = false;
+
+    unsigned long frame = 0;
+    for (unsigned int i = 0; i < events && !truncated; i++) {
+        frame += get_varint(fp, &truncated);
+
+        int b = fgetc(fp);
+        if (b == EOF) {
+            truncated = true;
+            break;
+        }
+        replay_key(r, frame, b & 0xF, (b & 0x80) != 0);
+    }
+
+    frame = 0;
+    for (unsigned int i = 0; i < hashes && !truncated; i++) {
+        frame += get_varint(fp, &truncated);
+
+        uint64_t hash = get_uint(fp, 8, &truncated);
+        if (!truncated) {
+            add_hash(r, frame, hash);
+        }
+    }
+
+    fclose(fp);
+
+    return truncated ? CHIP8_REPLAY_TRUNCATED : CHIP8_REPLAY_OK;
+}
+
+const char *get_replay_error(chip8_replay_result result)
+{
+    switch (result) {
+        case CHIP8_REPLAY_OK:          return "ok";
+        case CHIP8_REPLAY_OPEN:        return "unable to open file";
+        case CHIP8_REPLAY_WRITE:       return "unable to write file";
+        case CHIP8_REPLAY_BAD_MAGIC:   return "not a replay";
+        case CHIP8_REPLAY_BAD_VERSION: return "unsupported replay version";
+        case CHIP8_REPLAY_TRUNCATED:   return "replay is truncated";
+        case CHIP8_REPLAY_WRONG_ROM:   return "replay was recorded with another ROM, profile or quirks";
+        case CHIP8_REPLAY_DIVERGED:    return "replay diverged";
+    }
+
+    return "unknown error";
+}
@@ -0,0 +1,84 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include "chip8.h"
+#include "input.h"
+
+/* Replays
+ *
+ * A replay is everything needed to rerun a session exactly: the seed of the
+ * random number generator, the instructions per frame, the key events
+ * stamped with the frame they were applied at, and a hash of the display at
+ * every frame boundary where it changed. Runs only depend on these (the
+ * timers follow the instruction count), so playing a replay headlessly
+ * reproduces the session instruction by instruction, at full host speed.
+ *
+ * A replay is attached to a machine right after the ROM is loaded with
+ * start_recording. The core then logs key presses and releases and frame
+ * hashes until stop_recording. play_replay reruns it on a freshly loaded
+ * machine and reports the first frame whose display differs.
+ *
+ * File layout, integers little-endian, counts and frame deltas as LEB128:
+ *
+ *   "C8RP" version cycles_per_frame(32-bit) seed(64-bit) rom_hash(64-bit)
+ *   frames events hashes
+ *   events times: frame delta, key | pressed << 7
+ *   hashes times: frame delta, hash(64-bit)
+ */
+
+#define REPLAY_VERSION  1
+
+typedef enum chip8_replay_result_t {
+    CHIP8_REPLAY_OK = 0,
+    CHIP8_REPLAY_OPEN,
+    CHIP8_REPLAY_WRITE,
+    CHIP8_REPLAY_BAD_MAGIC,
+    CHIP8_REPLAY_BAD_VERSION,
+    CHIP8_REPLAY_TRUNCATED,
+    CHIP8_REPLAY_WRONG_ROM,
+    CHIP8_REPLAY_DIVERGED
+} chip8_replay_result;
+
+typedef struct chip8_frame_hash_t {
+    unsigned long frame;
+    uint64_t      hash;
+} chip8_frame_hash;
+
+typedef struct chip8_replay_t {
+    uint64_t          seed;
+    unsigned int      cycles_per_frame;
+    /* Hash of the loaded program and profile, a replay only fits the ROM it
+     * was made with
+     */
+    uint64_t          rom_hash;
+    /* Length of the session */
+    unsigned long     frames;
+
+    chip8_key_event  *events;
+    unsigned int      event_count, event_capacity;
+    chip8_frame_hash *hashes;
+    unsigned int      hash_count, hash_capacity;
+
+    /* Recording or checking, display hash at the last boundary */
+    bool              verifying;
+    uint64_t          last_hash;
+    /* Next hash to check and the first frame that didn't match */
+    unsigned int      next_hash;
+    bool              diverged;
+    unsigned long     diverged_at;
+} chip8_replay;
+
+chip8_replay        *create_replay     (void);
+void                 destroy_replay    (chip8_replay *r);
+void                 start_recording   (chip8 *c, chip8_replay *r, uint64_t seed);
+void                 stop_recording    (chip8 *c);
+chip8_replay_result  play_replay       (chip8 *c, chip8_replay *r, unsigned long *frame);
+chip8_replay_result  save_replay       (chip8_replay *r, const char *path);
+chip8_replay_result  load_replay       (chip8_replay *r, const char *path);
+const char          *get_replay_error  (chip8_replay_result result);
+
+/* Called by the core while a replay is attached */
+void  replay_key    (chip8_replay *r, unsigned long frame, unsigned char key, bool pressed);
+void  replay_frame  (chip8_replay *r, chip8 *c);
+
+#endif
@@ -0,0 +1,348 @@
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCALE_X86
+#endif
+
+#include "scale.h"
+
+const chip8_palette palettes[] = {
+    { "mono",  0xFFFFFFFF, 0xFF000000, 0xFF808080, 0xFFC0C0C0 },
+    { "green", 0xFF33FF66, 0xFF0A1A0F, 0xFF1A8033, 0xFF26BF4D },
+    { "amber", 0xFFFFB000, 0xFF1F1200, 0xFF805800, 0xFFBF8400 },
+    { "lcd",   0xFF0F380F, 0xFF9BBC0F, 0xFF8BAC0F, 0xFF306230 },
+    { "paper", 0xFF202020, 0xFFF0EAD6, 0xFFA0A0A0, 0xFF606060 }
+};
+
+const int palette_count = sizeof(palettes) / sizeof(palettes[0]);
+
+/* Writes n columns of one row half, n is a multiple of 32 */
+typedef void (*expand_function)(const uint32_t *masks, unsigned int n, uint32_t word, uint32_t on, uint32_t off, uint32_t *out);
+
+static void expand_scalar(const uint32_t *masks, unsigned int n, uint32_t word, uint32_t on, uint32_t off, uint32_t *out)
+{
+    for (unsigned int i = 0; i < n; i++) {
+        out[i] = word & masks[i] ? on : off;
+    }
+}
+
+#ifdef SCALE_X86
+__attribute__((target("sse2")))
+static void expand_sse2(const uint32_t *masks, unsigned int n, uint32_t word, uint32_t on, uint32_t off, uint32_t *out)
+{
+    __m128i w   = _mm_set1_epi32(word);
+    __m128i fg  = _mm_set1_epi32(on);
+    __m128i bg  = _mm_set1_epi32(off);
+
+    for (unsigned int i = 0; i < n; i += 4) {
+        __m128i m   = _mm_load_si128((const __m128i *) &masks[i]);
+        // all ones in the columns whose bit is set
+        __m128i lit = _mm_cmpeq_epi32(_mm_and_si128(w, m), m);
+
+        _mm_storeu_si128((__m128i *) &out[i], _mm_or_si128(_mm_and_si128(lit, fg), _mm_andnot_si128(lit, bg)));
+    }
+}
+
+__attribute__((target("avx2")))
+static void expand_avx2(const uint32_t *masks, unsigned int n, uint32_t word, uint32_t on, uint32_t off, uint32_t *out)
+{
+    __m256i w   = _mm256_set1_epi32(word);
+    __m256i fg  = _mm256_set1_epi32(on);
+    __m256i bg  = _mm256_set1_epi32(off);
+
+    for (unsigned int i = 0; i < n; i += 8) {
+        __m256i m   = _mm256_load_si256((const __m256i *) &masks[i]);
+        __m256i lit = _mm256_cmpeq_epi32(_mm256_and_si256(w, m), m);
+
+        _mm256_storeu_si256((__m256i *) &out[i], _mm256_blendv_epi8(bg, fg, lit));
+    }
+}
+
+static const expand_function kernels[] = { expand_scalar, expand_sse2, expand_avx2 };
+#else
+static const expand_function kernels[] = { expand_scalar, expand_scalar, expand_scalar };
+#endif
+
+/* Writes n columns of one row quarter from both planes, colors indexed by
+ * the plane bits
+ */
+typedef void (*expand_planes_function)(const uint32_t *masks, unsigned int n, uint32_t first, uint32_t second, const uint32_t *colors, uint32_t *out);
+
+static void expand_planes_scalar(const uint32_t *masks, unsigned int n, uint32_t first, uint32_t second, const uint32_t *colors, uint32_t *out)
+{
+    for (unsigned int i = 0; i < n; i++) {
+        out[i] = colors[((first & masks[i]) != 0) | ((second & masks[i]) != 0) << 1];
+    }
+}
+
+#ifdef SCALE_X86
+__attribute__((target("sse2")))
+static inline __m128i select_sse2(__m128i lit, __m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_and_si128(lit, a), _mm_andnot_si128(lit, b));
+}
+
+__attribute__((target("sse2")))
+static void expand_planes_sse2(const uint32_t *masks, unsigned int n, uint32_t first, uint32_t second, const uint32_t *colors, uint32_t *out)
+{
+    __m128i w0 = _mm_set1_epi32(first);
+    __m128i w1 = _mm_set1_epi32(second);
+    __m128i c0 = _mm_set1_epi32(colors[0]);
+    __m128i c1 = _mm_set1_epi32(colors[1]);
+    __m128i c2 = _mm_set1_epi32(colors[2]);
+    __m128i c3 = _mm_set1_epi32(colors[3]);
+
+    for (unsigned int i = 0; i < n; i += 4) {
+        __m128i m    = _mm_load_si128((const __m128i *) &masks[i]);
+        __m128i lit0 = _mm_cmpeq_epi32(_mm_and_si128(w0, m), m);
+        __m128i lit1 = _mm_cmpeq_epi32(_mm_and_si128(w1, m), m);
+
+        // the first plane picks within each pair, the second between them
+        __m128i low  = select_sse2(lit0, c1, c0);
+        __m128i high = select_sse2(lit0, c3, c2);
+
+        _mm_storeu_si128((__m128i *) &out[i], select_sse2(lit1, high, low));
+    }
+}
+
+__attribute__((target("avx2")))
+static void expand_planes_avx2(const uint32_t *masks, unsigned int n, uint32_t first, uint32_t second, const uint32_t *colors, uint32_t *out)
+{
+    __m256i w0 = _mm256_set1_epi32(first);
+    __m256i w1 = _mm256_set1_epi32(second);
+    __m256i c0 = _mm256_set1_epi32(colors[0]);
+    __m256i c1 = _mm256_set1_epi32(colors[1]);
+    __m256i c2 = _mm256_set1_epi32(colors[2]);
+    __m256i c3 = _mm256_set1_epi32(colors[3]);
+
+    for (unsigned int i = 0; i < n; i += 8) {
+        __m256i m    = _mm256_load_si256((const __m256i *) &masks[i]);
+        __m256i lit0 = _mm256_cmpeq_epi32(_mm256_and_si256(w0, m), m);
+        __m256i lit1 = _mm256_cmpeq_epi32(_mm256_and_si256(w1, m), m);
+        __m256i low  = _mm256_blendv_epi8(c0, c1, lit0);
+        __m256i high = _mm256_blendv_epi8(c2, c3, lit0);
+
+        _mm256_storeu_si256((__m256i *) &out[i], _mm256_blendv_epi8(low, high, lit1));
+    }
+}
+
+static const expand_planes_function plane_kernels[] = { expand_planes_scalar, expand_planes_sse2, expand_planes_avx2 };
+#else
+static const expand_planes_function plane_kernels[] = { expand_planes_scalar, expand_planes_scalar, expand_planes_scalar };
+#endif
+
+static bool kernel_supported(chip8_scaler_kernel kernel)
+{
+    switch (kernel) {
+        case CHIP8_SCALER_SCALAR: return true;
+#ifdef SCALE_X86
+        case CHIP8_SCALER_SSE2:   return __builtin_cpu_supports("sse2");
+        case CHIP8_SCALER_AVX2:   return __builtin_cpu_supports("avx2");
+#endif
+        default:                  return false;
+    }
+}
+
+chip8_scaler_kernel set_scaler_kernel(chip8_scaler *s, chip8_scaler_kernel kernel)
+{
+    while (kernel > CHIP8_SCALER_SCALAR && !kernel_supported(kernel)) {
+        kernel--;
+    }
+
+    s->kernel = kernel;
+
+    return kernel;
+}
+
+const char *get_kernel_name(chip8_scaler_kernel kernel)
+{
+    switch (kernel) {
+        case CHIP8_SCALER_SCALAR: return "scalar";
+        case CHIP8_SCALER_SSE2:   return "sse2";
+        case CHIP8_SCALER_AVX2:   return "avx2";
+    }
+
+    return "unknown";
+}
+
+const chip8_palette *find_palette(const char *name)
+{
+    for (int i = 0; i < palette_count; i++) {
+        if (strcmp(palettes[i].name, name) == 0) {
+            return &palettes[i];
+        }
+    }
+
+    return NULL;
+}
+
+bool init_scaler(chip8_scaler *s, chip8_variant variant, unsigned int scale, const chip8_palette *palette, unsigned int persistence)
+{
+    if (scale == 0 || scale > SCALE_MAX) {
+        return false;
+    }
+
+    if (palette == NULL) {
+        palette = &palettes[0];
+    }
+
+    memset(s, 0, sizeof(chip8_scaler));
+
+    bool classic = variant == CHIP8_VARIANT_CHIP8;
+
+    s->variant     = variant;
+    s->scale       = scale;
+    s->width       = (classic ? W_WIDTH : HIRES_WIDTH) * scale;
+    s->height      = (classic ? W_HEIGHT : HIRES_HEIGHT) * scale;
+    s->on          = palette->on;
+    s->off         = palette->off;
+    s->colors[0]   = palette->off;
+    s->colors[1]   = palette->on;
+    s->colors[2]   = palette->second;
+    s->colors[3]   = palette->both;
+    // XO-CHIP's colors would fade through each other
+    s->persistence = variant == CHIP8_VARIANT_XOCHIP ? 0 : persistence < 256 ? persistence : 255;
+
+    /* the width is a multiple of 64 columns, 256 bytes, as aligned_alloc wants */
+    s->masks = aligned_alloc(32, s->width * sizeof(uint32_t));
+    if (s->masks == NULL) {
+        fprintf(stderr, "unable to allocate scaler\n");
+        exit(1);
+    }
+
+    // column x shows pixel x / scale, the halves (quarters) are expanded separately
+    for (unsigned int x = 0; x < s->width; x++) {
+        s->masks[x] = 1u << (31 - (x / scale) % 32);
+    }
+
+    set_scaler_kernel(s, CHIP8_SCALER_AVX2);
+
+    return true;
+}
+
+void free_scaler(chip8_scaler *s)
+{
+    free(s->masks);
+    s->masks = NULL;
+}
+
+/* Blend between the two colors a channel at a time, level out of 255 */
+static uint32_t blend(uint32_t on, uint32_t off, unsigned int level)
+{
+    uint32_t color = 0;
+
+    for (int shift = 0; shift < 32; shift += 8) {
+        int a = (off >> shift) & 0xFF;
+        int b = (on >> shift) & 0xFF;
+
+        color |= (uint32_t) (a + (b - a) * (int) level / 255) << shift;
+    }
+
+    return color;
+}
+
+/* Fades row y, width pixels in 64-bit words, one frame further, true if
+ * some pixel is still fading out
+ */
+static bool fade_row(chip8_scaler *s, int y, const uint64_t *words, int width)
+{
+    unsigned char *level  = s->level[y];
+    bool           fading = false;
+
+    for (int x = 0; x < width; x++) {
+        if ((words[x / 64] >> (63 - x % 64)) & 1) {
+            level[x] = 255;
+        } else if (level[x] != 0) {
+            level[x] = level[x] * s->persistence >> 8;
+            fading |= level[x] != 0;
+        }
+    }
+
+    return fading;
+}
+
+static void draw_faded_line(chip8_scaler *s, int y, int width, uint32_t *out)
+{
+    for (int x = 0; x < width; x++) {
+        uint32_t color = blend(s->on, s->off, s->level[y][x]);
+
+        for (unsigned int i = 0; i < s->scale; i++) {
+            *out++ = color;
+        }
+    }
+}
+
+uint32_t scale_frame(chip8_scaler *s, const uint64_t *rows, uint32_t dirty, uint32_t *pixels, size_t pitch)
+{
+    expand_function expand = kernels[s->kernel];
+    unsigned int    half   = s->width / 2;
+    size_t          bytes  = s->width * sizeof(uint32_t);
+
+    uint32_t drawn  = dirty | s->fading;
+    uint32_t fading = 0;
+
+    for (uint32_t todo = drawn; todo != 0; todo &= todo - 1) {
+        int       y    = __builtin_ctz(todo);
+        uint32_t *line = (uint32_t *) ((char *) pixels + (size_t) y * s->scale * pitch);
+
+        if (s->persistence > 0 && fade_row(s, y, &rows[y], W_WIDTH)) {
+            fading |= 1u << y;
+            draw_faded_line(s, y, W_WIDTH, line);
+        } else {
+            expand(s->masks, half, rows[y] >> 32, s->on, s->off, line);
+            expand(s->masks + half, half, (uint32_t) rows[y], s->on, s->off, line + half);
+        }
+
+        for (unsigned int i = 1; i < s->scale; i++) {
+            memcpy((char *) line + i * pitch, line, bytes);
+        }
+    }
+
+    s->fading = fading;
+
+    return drawn;
+}
+
+uint64_t scale_planes(chip8_scaler *s, const uint64_t planes[MAX_PLANES][HIRES_HEIGHT][HIRES_WORDS], uint64_t dirty, uint32_t *pixels, size_t pitch)
+{
+    expand_planes_function expand  = plane_kernels[s->kernel];
+    unsigned int           quarter = s->width / 4;
+    size_t                 bytes   = s->width * sizeof(uint32_t);
+
+    uint64_t drawn  = dirty | s->fading;
+    uint64_t fading = 0;
+
+    for (uint64_t todo = drawn; todo != 0; todo &= todo - 1) {
+        int       y    = __builtin_ctzll(todo);
+        uint32_t *line = (uint32_t *) ((char *) pixels + (size_t) y * s->scale * pitch);
+
+        if (s->persistence > 0 && fade_row(s, y, planes[0][y], HIRES_WIDTH)) {
+            fading |= 1ULL << y;
+            draw_faded_line(s, y, HIRES_WIDTH, line);
+        } else {
+            for (int q = 0; q < 4; q++) {
+                int shift = q % 2 == 0 ? 32 : 0;
+
+                expand(s->masks + q * quarter, quarter, planes[0][y][q / 2] >> shift, planes[1][y][q / 2] >> shift, s->colors, line + q * quarter);
+            }
+        }
+
+        for (unsigned int i = 1; i < s->scale; i++) {
+            memcpy((char *) line + i * pitch, line, bytes);
+        }
+    }
+
+    s->fading = fading;
+
+    return drawn;
+}
+
+uint64_t scale_display(chip8_scaler *s, const chip8_frame *f, uint64_t dirty, uint32_t *pixels, size_t pitch)
+{
+    if (s->variant == CHIP8_VARIANT_CHIP8) {
+        return scale_frame(s, f->rows, dirty & ALL_ROWS, pixels, pitch);
+    }
+
+    return scale_planes(s, f->planes, dirty, pixels, pitch);
+}
@@ -0,0 +1,95 @@
+#ifndef SCALE_H
+#define SCALE_H
+
+#include "chip8.h"
+#include "frame.h"
+
+/* Display scaler
+ *
+ * Turns the packed display rows (one 64-bit word per row) straight into a
+ * 32-bit ARGB picture, every chip-8 pixel a scale x scale square in one of
+ * the two palette colors.
+ *
+ * Every output column shows one bit of one half of the row, so the scaler
+ * keeps a table with that bit's mask per column. A row is expanded by
+ * broadcasting each 32-bit half and testing it against the table four (SSE2)
+ * or eight (AVX2) columns at a time, which works for any integer scale.
+ * The first line of a row is expanded and the other scale - 1 are copies.
+ *
+ * The extended profiles are drawn from their 128x64 planes the same way, a
+ * quarter row at a time, the two planes picking one of four colors.
+ *
+ * With persistence, a pixel that goes dark fades out over a few frames
+ * instead of turning off at once, which hides most of the flicker of ROMs
+ * that erase and redraw their sprites every frame. Every pixel then has a
+ * brightness that is kept across calls. XO-CHIP's colors are always drawn
+ * as they are.
+ */
+
+#define SCALE_MAX  64
+
+/* on and off, then the XO-CHIP colors of a pixel only lit in the second
+ * plane and of one lit in both
+ */
+typedef struct chip8_palette_t {
+    const char *name;
+    uint32_t    on;
+    uint32_t    off;
+    uint32_t    second;
+    uint32_t    both;
+} chip8_palette;
+
+/* Built-in palettes, the first one is the default */
+extern const chip8_palette palettes[];
+extern const int           palette_count;
+
+typedef enum chip8_scaler_kernel_t {
+    CHIP8_SCALER_SCALAR = 0,
+    CHIP8_SCALER_SSE2,
+    CHIP8_SCALER_AVX2
+} chip8_scaler_kernel;
+
+typedef struct chip8_scaler_t {
+    chip8_variant       variant;
+    unsigned int        scale;
+    /* Size of the picture in pixels */
+    unsigned int        width;
+    unsigned int        height;
+    uint32_t            on;
+    uint32_t            off;
+    /* off, on, second and both, indexed by the plane bits */
+    uint32_t            colors[4];
+    chip8_scaler_kernel kernel;
+    /* Bit of its row half (or quarter) each output column shows */
+    uint32_t           *masks;
+
+    /* Brightness kept from one frame to the next out of 256, 0 turns
+     * persistence off
+     */
+    unsigned int        persistence;
+    unsigned char       level[HIRES_HEIGHT][HIRES_WIDTH];
+    /* Rows with pixels still fading out */
+    uint64_t            fading;
+} chip8_scaler;
+
+/* Picks the fastest kernel the host supports, returns false for a scale of
+ * 0 or above SCALE_MAX. The picture is the size of the profile's display.
+ */
+bool                  init_scaler         (chip8_scaler *s, chip8_variant variant, unsigned int scale, const chip8_palette *palette, unsigned int persistence);
+void                  free_scaler         (chip8_scaler *s);
+/* Falls back to the next best kernel if the host lacks it, returns the one used */
+chip8_scaler_kernel   set_scaler_kernel   (chip8_scaler *s, chip8_scaler_kernel kernel);
+const char           *get_kernel_name     (chip8_scaler_kernel kernel);
+const chip8_palette  *find_palette        (const char *name);
+
+/* Draws the rows in dirty plus those still fading into pixels, pitch bytes
+ * apart. Returns the mask of display rows it drew, each one scale lines of
+ * the picture.
+ */
+uint32_t              scale_frame         (chip8_scaler *s, const uint64_t *rows, uint32_t dirty, uint32_t *pixels, size_t pitch);
+/* The same for the planes of an extended profile */
+uint64_t              scale_planes        (chip8_scaler *s, const uint64_t planes[MAX_PLANES][HIRES_HEIGHT][HIRES_WORDS], uint64_t dirty, uint32_t *pixels, size_t pitch);
+/* Either of the above for a published frame of the scaler's profile */
+uint64_t              scale_display       (chip8_scaler *s, const chip8_frame *f, uint64_t dirty, uint32_t *pixels, size_t pitch);
+
+#endif
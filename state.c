@@ -0,0 +1,355 @@
+#include <string.h>
+
+#include "state.h"
+
+/* Differing bytes closer than this are stored as one run */
+#define STATE_RUN_GAP   4
+/* Memory is compared in chunks of this size before looking at bytes */
+#define STATE_CHUNK     64
+
+typedef struct writer_t {
+    unsigned char *buf;
+    size_t size, pos;
+    bool overflow;
+} writer;
+
+typedef struct reader_t {
+    const unsigned char *buf;
+    size_t size, pos;
+    bool truncated;
+} reader;
+
+static void put_bytes(writer *w, const void *data, size_t n)
+{
+    if (w->pos + n > w->size) {
+        w->overflow = true;
+        return;
+    }
+
+    memcpy(w->buf + w->pos, data, n);
+    w->pos += n;
+}
+
+static void put_u8(writer *w, unsigned char v)
+{
+    put_bytes(w, &v, 1);
+}
+
+static void put_u16(writer *w, unsigned short v)
+{
+    unsigned char b[2] = { v & 0xFF, v >> 8 };
+    put_bytes(w, b, 2);
+}
+
+static void put_u64(writer *w, uint64_t v)
+{
+    unsigned char b[8];
+
+    for (int i = 0; i < 8; i++) {
+        b[i] = (v >> (i * 8)) & 0xFF;
+    }
+    put_bytes(w, b, 8);
+}
+
+static void get_bytes(reader *r, void *data, size_t n)
+{
+    if (r->pos + n > r->size) {
+        r->truncated = true;
+        memset(data, 0, n);
+        return;
+    }
+
+    memcpy(data, r->buf + r->pos, n);
+    r->pos += n;
+}
+
+static unsigned char get_u8(reader *r)
+{
+    unsigned char v;
+    get_bytes(r, &v, 1);
+    return v;
+}
+
+static unsigned short get_u16(reader *r)
+{
+    unsigned char b[2];
+    get_bytes(r, b, 2);
+    return b[0] | (b[1] << 8);
+}
+
+static uint64_t get_u64(reader *r)
+{
+    unsigned char b[8];
+    uint64_t v = 0;
+
+    get_bytes(r, b, 8);
+    for (int i = 0; i < 8; i++) {
+        v |= (uint64_t) b[i] << (i * 8);
+    }
+
+    return v;
+}
+
+/* Runs of the size bytes of memory that differ from base, close runs are
+ * merged as long as the length fits 16 bits
+ */
+static void put_delta(writer *w, const unsigned char *memory, const unsigned char *base, int size)
+{
+    size_t count_pos = w->pos;
+    unsigned short runs = 0;
+
+    put_u16(w, 0);
+
+    for (int i = 0; i < size; ) {
+        // skip whole unchanged chunks
+        if (i % STATE_CHUNK == 0 && memcmp(&memory[i], &base[i], STATE_CHUNK) == 0) {
+            i += STATE_CHUNK;
+            continue;
+        }
+        if (memory[i] == base[i]) {
+            i++;
+            continue;
+        }
+
+        int start = i, end = i + 1, same = 0;
+
+        while (end < size && same < STATE_RUN_GAP && end - start < 0xFFFF) {
+            same = (memory[end] == base[end]) ? same + 1 : 0;
+            end++;
+        }
+        end -= same;
+
+        put_u16(w, start);
+        put_u16(w, end - start);
+        put_bytes(w, &memory[start], end - start);
+        runs++;
+
+        i = end;
+    }
+
+    if (!w->overflow) {
+        w->buf[count_pos]     = runs & 0xFF;
+        w->buf[count_pos + 1] = runs >> 8;
+    }
+}
+
+size_t chip8_save_state(chip8 *c, unsigned char *buf, size_t size, const unsigned char *base)
+{
+    writer w = { buf, size, 0, false };
+
+    put_bytes(&w, "C8ST", 4);
+    put_u8(&w, STATE_VERSION);
+    put_u8(&w, base != NULL ? STATE_FLAG_DELTA : 0);
+
+    put_u16(&w, c->opcode);
+    put_u16(&w, c->I);
+    put_u16(&w, c->PC);
+    put_u8(&w, c->SP);
+    for (int i = 0; i < 16; i++) {
+        put_u16(&w, c->stack[i]);
+    }
+    put_bytes(&w, c->V, 16);
+    put_u8(&w, c->DT);
+    put_u8(&w, c->ST);
+
+    unsigned short keys = 0;
+    for (int i = 0; i < 16; i++) {
+        keys |= (c->keys[i] != 0) << i;
+    }
+    put_u16(&w, keys);
+    put_u8(&w, c->pause);
+    put_u8(&w, c->key_flag);
+    put_u64(&w, c->cycles);
+    put_u64(&w, c->rng);
+    put_u8(&w, c->variant);
+    put_u8(&w, c->quirks);
+
+    if (c->display->planes == NULL) {
+        for (int y = 0; y < W_HEIGHT; y++) {
+            put_u64(&w, c->display->rows[y]);
+        }
+    } else {
+        put_u8(&w, c->hires);
+        put_u8(&w, c->plane);
+        put_bytes(&w, c->flags, 16);
+
+        for (int p = 0; p < MAX_PLANES; p++) {
+            for (int y = 0; y < HIRES_HEIGHT; y++) {
+                put_u64(&w, c->display->planes[p][y][0]);
+                put_u64(&w, c->display->planes[p][y][1]);
+            }
+        }
+    }
+
+    int           length = get_memory_size(c);
+    unsigned char memory[XO_MEMORY];
+    read_memory(c, 0, memory, length);
+
+    if (base != NULL) {
+        put_delta(&w, memory, base, length);
+    } else {
+        put_bytes(&w, memory, length);
+    }
+
+    return w.overflow ? 0 : w.pos;
+}
+
+chip8_state_result chip8_load_state(chip8 *c, const unsigned char *buf, size_t size, const unsigned char *base)
+{
+    reader r = { buf, size, 0, false };
+    char magic[4];
+
+    get_bytes(&r, magic, 4);
+    if (r.truncated || memcmp(magic, "C8ST", 4) != 0) {
+        return CHIP8_STATE_BAD_MAGIC;
+    }
+    unsigned char version = get_u8(&r);
+    if (version < 1 || version > STATE_VERSION) {
+        return CHIP8_STATE_BAD_VERSION;
+    }
+
+    unsigned char flags = get_u8(&r);
+    if ((flags & STATE_FLAG_DELTA) && base == NULL) {
+        return CHIP8_STATE_NEEDS_BASE;
+    }
+
+    /* decode into a copy so a bad state leaves c untouched */
+    chip8 s = *c;
+
+    s.opcode = get_u16(&r);
+    s.I      = get_u16(&r);
+    s.PC     = get_u16(&r);
+    s.SP     = get_u8(&r);
+    for (int i = 0; i < 16; i++) {
+        s.stack[i] = get_u16(&r);
+    }
+    get_bytes(&r, s.V, 16);
+    s.DT = get_u8(&r);
+    s.ST = get_u8(&r);
+
+    unsigned short keys = get_u16(&r);
+    for (int i = 0; i < 16; i++) {
+        s.keys[i] = (keys >> i) & 1;
+    }
+    s.pause    = get_u8(&r);
+    s.key_flag = (signed char) get_u8(&r);
+    s.cycles   = get_u64(&r);
+
+    /* version 1 states predate the per-instance generator, keep ours */
+    if (version >= 2) {
+        s.rng = get_u64(&r);
+    }
+
+    /* and older ones the classic machine */
+    unsigned char variant = version >= 3 ? get_u8(&r) : CHIP8_VARIANT_CHIP8;
+    if (r.truncated) {
+        return CHIP8_STATE_TRUNCATED;
+    }
+    if (variant != c->variant) {
+        return CHIP8_STATE_WRONG_VARIANT;
+    }
+
+    /* states before version 4 ran with the profile's quirks */
+    unsigned int quirks = version >= 4 ? get_u8(&r) % CHIP8_QUIRKS : get_default_quirks(variant);
+
+    uint64_t rows[W_HEIGHT];
+    uint64_t planes[MAX_PLANES][HIRES_HEIGHT][HIRES_WORDS];
+
+    if (c->display->planes == NULL) {
+        for (int y = 0; y < W_HEIGHT; y++) {
+            rows[y] = get_u64(&r);
+        }
+    } else {
+        s.hires = get_u8(&r) != 0;
+        s.plane = get_u8(&r) & 3;
+        get_bytes(&r, s.flags, 16);
+
+        for (int p = 0; p < MAX_PLANES; p++) {
+            for (int y = 0; y < HIRES_HEIGHT; y++) {
+                planes[p][y][0] = get_u64(&r);
+                planes[p][y][1] = get_u64(&r);
+            }
+        }
+    }
+
+    int           length = get_memory_size(c);
+    unsigned char memory[XO_MEMORY];
+
+    if (flags & STATE_FLAG_DELTA) {
+        memcpy(memory, base, length);
+
+        unsigned short runs = get_u16(&r);
+        for (unsigned int i = 0; i < runs && !r.truncated; i++) {
+            unsigned short start = get_u16(&r);
+            unsigned short count = get_u16(&r);
+
+            if (start + count > length) {
+                return CHIP8_STATE_TRUNCATED;
+            }
+            get_bytes(&r, &memory[start], count);
+        }
+    } else {
+        get_bytes(&r, memory, length);
+    }
+
+    if (r.truncated) {
+        return CHIP8_STATE_TRUNCATED;
+    }
+
+    *c = s;
+
+    if (quirks != c->quirks) {
+        set_quirks(c, quirks);
+    }
+
+    /* the next timer tick follows from the restored instruction count */
+    set_cycles_per_frame(c, c->cycles_per_frame);
+
+    if (c->display->planes == NULL) {
+        if (memcmp(c->display->rows, rows, sizeof(rows)) != 0) {
+            unshare_display(c);
+            memcpy(c->display->rows, rows, sizeof(rows));
+            redraw_display(c);
+        }
+    } else if (memcmp(c->display->planes, planes, PLANES_SIZE) != 0) {
+        unshare_display(c);
+        memcpy(c->display->planes, planes, PLANES_SIZE);
+        redraw_display(c);
+    }
+
+    /* copy the pages that differ straight in, so shared pages that match
+     * stay shared and restoring every frame stays cheap. A restore is not
+     * something the program stored, it is kept out of the trace and the
+     * self-modifying code tracking, the decoded code is dropped instead.
+     */
+    bool changed = false;
+
+    for (int i = 0; i < length / MEMORY_PAGE_SIZE; i++) {
+        const unsigned char *data = &memory[i * MEMORY_PAGE_SIZE];
+
+        if (memcmp((*get_page_slot(c, i))->data, data, MEMORY_PAGE_SIZE) != 0) {
+            memcpy(unshare_page(c, i)->data, data, MEMORY_PAGE_SIZE);
+            changed = true;
+        }
+    }
+
+    if (changed) {
+        clear_icache(c);
+    }
+
+    return CHIP8_STATE_OK;
+}
+
+const char *get_state_error(chip8_state_result result)
+{
+    switch (result) {
+        case CHIP8_STATE_OK:          return "ok";
+        case CHIP8_STATE_BAD_MAGIC:   return "not a chip-8 save state";
+        case CHIP8_STATE_BAD_VERSION: return "unsupported save state version";
+        case CHIP8_STATE_TRUNCATED:   return "truncated save state";
+        case CHIP8_STATE_NEEDS_BASE:  return "delta save state needs its base image";
+        case CHIP8_STATE_WRONG_VARIANT: return "save state is for another machine profile";
+    }
+
+    return "unknown error";
+}
@@ -0,0 +1,56 @@
+#ifndef STATE_H
+#define STATE_H
+
+#include "chip8.h"
+
+/* Save states
+ *
+ * A state holds everything needed to resume a machine deterministically:
+ * registers, stack, timers, keys, the wait state, the cycle counter, the
+ * random number generator, the display and the memory. The host side
+ * (cycles per frame, engine, caches) is not part of it. A state only
+ * restores into a machine of the profile it was saved from, and brings its
+ * quirks along.
+ *
+ * Layout, all integers little-endian:
+ *
+ *   "C8ST" version flags
+ *   opcode I PC SP stack[16] V[16] DT ST keys(16-bit mask) pause key_flag cycles(64-bit)
+ *   rng(64-bit, version 2 and later)
+ *   variant (version 3 and later, older states are classic)
+ *   quirks (version 4 and later, older states have the profile's)
+ *   hires plane flags[16] (extended profiles only)
+ *   display, 32 rows of 8 bytes, or for the extended profiles both planes
+ *   of 64 rows of 16 bytes
+ *   memory, either all of it (4096 bytes, 65536 on XO-CHIP) or, with
+ *   STATE_FLAG_DELTA, a run count followed by (offset, length, bytes) runs
+ *   that differ from a base image
+ *
+ * The base image is typically the memory right after load_file. Only a few
+ * bytes of it ever change, so delta states stay around 400 bytes.
+ */
+
+#define STATE_VERSION     4
+#define STATE_FLAG_DELTA  0x01
+
+/* Upper bound of a state, full memory or worst case delta */
+#define STATE_MAX_SIZE    (128 + MAX_PLANES * HIRES_HEIGHT * HIRES_WORDS * 8 + XO_MEMORY * 2)
+
+typedef enum chip8_state_result_t {
+    CHIP8_STATE_OK = 0,
+    CHIP8_STATE_BAD_MAGIC,
+    CHIP8_STATE_BAD_VERSION,
+    CHIP8_STATE_TRUNCATED,
+    CHIP8_STATE_NEEDS_BASE,
+    CHIP8_STATE_WRONG_VARIANT
+} chip8_state_result;
+
+/* Serialize c into buf, returns the state size or 0 if buf is too small.
+ * With a base image only the bytes of memory differing from it are stored.
+ */
+size_t             chip8_save_state  (chip8 *c, unsigned char *buf, size_t size, const unsigned char *base);
+/* Restore c from a state, base must be the image the state was saved with */
+chip8_state_result chip8_load_state  (chip8 *c, const unsigned char *buf, size_t size, const unsigned char *base);
+const char        *get_state_error   (chip8_state_result result);
+
+#endif
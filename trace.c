@@ -0,0 +1,658 @@
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "trace.h"
+
+/* next_pc before the first record, out of the range of addresses */
+#define TRACE_NO_PC  0x10000
+
+static void *run_writer(void *arg);
+
+chip8_trace *open_trace(const char *path, bool compress)
+{
+    FILE *fp = fopen(path, "wb");
+
+    if (fp == NULL) {
+        return NULL;
+    }
+
+    chip8_trace *t = calloc(1, sizeof(chip8_trace));
+
+    if (t == NULL) {
+        fprintf(stderr, "unable to allocate trace\n");
+        exit(1);
+    }
+
+    t->fp       = fp;
+    t->compress = compress;
+    t->out      = t->blocks[0].data;
+    t->end      = t->blocks[0].data + TRACE_BLOCK_SIZE - TRACE_RECORD_MAX;
+    atomic_init(&t->head, 0);
+    atomic_init(&t->tail, 0);
+    atomic_init(&t->done, false);
+
+    fwrite("C8TR", 1, 4, fp);
+    fputc(TRACE_VERSION, fp);
+    fputc(compress ? TRACE_COMPRESSED : 0, fp);
+
+    if (pthread_create(&t->writer, NULL, run_writer, t) != 0) {
+        fprintf(stderr, "unable to start the trace writer\n");
+        exit(1);
+    }
+
+    return t;
+}
+
+/* Hand the block being filled to the writer and move on to the next one */
+static void submit_block(chip8_trace *t)
+{
+    unsigned int       head = atomic_load_explicit(&t->head, memory_order_relaxed);
+    chip8_trace_block *b    = &t->blocks[head % TRACE_BLOCKS];
+
+    b->size = t->out - b->data;
+
+    /* the size is published along with the block */
+    atomic_store_explicit(&t->head, head + 1, memory_order_release);
+
+    /* wait for the writer to give the next block back */
+    while (head + 1 - atomic_load_explicit(&t->tail, memory_order_acquire) == TRACE_BLOCKS) {
+        sched_yield();
+    }
+
+    b = &t->blocks[(head + 1) % TRACE_BLOCKS];
+    t->out = b->data;
+    t->end = b->data + TRACE_BLOCK_SIZE - TRACE_RECORD_MAX;
+}
+
+bool close_trace(chip8_trace *t)
+{
+    if (t == NULL) {
+        return true;
+    }
+
+    unsigned int head = atomic_load_explicit(&t->head, memory_order_relaxed);
+    if (t->out != t->blocks[head % TRACE_BLOCKS].data) {
+        submit_block(t);
+    }
+
+    atomic_store_explicit(&t->done, true, memory_order_release);
+    pthread_join(t->writer, NULL);
+
+    bool ok = !t->failed && !ferror(t->fp);
+    ok = fclose(t->fp) == 0 && ok;
+
+    free(t);
+
+    return ok;
+}
+
+void attach_trace(chip8 *c, chip8_trace *t)
+{
+    c->trace = t;
+
+    /* records are relative to an all zero machine, the first one carries
+     * every register that isn't zero
+     */
+    memset(t->V, 0, sizeof(t->V));
+    t->I       = 0;
+    t->SP      = 0;
+    t->top     = 0;
+    t->DT      = 0;
+    t->ST      = 0;
+    t->next_pc = TRACE_NO_PC;
+    t->stores  = 0;
+}
+
+/* Encoding, runs on the machine's thread */
+static unsigned char *put_u16(unsigned char *p, unsigned short v)
+{
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+
+    return p + 2;
+}
+
+static unsigned char *put_varint(unsigned char *p, unsigned long v)
+{
+    while (v >= 0x80) {
+        *p++ = (v & 0x7F) | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+
+    return p;
+}
+
+#ifndef __SSE2__
+/* One bit per byte of x that isn't zero, byte 0 in bit 0 */
+static inline unsigned int nonzero_bytes(uint64_t x)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+    x |= x >> 4;
+    x |= x >> 2;
+    x |= x >> 1;
+    x &= 0x0101010101010101ULL;
+
+    return (x * 0x0102040810204080ULL) >> 56;
+}
+#endif
+
+/* Bit i set if V[i] differs from the last record, which then gets the new
+ * values. A whole register file compare costs a handful of instructions
+ * and no branches, less than working out what the instruction could write.
+ */
+static inline unsigned short diff_registers(chip8_trace *t, chip8 *c)
+{
+#ifdef __SSE2__
+    __m128i now  = _mm_loadu_si128((const __m128i *) c->V);
+    __m128i last = _mm_loadu_si128((const __m128i *) t->V);
+
+    _mm_storeu_si128((__m128i *) t->V, now);
+
+    return ~_mm_movemask_epi8(_mm_cmpeq_epi8(now, last));
+#else
+    uint64_t now[2], last[2];
+
+    memcpy(now, c->V, 16);
+    memcpy(last, t->V, 16);
+    memcpy(t->V, now, 16);
+
+    return nonzero_bytes(now[0] ^ last[0]) | nonzero_bytes(now[1] ^ last[1]) << 8;
+#endif
+}
+
+/* Runs for every instruction, so the common case (straight-line code that
+ * only writes registers) is kept to a few tests: the registers, then one
+ * test for everything else that rarely changes
+ */
+static inline __attribute__((always_inline)) void put_record(chip8_trace *t, chip8 *c, unsigned short pc, unsigned short opcode, unsigned long idle)
+{
+    if (t->out > t->end) {
+        submit_block(t);
+    }
+
+    unsigned short mask   = diff_registers(t, c);
+    unsigned short top    = c->stack[c->SP & 0xF];
+    unsigned char  fields = 0;
+
+    fields |= pc != t->next_pc ? TRACE_PC : 0;
+    fields |= mask != 0 ? TRACE_V : 0;
+    fields |= idle > 0 ? TRACE_IDLE : 0;
+
+    if (c->I != t->I || c->SP != t->SP || top != t->top || c->DT != t->DT || c->ST != t->ST || t->stores > 0) {
+        if (c->I != t->I) {
+            fields |= TRACE_I;
+            t->I = c->I;
+        }
+        if (c->SP != t->SP || top != t->top) {
+            fields |= TRACE_STACK;
+            t->SP  = c->SP;
+            t->top = top;
+        }
+        if (c->DT != t->DT || c->ST != t->ST) {
+            fields |= TRACE_TIMERS;
+            t->DT = c->DT;
+            t->ST = c->ST;
+        }
+        if (t->stores > 0) {
+            fields |= TRACE_STORES;
+        }
+    }
+
+    /* the values come from the trace's copy, updated above */
+    unsigned char *p = t->out;
+
+    *p++ = fields;
+
+    if (fields & TRACE_PC) {
+        p = put_u16(p, pc);
+    }
+
+    p = idle > 0 ? put_varint(p, idle) : put_u16(p, opcode);
+
+    if (fields & TRACE_V) {
+        p = put_u16(p, mask);
+        for (unsigned int bits = mask; bits != 0; bits &= bits - 1) {
+            *p++ = t->V[__builtin_ctz(bits)];
+        }
+    }
+    if (fields & ~(TRACE_PC | TRACE_V | TRACE_IDLE)) {
+        if (fields & TRACE_I) {
+            p = put_u16(p, t->I);
+        }
+        if (fields & TRACE_STACK) {
+            *p++ = t->SP;
+            p = put_u16(p, t->top);
+        }
+        if (fields & TRACE_TIMERS) {
+            *p++ = t->DT;
+            *p++ = t->ST;
+        }
+        if (fields & TRACE_STORES) {
+            *p++ = t->stores;
+            for (unsigned int i = 0; i < t->stores; i++) {
+                p = put_u16(p, t->store_addr[i]);
+                *p++ = t->store_value[i];
+            }
+            t->stores = 0;
+        }
+    }
+
+    t->out = p;
+}
+
+void trace_instruction(chip8_trace *t, chip8 *c, unsigned short pc)
+{
+    put_record(t, c, pc, c->opcode, 0);
+    t->next_pc = (unsigned short) (pc + 2);
+}
+
+void trace_idle(chip8_trace *t, chip8 *c, unsigned short pc, unsigned long n)
+{
+    put_record(t, c, pc, 0, n);
+
+    /* the loop carries on at pc, as if right after the instruction before it */
+    t->next_pc = pc;
+}
+
+void trace_store(chip8_trace *t, unsigned short addr, unsigned char value)
+{
+    /* no instruction stores more than Fx55 does, this only guards the buffer */
+    if (t->stores < TRACE_MAX_STORES) {
+        t->store_addr[t->stores]  = addr;
+        t->store_value[t->stores] = value;
+        t->stores++;
+    }
+}
+
+/* Block compression, greedy LZ77 with LZ4-style sequences */
+#define LZ_MIN_MATCH   4
+#define LZ_HASH_BITS   12
+
+static unsigned char *put_length(unsigned char *p, size_t n)
+{
+    while (n >= 255) {
+        *p++ = 255;
+        n   -= 255;
+    }
+    *p++ = n;
+
+    return p;
+}
+
+static unsigned char *put_sequence(unsigned char *p, const unsigned char *literals, size_t count, size_t offset, size_t match)
+{
+    unsigned char *token = p++;
+    size_t extra = match > 0 ? match - LZ_MIN_MATCH : 0;
+
+    *token = (count < 15 ? count : 15) << 4 | (extra < 15 ? extra : 15);
+
+    if (count >= 15) {
+        p = put_length(p, count - 15);
+    }
+    memcpy(p, literals, count);
+    p += count;
+
+    /* the last sequence is literals only */
+    if (match == 0) {
+        return p;
+    }
+
+    p = put_u16(p, offset);
+    if (extra >= 15) {
+        p = put_length(p, extra - 15);
+    }
+
+    return p;
+}
+
+static size_t compress_block(const unsigned char *in, size_t n, unsigned char *out)
+{
+    uint32_t       table[1 << LZ_HASH_BITS] = { 0 };
+    unsigned char *p      = out;
+    size_t         ip     = 0;
+    size_t         anchor = 0;
+
+    while (ip + LZ_MIN_MATCH <= n) {
+        uint32_t seq;
+        memcpy(&seq, &in[ip], 4);
+
+        uint32_t hash = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t   ref  = table[hash];
+        table[hash]   = ip + 1;
+
+        /* positions are stored plus one, zero is an empty slot */
+        if (ref == 0 || ip - (ref - 1) > 0xFFFF || memcmp(&in[ref - 1], &in[ip], LZ_MIN_MATCH) != 0) {
+            ip++;
+            continue;
+        }
+        ref--;
+
+        size_t match = LZ_MIN_MATCH;
+        while (ip + match < n && in[ref + match] == in[ip + match]) {
+            match++;
+        }
+
+        p = put_sequence(p, &in[anchor], ip - anchor, ip - ref, match);
+        ip    += match;
+        anchor = ip;
+    }
+
+    p = put_sequence(p, &in[anchor], n - anchor, 0, 0);
+
+    return p - out;
+}
+
+/* Bytes written to out or 0 if the block is corrupt */
+static size_t decompress_block(const unsigned char *in, size_t n, unsigned char *out, size_t capacity)
+{
+    size_t ip = 0;
+    size_t op = 0;
+
+    while (ip < n) {
+        unsigned char token = in[ip++];
+        size_t count = token >> 4;
+
+        if (count == 15) {
+            unsigned char b;
+            do {
+                if (ip >= n) return 0;
+                b = in[ip++];
+                count += b;
+            } while (b == 255);
+        }
+
+        if (count > n - ip || count > capacity - op) {
+            return 0;
+        }
+        memcpy(&out[op], &in[ip], count);
+        ip += count;
+        op += count;
+
+        if (ip == n) {
+            break;
+        }
+        if (n - ip < 2) {
+            return 0;
+        }
+
+        size_t offset = in[ip] | in[ip + 1] << 8;
+        size_t match  = token & 0xF;
+        ip += 2;
+
+        if (match == 15) {
+            unsigned char b;
+            do {
+                if (ip >= n) return 0;
+                b = in[ip++];
+                match += b;
+            } while (b == 255);
+        }
+        match += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > op || match > capacity - op) {
+            return 0;
+        }
+        /* byte by byte, the match may overlap what it copies */
+        for (size_t i = 0; i < match; i++, op++) {
+            out[op] = out[op - offset];
+        }
+    }
+
+    return op;
+}
+
+/* Writer thread, the only one touching the file until close_trace */
+static void write_u32(FILE *fp, uint32_t v)
+{
+    for (int i = 0; i < 4; i++) {
+        fputc((v >> (i * 8)) & 0xFF, fp);
+    }
+}
+
+static void write_block(chip8_trace *t, const chip8_trace_block *b)
+{
+    const unsigned char *data = b->data;
+    size_t size = b->size;
+
+    if (t->compress) {
+        size_t packed = compress_block(b->data, b->size, t->packed);
+
+        /* keep it as is if compressing didn't help */
+        if (packed < b->size) {
+            data = t->packed;
+            size = packed;
+        }
+    }
+
+    write_u32(t->fp, b->size);
+    write_u32(t->fp, size);
+    if (fwrite(data, 1, size, t->fp) != size) {
+        t->failed = true;
+    }
+}
+
+static void *run_writer(void *arg)
+{
+    chip8_trace *t = arg;
+    struct timespec nap = { 0, 1000000 };
+
+    for (;;) {
+        unsigned int tail = atomic_load_explicit(&t->tail, memory_order_relaxed);
+        /* done is read first, a block submitted before it is then seen too */
+        bool done = atomic_load_explicit(&t->done, memory_order_acquire);
+        unsigned int head = atomic_load_explicit(&t->head, memory_order_acquire);
+
+        if (tail == head) {
+            if (done) {
+                break;
+            }
+            nanosleep(&nap, NULL);
+            continue;
+        }
+
+        write_block(t, &t->blocks[tail % TRACE_BLOCKS]);
+
+        /* hand the block back to the machine */
+        atomic_store_explicit(&t->tail, tail + 1, memory_order_release);
+    }
+
+    return NULL;
+}
+
+/* Reading */
+static unsigned short get_u16(const unsigned char *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static bool get_u32(FILE *fp, uint32_t *v, bool *end)
+{
+    *v = 0;
+
+    for (int i = 0; i < 4; i++) {
+        int b = fgetc(fp);
+        if (b == EOF) {
+            *end = i == 0;
+            return false;
+        }
+        *v |= (uint32_t) b << (i * 8);
+    }
+
+    return true;
+}
+
+/* Decode the records of one block, false if one runs past its end */
+static bool read_records(const unsigned char *data, size_t size, chip8_trace_record *r, chip8_trace_reader reader, void *user)
+{
+    const unsigned char *p   = data;
+    const unsigned char *end = data + size;
+
+    /* every field is checked against the end as it is read */
+#define NEED(n) do { if ((size_t) (end - p) < (size_t) (n)) return false; } while (0)
+
+    while (p < end) {
+        unsigned char fields = *p++;
+
+        r->fields = fields;
+        r->stores = 0;
+
+        if (fields & TRACE_PC) {
+            NEED(2);
+            r->pc = get_u16(p);
+            p += 2;
+        } else {
+            r->pc += 2;
+        }
+
+        if (fields & TRACE_IDLE) {
+            r->idle = 0;
+            for (int shift = 0; ; shift += 7) {
+                NEED(1);
+                unsigned char b = *p++;
+                r->idle |= (unsigned long) (b & 0x7F) << shift;
+                if ((b & 0x80) == 0 || shift >= 63) {
+                    break;
+                }
+            }
+        } else {
+            NEED(2);
+            r->opcode = get_u16(p);
+            r->idle   = 0;
+            p += 2;
+        }
+
+        r->mask = 0;
+        if (fields & TRACE_V) {
+            NEED(2);
+            r->mask = get_u16(p);
+            p += 2;
+            for (int i = 0; i < 16; i++) {
+                if (r->mask & (1 << i)) {
+                    NEED(1);
+                    r->V[i] = *p++;
+                }
+            }
+        }
+        if (fields & TRACE_I) {
+            NEED(2);
+            r->I = get_u16(p);
+            p += 2;
+        }
+        if (fields & TRACE_STACK) {
+            NEED(3);
+            r->SP  = p[0];
+            r->top = get_u16(p + 1);
+            p += 3;
+        }
+        if (fields & TRACE_TIMERS) {
+            NEED(2);
+            r->DT = p[0];
+            r->ST = p[1];
+            p += 2;
+        }
+        if (fields & TRACE_STORES) {
+            NEED(1);
+            r->stores = *p++;
+            if (r->stores > TRACE_MAX_STORES) {
+                return false;
+            }
+            NEED(r->stores * 3);
+            for (unsigned int i = 0; i < r->stores; i++) {
+                r->store_addr[i]  = get_u16(p);
+                r->store_value[i] = p[2];
+                p += 3;
+            }
+        }
+
+        reader(r, user);
+
+        /* the next record follows on from where the loop resumes */
+        if (fields & TRACE_IDLE) {
+            r->pc -= 2;
+        }
+    }
+
+#undef NEED
+
+    return true;
+}
+
+chip8_trace_result read_trace(const char *path, chip8_trace_reader reader, void *user)
+{
+    FILE *fp = fopen(path, "rb");
+    unsigned char header[6];
+
+    if (fp == NULL) {
+        return CHIP8_TRACE_OPEN;
+    }
+
+    if (fread(header, 1, 6, fp) != 6 || memcmp(header, "C8TR", 4) != 0) {
+        fclose(fp);
+        return CHIP8_TRACE_BAD_MAGIC;
+    }
+    if (header[4] != TRACE_VERSION) {
+        fclose(fp);
+        return CHIP8_TRACE_BAD_VERSION;
+    }
+
+    unsigned char     *raw    = malloc(TRACE_BLOCK_SIZE);
+    unsigned char     *stored = malloc(TRACE_BLOCK_SIZE);
+    chip8_trace_record record = { 0 };
+    chip8_trace_result result = CHIP8_TRACE_OK;
+
+    for (;;) {
+        uint32_t size, packed;
+        bool     end = false;
+
+        if (!get_u32(fp, &size, &end)) {
+            result = end ? CHIP8_TRACE_OK : CHIP8_TRACE_CORRUPT;
+            break;
+        }
+        if (!get_u32(fp, &packed, &end) || size > TRACE_BLOCK_SIZE || packed > size
+            || fread(stored, 1, packed, fp) != packed) {
+            result = CHIP8_TRACE_CORRUPT;
+            break;
+        }
+
+        const unsigned char *data = stored;
+        if (packed < size) {
+            if (decompress_block(stored, packed, raw, TRACE_BLOCK_SIZE) != size) {
+                result = CHIP8_TRACE_CORRUPT;
+                break;
+            }
+            data = raw;
+        }
+
+        if (!read_records(data, size, &record, reader, user)) {
+            result = CHIP8_TRACE_CORRUPT;
+            break;
+        }
+    }
+
+    free(raw);
+    free(stored);
+    fclose(fp);
+
+    return result;
+}
+
+const char *get_trace_error(chip8_trace_result result)
+{
+    switch (result) {
+        case CHIP8_TRACE_OK:          return "ok";
+        case CHIP8_TRACE_OPEN:        return "unable to open file";
+        case CHIP8_TRACE_BAD_MAGIC:   return "not a trace";
+        case CHIP8_TRACE_BAD_VERSION: return "unsupported trace version";
+        case CHIP8_TRACE_CORRUPT:     return "trace is corrupt";
+    }
+
+    return "unknown error";
+}
@@ -0,0 +1,141 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <pthread.h>
+
+#include "chip8.h"
+
+/* Instruction trace
+ *
+ * Once attached, the core logs every instruction it runs: its address and
+ * opcode, the registers it changed (V, I, the stack, the timers) and the
+ * bytes it stored. Each record only carries what differs from the previous
+ * one, the first against an all zero machine, so a straight run of ALU
+ * instructions costs three to six bytes each.
+ * Instructions fast-forwarded by skip_idle are logged as one idle record.
+ *
+ * The machine's thread only encodes records into fixed size blocks. Full
+ * blocks go through a ring to a writer thread which optionally compresses
+ * them and does all the file I/O. The machine only waits if the writer
+ * falls a whole ring behind. Encoding is what tracing costs: test_opcode
+ * runs about 1.5 times slower, a tight ALU loop, where a record takes as
+ * long to write as the instruction took to run, up to 3 times slower.
+ *
+ * File layout, integers little-endian:
+ *
+ *   "C8TR" version flags
+ *   blocks until the end: raw size(32-bit) stored size(32-bit) data
+ *
+ * A block whose stored size equals its raw size is stored as is, otherwise
+ * it is LZ77 compressed (LZ4-style sequences: token, literals, 16-bit
+ * offset). Records never straddle blocks. Each record is:
+ *
+ *   fields(8-bit)
+ *   [PC(16-bit)]           TRACE_PC, the address unless it follows the last one
+ *   opcode(16-bit)         or for TRACE_IDLE the instructions skipped (LEB128)
+ *   [mask(16-bit) V...]    TRACE_V, changed registers in ascending order
+ *   [I(16-bit)]            TRACE_I
+ *   [SP top(16-bit)]       TRACE_STACK, stack pointer and the entry it points at
+ *   [DT ST]                TRACE_TIMERS
+ *   [count (addr(16-bit) value)...]  TRACE_STORES
+ */
+
+#define TRACE_VERSION     1
+#define TRACE_COMPRESSED  0x01
+
+#define TRACE_BLOCK_SIZE  65536
+#define TRACE_BLOCKS      16
+/* Room left in a block before it is handed over, a record is at most ~90 bytes */
+#define TRACE_RECORD_MAX  128
+#define TRACE_MAX_STORES  16
+
+/* Fields present in a record */
+#define TRACE_PC      0x01
+#define TRACE_V       0x02
+#define TRACE_I       0x04
+#define TRACE_STACK   0x08
+#define TRACE_TIMERS  0x10
+#define TRACE_STORES  0x20
+#define TRACE_IDLE    0x40
+
+typedef enum chip8_trace_result_t {
+    CHIP8_TRACE_OK = 0,
+    CHIP8_TRACE_OPEN,
+    CHIP8_TRACE_BAD_MAGIC,
+    CHIP8_TRACE_BAD_VERSION,
+    CHIP8_TRACE_CORRUPT
+} chip8_trace_result;
+
+typedef struct chip8_trace_block_t {
+    uint32_t      size;
+    unsigned char data[TRACE_BLOCK_SIZE];
+} chip8_trace_block;
+
+typedef struct chip8_trace_t {
+    /* State as of the last record, only changes are written. PC is left out
+     * when it is next_pc, which no address matches before the first record.
+     */
+    unsigned int   next_pc;
+    unsigned char  V[16];
+    unsigned short I;
+    unsigned char  SP;
+    unsigned short top;
+    unsigned char  DT, ST;
+
+    /* Stores of the instruction being run */
+    unsigned short store_addr[TRACE_MAX_STORES];
+    unsigned char  store_value[TRACE_MAX_STORES];
+    unsigned int   stores;
+
+    /* The machine fills blocks[head % TRACE_BLOCKS], the writer drains from tail */
+    chip8_trace_block blocks[TRACE_BLOCKS];
+    /* Where the next record goes in the block being filled, and the point
+     * past which it is handed over
+     */
+    unsigned char *out;
+    unsigned char *end;
+    _Alignas(64) atomic_uint head;
+    _Alignas(64) atomic_uint tail;
+    atomic_bool    done;
+
+    /* Writer side */
+    pthread_t      writer;
+    FILE          *fp;
+    bool           compress;
+    bool           failed;
+    unsigned char  packed[TRACE_BLOCK_SIZE + TRACE_BLOCK_SIZE / 128 + 16];
+} chip8_trace;
+
+/* A decoded record, registers hold their values after the instruction */
+typedef struct chip8_trace_record_t {
+    unsigned char  fields;
+    unsigned short pc;
+    unsigned short opcode;
+    unsigned long  idle;
+    unsigned short mask;
+    unsigned char  V[16];
+    unsigned short I;
+    unsigned char  SP;
+    unsigned short top;
+    unsigned char  DT, ST;
+    unsigned int   stores;
+    unsigned short store_addr[TRACE_MAX_STORES];
+    unsigned char  store_value[TRACE_MAX_STORES];
+} chip8_trace_record;
+
+typedef void (*chip8_trace_reader)(const chip8_trace_record *record, void *user);
+
+/* Starts the writer thread, NULL if the file can't be created */
+chip8_trace        *open_trace        (const char *path, bool compress);
+/* Flushes, stops the writer and frees the trace, false if a write failed */
+bool                close_trace       (chip8_trace *t);
+void                attach_trace      (chip8 *c, chip8_trace *t);
+chip8_trace_result  read_trace        (const char *path, chip8_trace_reader reader, void *user);
+const char         *get_trace_error   (chip8_trace_result result);
+
+/* Called by the core while a trace is attached */
+void  trace_instruction  (chip8_trace *t, chip8 *c, unsigned short pc);
+void  trace_idle         (chip8_trace *t, chip8 *c, unsigned short pc, unsigned long n);
+void  trace_store        (chip8_trace *t, unsigned short addr, unsigned char value);
+
+#endif
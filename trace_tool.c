@@ -0,0 +1,62 @@
+#include "trace.h"
+
+/* chip8-trace, prints a trace written with -t as text, one instruction per
+ * line: its number, address and opcode followed by what it changed.
+ *
+ * usage: chip8-trace <trace>
+ *
+ *   1042 20a 8014 V0=3c VF=01
+ *   1043 20c f055 I=306 [300]=3c
+ *   1044 20e 1204 idle 2997 V0=00
+ */
+
+static void print_record(const chip8_trace_record *r, void *user)
+{
+    unsigned long *count = user;
+
+    if (r->fields & TRACE_IDLE) {
+        printf("%lu %03x idle %lu", *count, r->pc, r->idle);
+        *count += r->idle;
+    } else {
+        printf("%lu %03x %04x", *count, r->pc, r->opcode);
+        *count += 1;
+    }
+
+    for (int i = 0; i < 16; i++) {
+        if (r->mask & (1 << i)) {
+            printf(" V%X=%02x", i, r->V[i]);
+        }
+    }
+    if (r->fields & TRACE_I) {
+        printf(" I=%03x", r->I);
+    }
+    if (r->fields & TRACE_STACK) {
+        printf(" SP=%x top=%03x", r->SP, r->top);
+    }
+    if (r->fields & TRACE_TIMERS) {
+        printf(" DT=%02x ST=%02x", r->DT, r->ST);
+    }
+    for (unsigned int i = 0; i < r->stores; i++) {
+        printf(" [%03x]=%02x", r->store_addr[i], r->store_value[i]);
+    }
+
+    printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <trace>\n", argv[0]);
+        return 1;
+    }
+
+    unsigned long count = 0;
+    chip8_trace_result result = read_trace(argv[1], print_record, &count);
+
+    if (result != CHIP8_TRACE_OK) {
+        fprintf(stderr, "unable to read %s: %s\n", argv[1], get_trace_error(result));
+        return 1;
+    }
+
+    return 0;
+}
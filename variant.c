@@ -0,0 +1,574 @@
+#include <string.h>
+
+#include "variant.h"
+
+#define SCHIP_MASK   (MAX_MEMORY - 1)
+#define XOCHIP_MASK  (XO_MEMORY - 1)
+
+/* A display row of the extended machines, leftmost pixel in the top bit */
+typedef unsigned __int128 uint128;
+
+static const char *variant_names[CHIP8_VARIANTS] = { "chip8", "schip", "xochip" };
+
+static const unsigned int default_quirks[CHIP8_VARIANTS] = {
+    0,
+    CHIP8_QUIRK_SHIFT | CHIP8_QUIRK_LOAD_STORE | CHIP8_QUIRK_JUMP | CHIP8_QUIRK_CLIP,
+    0
+};
+
+unsigned int get_default_quirks(chip8_variant variant)
+{
+    return variant < CHIP8_VARIANTS ? default_quirks[variant] : 0;
+}
+
+const char *get_variant_name(chip8_variant variant)
+{
+    return variant < CHIP8_VARIANTS ? variant_names[variant] : "unknown";
+}
+
+bool find_variant(const char *name, chip8_variant *variant)
+{
+    for (int i = 0; i < CHIP8_VARIANTS; i++) {
+        if (strcmp(variant_names[i], name) == 0) {
+            *variant = i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Memory byte with the profile's memory size as a constant */
+static inline unsigned char byte_at(chip8 *c, unsigned short addr, unsigned short mask)
+{
+    addr &= mask;
+
+    return (*get_page_slot(c, addr / MEMORY_PAGE_SIZE))->data[addr % MEMORY_PAGE_SIZE];
+}
+
+static inline uint128 load_row(chip8 *c, int p, int y)
+{
+    const uint64_t *words = c->display->planes[p][y];
+
+    return (uint128) words[0] << 64 | words[1];
+}
+
+static inline void store_row(chip8 *c, int p, int y, uint128 row)
+{
+    uint64_t *words = c->display->planes[p][y];
+
+    words[0] = row >> 64;
+    words[1] = (uint64_t) row;
+}
+
+/* Display pixels per pixel of the current mode */
+static inline unsigned int pixel_size(chip8 *c)
+{
+    return c->hires ? 1 : 2;
+}
+
+/* Doubles each of the low n bits, a lo-res sprite row at display size */
+static uint32_t widen(uint32_t bits, int n)
+{
+    uint32_t wide = 0;
+
+    for (int i = 0; i < n; i++) {
+        wide |= ((bits >> i) & 1) * (3u << (i * 2));
+    }
+
+    return wide;
+}
+
+/* Dxyn of the extended machines. Dxy0 is 16x16, two bytes a row. With XO-CHIP
+ * every selected plane gets its own sprite, one after the other in memory.
+ * Sprites wrap around the edges or are clipped, and VF is either set on a
+ * collision or, for SUPER-CHIP in hi-res, the number of rows that collided
+ * or were clipped at the bottom.
+ */
+static inline __attribute__((always_inline)) void draw_sprite(chip8 *c, const chip8_insn *in, unsigned short mask, bool wrap, bool count_rows)
+{
+    unsigned int   size    = pixel_size(c);
+    unsigned int   x       = c->V[in->x] % (HIRES_WIDTH / size) * size;
+    unsigned int   y       = c->V[in->y] % (HIRES_HEIGHT / size) * size;
+    unsigned int   bytes   = in->n == 0 ? 2 : 1;
+    unsigned int   height  = in->n == 0 ? 16 : in->n;
+    unsigned int   width   = bytes * 8 * size;
+    unsigned short addr    = c->I;
+    unsigned int   hit     = 0;
+    unsigned int   clipped = 0;
+
+    // a forked machine gets its own display on its first draw
+    unshare_display(c);
+
+    for (int p = 0; p < MAX_PLANES; p++) {
+        if ((c->plane & (1 << p)) == 0) {
+            continue;
+        }
+
+        for (unsigned int r = 0; r < height; r++) {
+            uint32_t bits = byte_at(c, addr, mask);
+
+            if (bytes == 2) {
+                bits = bits << 8 | byte_at(c, addr + 1, mask);
+            }
+            addr += bytes;
+
+            if (size == 2) {
+                bits = widen(bits, bytes * 8);
+            }
+
+            uint128 sprite = (uint128) bits << (128 - width);
+
+            if (!wrap) {
+                sprite >>= x;
+            } else if (x != 0) {
+                sprite = (sprite >> x) | (sprite << (128 - x));
+            }
+
+            bool collided = false;
+
+            for (unsigned int i = 0; i < size; i++) {
+                unsigned int row = y + r * size + i;
+
+                if (row >= HIRES_HEIGHT && !wrap) {
+                    clipped += i == 0;
+                    continue;
+                }
+                row %= HIRES_HEIGHT;
+
+                uint128 old = load_row(c, p, row);
+
+                collided |= (old & sprite) != 0;
+                store_row(c, p, row, old ^ sprite);
+
+                if (sprite != 0) {
+                    c->extended->dirty_rows |= 1ULL << row;
+                }
+            }
+
+            hit += collided;
+        }
+    }
+
+    c->V[0xF] = count_rows && c->hires ? hit + clipped : hit != 0;
+}
+
+/* Moves the selected planes by dx, dy pixels of the current mode, what
+ * scrolls off is lost and the space it leaves is blank
+ */
+static void scroll(chip8 *c, int dx, int dy)
+{
+    int size = pixel_size(c);
+
+    dx *= size;
+    dy *= size;
+
+    unshare_display(c);
+
+    for (int p = 0; p < MAX_PLANES; p++) {
+        if ((c->plane & (1 << p)) == 0) {
+            continue;
+        }
+
+        uint128 rows[HIRES_HEIGHT];
+
+        for (int y = 0; y < HIRES_HEIGHT; y++) {
+            rows[y] = load_row(c, p, y);
+        }
+
+        for (int y = 0; y < HIRES_HEIGHT; y++) {
+            int     from = y - dy;
+            uint128 row  = from >= 0 && from < HIRES_HEIGHT ? rows[from] : 0;
+
+            store_row(c, p, y, dx >= 0 ? row >> dx : row << -dx);
+        }
+    }
+
+    redraw_display(c);
+}
+
+/* Instructions of both extended machines */
+static void op_00Cn(chip8 *c, const chip8_insn *in)
+{
+    scroll(c, 0, in->n);
+}
+
+static void op_00Dn(chip8 *c, const chip8_insn *in)
+{
+    scroll(c, 0, -(int) in->n);
+}
+
+static void op_00E0_planes(chip8 *c, const chip8_insn *in)
+{
+    unshare_display(c);
+
+    for (int p = 0; p < MAX_PLANES; p++) {
+        if (c->plane & (1 << p)) {
+            memset(c->display->planes[p], 0, sizeof(*c->display->planes));
+        }
+    }
+
+    redraw_display(c);
+}
+
+static void op_00FB(chip8 *c, const chip8_insn *in)
+{
+    scroll(c, 4, 0);
+}
+
+static void op_00FC(chip8 *c, const chip8_insn *in)
+{
+    scroll(c, -4, 0);
+}
+
+static void op_00FD(chip8 *c, const chip8_insn *in)
+{
+    // there is nothing to return to, stay here
+    jump(c, get_pc(c));
+}
+
+static void op_00FE(chip8 *c, const chip8_insn *in)
+{
+    c->hires = false;
+}
+
+static void op_00FF(chip8 *c, const chip8_insn *in)
+{
+    c->hires = true;
+}
+
+/* XO-CHIP clears every plane when the resolution changes, as Octo does */
+static void op_00FE_clear(chip8 *c, const chip8_insn *in)
+{
+    c->hires = false;
+    clear_display(c);
+}
+
+static void op_00FF_clear(chip8 *c, const chip8_insn *in)
+{
+    c->hires = true;
+    clear_display(c);
+}
+
+static void op_Fx30(chip8 *c, const chip8_insn *in)
+{
+    set_addr(c, BIGFONT_START + (get_reg_value(c, in->x) & 0xF) * 10);
+}
+
+static void op_Fx75(chip8 *c, const chip8_insn *in)
+{
+    memcpy(c->flags, c->V, in->x + 1);
+}
+
+static void op_Fx85(chip8 *c, const chip8_insn *in)
+{
+    memcpy(c->V, c->flags, in->x + 1);
+}
+
+/* Quirks, the behaviour that isn't the classic one. Where the handler
+ * depends on the profile too it is stamped out of a template per profile.
+ */
+static void op_8xy6_vx(chip8 *c, const chip8_insn *in)
+{
+    unsigned char n = get_reg_value(c, in->x);
+
+    set_reg_value(c, in->x, n >> 1);
+    set_reg_value(c, 0xF, n & 0x01);
+}
+
+static void op_8xyE_vx(chip8 *c, const chip8_insn *in)
+{
+    unsigned char n = get_reg_value(c, in->x);
+
+    set_reg_value(c, in->x, n << 1);
+    set_reg_value(c, 0xF, (n & 0x80) != 0);
+}
+
+static void op_Bxnn(chip8 *c, const chip8_insn *in)
+{
+    jump(c, in->nnn + get_reg_value(c, in->x));
+}
+
+static void op_Fx55_keep(chip8 *c, const chip8_insn *in)
+{
+    for (int i = 0; i <= in->x; i++) {
+        set_memory_value(c, get_addr(c) + i, get_reg_value(c, i));
+    }
+}
+
+/* Fx65 with the memory size as a constant, I moved past VX or left alone */
+static inline __attribute__((always_inline)) void load_registers(chip8 *c, const chip8_insn *in, unsigned short mask, bool move)
+{
+    for (int i = 0; i <= in->x; i++) {
+        set_reg_value(c, i, byte_at(c, get_addr(c) + i, mask));
+    }
+    if (move) {
+        set_addr(c, get_addr(c) + in->x + 1);
+    }
+}
+
+#define LOAD_REGISTERS(name, mask, move)                               \
+    static void name(chip8 *c, const chip8_insn *in)                   \
+    {                                                                  \
+        load_registers(c, in, mask, move);                             \
+    }
+
+LOAD_REGISTERS(op_Fx65_keep,        SCHIP_MASK,  false)
+LOAD_REGISTERS(op_Fx65_xochip,      XOCHIP_MASK, true)
+LOAD_REGISTERS(op_Fx65_xochip_keep, XOCHIP_MASK, false)
+
+#define DRAW_SPRITE(name, mask, wrap, count_rows)                      \
+    static void name(chip8 *c, const chip8_insn *in)                   \
+    {                                                                  \
+        draw_sprite(c, in, mask, wrap, count_rows);                    \
+    }
+
+DRAW_SPRITE(op_Dxyn_schip,       SCHIP_MASK,  false, true)
+DRAW_SPRITE(op_Dxyn_schip_wrap,  SCHIP_MASK,  true,  true)
+DRAW_SPRITE(op_Dxyn_xochip,      XOCHIP_MASK, true,  false)
+DRAW_SPRITE(op_Dxyn_xochip_clip, XOCHIP_MASK, false, false)
+
+/* Dxyn of the classic machine with sprites cut off at the edges */
+static void op_Dxyn_clip(chip8 *c, const chip8_insn *in)
+{
+    unsigned int x = c->V[in->x] % W_WIDTH;
+    unsigned int y = c->V[in->y] % W_HEIGHT;
+    uint64_t erased = 0;
+
+    unshare_display(c);
+
+    for (unsigned int i = 0; i < in->n && y + i < W_HEIGHT; i++) {
+        uint64_t  sprite = (uint64_t) byte_at(c, c->I + i, SCHIP_MASK) << (W_WIDTH - 8) >> x;
+        uint64_t *row    = &c->display->rows[y + i];
+
+        erased |= *row & sprite;
+        *row   ^= sprite;
+
+        if (sprite != 0) {
+            c->dirty_rows |= 1u << (y + i);
+        }
+    }
+
+    c->V[0xF] = erased != 0;
+}
+
+/* Handlers of the quirked instructions, indexed by whether the quirk is on */
+static const chip8_op shifts_right[2] = { op_8xy6, op_8xy6_vx };
+static const chip8_op shifts_left[2]  = { op_8xyE, op_8xyE_vx };
+static const chip8_op jumps[2]        = { op_Bnnn, op_Bxnn };
+static const chip8_op stores[2]       = { op_Fx55, op_Fx55_keep };
+
+/* and by profile */
+static const chip8_op loads[CHIP8_VARIANTS][2] = {
+    { op_Fx65,        op_Fx65_keep },
+    { op_Fx65,        op_Fx65_keep },
+    { op_Fx65_xochip, op_Fx65_xochip_keep }
+};
+static const chip8_op draws[CHIP8_VARIANTS][2] = {
+    { op_Dxyn,            op_Dxyn_clip },
+    { op_Dxyn_schip_wrap, op_Dxyn_schip },
+    { op_Dxyn_xochip,     op_Dxyn_xochip_clip }
+};
+
+/* XO-CHIP, skips step over the second word of F000 nnnn too */
+static inline void skip_next(chip8 *c)
+{
+    unsigned short next = c->PC + 2;
+
+    pc_increment(c);
+
+    if (byte_at(c, next, XOCHIP_MASK) == 0xF0 && byte_at(c, next + 1, XOCHIP_MASK) == 0x00) {
+        pc_increment(c);
+    }
+}
+
+#define XOCHIP_SKIP(name, condition)                                   \
+    static void op_##name##_xochip(chip8 *c, const chip8_insn *in)     \
+    {                                                                  \
+        if (condition) {                                               \
+            skip_next(c);                                              \
+        }                                                              \
+    }
+
+XOCHIP_SKIP(3xnn, get_reg_value(c, in->x) == in->nn)
+XOCHIP_SKIP(4xnn, get_reg_value(c, in->x) != in->nn)
+XOCHIP_SKIP(5xy0, get_reg_value(c, in->x) == get_reg_value(c, in->y))
+XOCHIP_SKIP(9xy0, get_reg_value(c, in->x) != get_reg_value(c, in->y))
+XOCHIP_SKIP(Ex9E, get_key_value(c, get_reg_value(c, in->x)))
+XOCHIP_SKIP(ExA1, !get_key_value(c, get_reg_value(c, in->x)))
+
+/* VX to VY inclusive, counting down if x > y, I is left alone */
+static void op_5xy2(chip8 *c, const chip8_insn *in)
+{
+    int step  = in->x <= in->y ? 1 : -1;
+    int count = in->x <= in->y ? in->y - in->x : in->x - in->y;
+
+    for (int i = 0; i <= count; i++) {
+        set_memory_value(c, get_addr(c) + i, get_reg_value(c, in->x + i * step));
+    }
+}
+
+static void op_5xy3(chip8 *c, const chip8_insn *in)
+{
+    int step  = in->x <= in->y ? 1 : -1;
+    int count = in->x <= in->y ? in->y - in->x : in->x - in->y;
+
+    for (int i = 0; i <= count; i++) {
+        set_reg_value(c, in->x + i * step, byte_at(c, get_addr(c) + i, XOCHIP_MASK));
+    }
+}
+
+static void op_F000(chip8 *c, const chip8_insn *in)
+{
+    unsigned short next = c->PC + 2;
+
+    set_addr(c, byte_at(c, next, XOCHIP_MASK) << 8 | byte_at(c, next + 1, XOCHIP_MASK));
+
+    // end_instruction steps past the address word
+    pc_increment(c);
+}
+
+static void op_Fn01(chip8 *c, const chip8_insn *in)
+{
+    c->plane = in->x & 0x3;
+}
+
+static const chip8_op block_enders[] = {
+    op_00FD, op_Bxnn, op_Fx55_keep,
+    op_Dxyn_clip, op_Dxyn_schip, op_Dxyn_schip_wrap, op_Dxyn_xochip, op_Dxyn_xochip_clip,
+    op_3xnn_xochip, op_4xnn_xochip, op_5xy0_xochip, op_9xy0_xochip,
+    op_Ex9E_xochip, op_ExA1_xochip, op_5xy2, op_F000
+};
+
+bool variant_ends_block(chip8_op op)
+{
+    for (size_t i = 0; i < sizeof(block_enders) / sizeof(block_enders[0]); i++) {
+        if (block_enders[i] == op) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Swaps in the handlers of the quirks that are on */
+static void apply_quirks(chip8_variant variant, unsigned int quirks, chip8_insn *in)
+{
+    if (in->op == op_8xy6) {
+        in->op = shifts_right[(quirks & CHIP8_QUIRK_SHIFT) != 0];
+    } else if (in->op == op_8xyE) {
+        in->op = shifts_left[(quirks & CHIP8_QUIRK_SHIFT) != 0];
+    } else if (in->op == op_Bnnn) {
+        in->op = jumps[(quirks & CHIP8_QUIRK_JUMP) != 0];
+    } else if (in->op == op_Fx55) {
+        in->op = stores[(quirks & CHIP8_QUIRK_LOAD_STORE) != 0];
+    } else if (in->op == op_Fx65) {
+        in->op = loads[variant][(quirks & CHIP8_QUIRK_LOAD_STORE) != 0];
+    } else if (in->op == op_Dxyn) {
+        in->op = draws[variant][(quirks & CHIP8_QUIRK_CLIP) != 0];
+    }
+}
+
+void decode_variant_opcode(chip8_variant variant, unsigned int quirks, unsigned short opcode, chip8_insn *in)
+{
+    decode_opcode(opcode, in);
+    apply_quirks(variant, quirks, in);
+
+    if (variant == CHIP8_VARIANT_CHIP8) {
+        return;
+    }
+
+    bool xo = variant == CHIP8_VARIANT_XOCHIP;
+
+    switch (opcode & 0xF000) {
+        case 0x0000: {
+            /* 00Cn - Scroll the display down n pixels */
+            if ((opcode & 0xFFF0) == 0x00C0 && in->n != 0) {
+                in->op = op_00Cn;
+            }
+            /* 00Dn - Scroll the display up n pixels (XO-CHIP) */
+            else if (xo && (opcode & 0xFFF0) == 0x00D0 && in->n != 0) {
+                in->op = op_00Dn;
+            }
+            /* 00E0 - Clear the selected planes */
+            else if (opcode == 0x00E0) {
+                in->op = op_00E0_planes;
+            }
+            /* 00FB - Scroll right 4 pixels, 00FC - Scroll left 4 pixels */
+            else if (opcode == 0x00FB) {
+                in->op = op_00FB;
+            }
+            else if (opcode == 0x00FC) {
+                in->op = op_00FC;
+            }
+            /* 00FD - Exit the interpreter */
+            else if (opcode == 0x00FD) {
+                in->op = op_00FD;
+            }
+            /* 00FE - Lo-res mode, 00FF - Hi-res mode */
+            else if (opcode == 0x00FE) {
+                in->op = xo ? op_00FE_clear : op_00FE;
+            }
+            else if (opcode == 0x00FF) {
+                in->op = xo ? op_00FF_clear : op_00FF;
+            }
+            break;
+        }
+        case 0x3000: {
+            if (xo) {
+                in->op = op_3xnn_xochip;
+            }
+            break;
+        }
+        case 0x4000: {
+            if (xo) {
+                in->op = op_4xnn_xochip;
+            }
+            break;
+        }
+        case 0x5000: {
+            /* 5xy2 - Store VX to VY at I, 5xy3 - Load VX to VY from I (XO-CHIP) */
+            if (xo) {
+                in->op = in->n == 2 ? op_5xy2 : in->n == 3 ? op_5xy3 : op_5xy0_xochip;
+            }
+            break;
+        }
+        case 0x9000: {
+            if (xo) {
+                in->op = op_9xy0_xochip;
+            }
+            break;
+        }
+        case 0xE000: {
+            if (xo && in->op == op_Ex9E) {
+                in->op = op_Ex9E_xochip;
+            } else if (xo && in->op == op_ExA1) {
+                in->op = op_ExA1_xochip;
+            }
+            break;
+        }
+        case 0xF000: {
+            /* F000 nnnn - Load I with the 16-bit address that follows (XO-CHIP) */
+            if (xo && opcode == 0xF000) {
+                in->op = op_F000;
+                break;
+            }
+            /* F002 - Load the audio pattern, Fx3A - Set the pitch (XO-CHIP) */
+            if (xo && (opcode == 0xF002 || in->nn == 0x3A)) {
+                in->op = op_nop;
+                break;
+            }
+
+            switch (in->nn) {
+                /* Fn01 - Select the planes to draw to (XO-CHIP) */
+                case 0x01: in->op = xo ? op_Fn01 : in->op; break;
+                /* Fx30 - Set I to the big digit for the low nibble of VX */
+                case 0x30: in->op = op_Fx30; break;
+                /* Fx75, Fx85 - Save and restore V0 to VX in the flag registers */
+                case 0x75: in->op = op_Fx75; break;
+                case 0x85: in->op = op_Fx85; break;
+            }
+            break;
+        }
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef VARIANT_H
+#define VARIANT_H
+
+#include "chip8.h"
+
+/* Machine profiles
+ *
+ * SUPER-CHIP and XO-CHIP extend the classic instruction set. Every profile
+ * has a decode table of its own, built from the classic decoding with the
+ * handlers that behave differently swapped in, so the classic table only
+ * ever holds the classic handlers and pays nothing for the extensions.
+ *
+ * The extended handlers are instantiated per profile from inline templates
+ * that take the memory size, sprite clipping and skip width as constants.
+ * Both extended machines draw to a 128x64 display, lo-res pixels are 2x2 and
+ * scroll distances are in the pixels of the current mode.
+ *
+ *   schip   00Cn 00FB 00FC scroll down, right and left, 00FD exit (the
+ *           machine stays on it), 00FE 00FF lo-res and hi-res, Dxy0 16x16
+ *           sprites, Fx30 big digits and Fx75 Fx85 flag registers. In hi-res
+ *           VF counts the rows that collided or fell off the bottom. All
+ *           four quirks are on by default.
+ *   xochip  the above with none of the quirks by default, plus 64 KB of
+ *           memory, F000 nnnn loads I with a 16-bit address, 00Dn scrolls
+ *           up, Fn01 selects the planes that 00E0, Dxyn and the scrolls work
+ *           on, 00FE 00FF clear every plane, 5xy2 5xy3 store and load a
+ *           range of registers. Skips step over a whole F000 nnnn. The
+ *           audio pattern instructions F002 and Fx3A are accepted but the
+ *           tone stays the square wave of audio.h.
+ *
+ * The quirks (see chip8_quirk) are resolved the same way: every handler
+ * they touch has an instance per behaviour, and the decode table of a
+ * profile and quirk combination points at the matching ones.
+ */
+
+void         decode_variant_opcode  (chip8_variant variant, unsigned int quirks, unsigned short opcode, chip8_insn *in);
+/* Extended handlers after which a translated block cannot continue */
+bool         variant_ends_block     (chip8_op op);
+const char  *get_variant_name       (chip8_variant variant);
+bool         find_variant           (const char *name, chip8_variant *variant);
+
+#endif
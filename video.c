@@ -0,0 +1,734 @@
+#include <sched.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "video.h"
+
+static void *run_writer    (void *arg);
+static bool  write_header  (chip8_video *v);
+
+bool get_video_format(const char *path, chip8_video_format *format)
+{
+    static const struct {
+        const char        *extension;
+        chip8_video_format format;
+    } extensions[] = {
+        { ".ppm",  CHIP8_VIDEO_PPM  },
+        { ".y4m",  CHIP8_VIDEO_Y4M  },
+        { ".gif",  CHIP8_VIDEO_GIF  },
+        { ".png",  CHIP8_VIDEO_APNG },
+        { ".apng", CHIP8_VIDEO_APNG }
+    };
+
+    const char *dot = strrchr(path, '.');
+
+    for (size_t i = 0; dot != NULL && i < sizeof(extensions) / sizeof(extensions[0]); i++) {
+        if (strcasecmp(dot, extensions[i].extension) == 0) {
+            *format = extensions[i].format;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+chip8_video *open_video(const char *path, chip8_variant variant, unsigned int scale, const chip8_palette *palette)
+{
+    /* the scaler draws indices into the palette rather than colors */
+    static const chip8_palette indices = { "indices", 1, 0, 2, 3 };
+
+    chip8_video_format format;
+
+    if (!get_video_format(path, &format) || scale == 0 || scale > SCALE_MAX) {
+        return NULL;
+    }
+
+    FILE *fp = fopen(path, "wb");
+
+    if (fp == NULL) {
+        return NULL;
+    }
+
+    chip8_video *v = calloc(1, sizeof(chip8_video));
+
+    if (v == NULL) {
+        fprintf(stderr, "unable to allocate video\n");
+        exit(1);
+    }
+
+    if (palette == NULL) {
+        palette = &palettes[0];
+    }
+
+    v->fp     = fp;
+    v->format = format;
+    v->colors = variant == CHIP8_VARIANT_XOCHIP ? 4 : 2;
+    init_scaler(&v->scaler, variant, scale, &indices, 0);
+
+    for (int i = 0; i < 3; i++) {
+        v->color[0][i] = palette->off    >> (16 - i * 8);
+        v->color[1][i] = palette->on     >> (16 - i * 8);
+        v->color[2][i] = palette->second >> (16 - i * 8);
+        v->color[3][i] = palette->both   >> (16 - i * 8);
+    }
+
+    /* three bytes a pixel is the most any format takes, PPM and Y4M */
+    size_t pixels = (size_t) v->scaler.width * v->scaler.height;
+
+    v->picture = calloc(pixels, sizeof(uint32_t));
+    v->buffer  = malloc(pixels * 3 + 4096);
+    v->raw     = malloc(pixels / 4 + v->scaler.height);
+
+    if (v->picture == NULL || v->buffer == NULL || v->raw == NULL) {
+        fprintf(stderr, "unable to allocate video\n");
+        exit(1);
+    }
+
+    atomic_init(&v->head, 0);
+    atomic_init(&v->tail, 0);
+    atomic_init(&v->done, false);
+
+    if (!write_header(v)) {
+        fclose(fp);
+        free_scaler(&v->scaler);
+        free(v->picture);
+        free(v->buffer);
+        free(v->raw);
+        free(v);
+        return NULL;
+    }
+
+    if (pthread_create(&v->writer, NULL, run_writer, v) != 0) {
+        fprintf(stderr, "unable to start the video writer\n");
+        exit(1);
+    }
+
+    return v;
+}
+
+void attach_video(chip8 *c, chip8_video *v)
+{
+    c->video = v;
+
+    push_video_frame(v, c);
+}
+
+void push_video_frame(chip8_video *v, chip8 *c)
+{
+    unsigned int head = atomic_load_explicit(&v->head, memory_order_relaxed);
+
+    /* wait for the writer to free a slot rather than drop a frame */
+    while (head - atomic_load_explicit(&v->tail, memory_order_acquire) == VIDEO_RING_SIZE) {
+        sched_yield();
+    }
+
+    chip8_frame *f = &v->frames[head % VIDEO_RING_SIZE];
+
+    copy_display(f, c);
+    f->number = get_frame(c);
+
+    atomic_store_explicit(&v->head, head + 1, memory_order_release);
+}
+
+/* Output helpers, PNG is big-endian and GIF little-endian */
+static unsigned char *put_u16_le(unsigned char *p, unsigned int v)
+{
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+
+    return p + 2;
+}
+
+static unsigned char *put_u16_be(unsigned char *p, unsigned int v)
+{
+    p[0] = (v >> 8) & 0xFF;
+    p[1] = v & 0xFF;
+
+    return p + 2;
+}
+
+static unsigned char *put_u32_be(unsigned char *p, uint32_t v)
+{
+    p = put_u16_be(p, v >> 16);
+
+    return put_u16_be(p, v & 0xFFFF);
+}
+
+/* Packs codes LSB first, as both GIF and deflate want */
+typedef struct bit_writer_t {
+    unsigned char *p;
+    uint32_t       bits;
+    int            count;
+} bit_writer;
+
+static void put_bits(bit_writer *b, uint32_t value, int count)
+{
+    b->bits  |= value << b->count;
+    b->count += count;
+
+    while (b->count >= 8) {
+        *b->p++    = b->bits & 0xFF;
+        b->bits  >>= 8;
+        b->count  -= 8;
+    }
+}
+
+static void flush_bits(bit_writer *b)
+{
+    if (b->count > 0) {
+        *b->p++ = b->bits & 0xFF;
+    }
+
+    b->bits  = 0;
+    b->count = 0;
+}
+
+/* GIF, LZW over the palette indices with 2-bit literals (the smallest the
+ * format allows) and codes growing up to 12 bits
+ */
+#define GIF_MIN_CODE  2
+#define GIF_CLEAR     (1 << GIF_MIN_CODE)
+#define GIF_END       (GIF_CLEAR + 1)
+
+static size_t encode_lzw(chip8_video *v, const uint32_t *pixels, size_t n, unsigned char *out)
+{
+    bit_writer   b      = { out, 0, 0 };
+    int          size   = GIF_MIN_CODE + 1;
+    unsigned int next   = GIF_END + 1;
+
+    // 0 means no entry, codes below GIF_END + 1 are never added
+    memset(v->lzw, 0, sizeof(v->lzw));
+    put_bits(&b, GIF_CLEAR, size);
+
+    unsigned int prefix = pixels[0];
+
+    for (size_t i = 1; i < n; i++) {
+        unsigned int index = pixels[i];
+
+        if (v->lzw[prefix][index] != 0) {
+            prefix = v->lzw[prefix][index];
+            continue;
+        }
+
+        put_bits(&b, prefix, size);
+
+        if (next < 4096) {
+            if (next == 1u << size) {
+                size++;
+            }
+            v->lzw[prefix][index] = next++;
+        } else {
+            // table full, start over
+            put_bits(&b, GIF_CLEAR, size);
+            memset(v->lzw, 0, sizeof(v->lzw));
+            size = GIF_MIN_CODE + 1;
+            next = GIF_END + 1;
+        }
+
+        prefix = index;
+    }
+
+    put_bits(&b, prefix, size);
+
+    // the decoder adds a string for the last code as well, and widens its
+    // codes first if that fills the current size
+    if (next < 4096 && next == 1u << size) {
+        size++;
+    }
+    put_bits(&b, GIF_END, size);
+    flush_bits(&b);
+
+    return b.p - out;
+}
+
+static void write_gif_frame(chip8_video *v, int top, int height, unsigned long start, unsigned long end)
+{
+    unsigned char header[32];
+    unsigned char *p = header;
+
+    /* centiseconds since the first frame, rounded, so the delays add up
+     * to the right length however they are split
+     */
+    unsigned long from  = ((start - v->first) * 100 + 30) / 60;
+    unsigned long to    = ((end - v->first) * 100 + 30) / 60;
+    unsigned long delay = to - from < 65535 ? to - from : 65535;
+
+    // graphic control: keep the previous frame under this one, delay
+    *p++ = 0x21; *p++ = 0xF9; *p++ = 4;
+    *p++ = 1 << 2;
+    p = put_u16_le(p, delay);
+    *p++ = 0; *p++ = 0;
+
+    // image descriptor: the changed rows, no local color table
+    *p++ = 0x2C;
+    p = put_u16_le(p, 0);
+    p = put_u16_le(p, top);
+    p = put_u16_le(p, v->scaler.width);
+    p = put_u16_le(p, height);
+    *p++ = 0;
+    *p++ = GIF_MIN_CODE;
+
+    fwrite(header, 1, p - header, v->fp);
+
+    const uint32_t *pixels = v->picture + (size_t) top * v->scaler.width;
+    size_t          size   = encode_lzw(v, pixels, (size_t) height * v->scaler.width, v->buffer);
+
+    // data sub-blocks of at most 255 bytes
+    for (size_t i = 0; i < size; i += 255) {
+        size_t length = size - i < 255 ? size - i : 255;
+
+        fputc(length, v->fp);
+        fwrite(v->buffer + i, 1, length, v->fp);
+    }
+    fputc(0, v->fp);
+}
+
+/* PNG, chunks with a CRC-32 and zlib streams of one deflate block with the
+ * fixed codes. The matcher only tries the previous byte and the byte above,
+ * which is all a scaled 1 or 2-bit picture needs.
+ */
+static uint32_t crc32_update(uint32_t crc, const unsigned char *data, size_t size)
+{
+    for (size_t i = 0; i < size; i++) {
+        crc ^= data[i];
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+        }
+    }
+
+    return crc;
+}
+
+static void write_chunk(chip8_video *v, const char *type, const unsigned char *data, size_t size)
+{
+    unsigned char length[4], crc[4];
+    uint32_t      sum = 0xFFFFFFFF;
+
+    sum = crc32_update(sum, (const unsigned char *) type, 4);
+    sum = crc32_update(sum, data, size);
+
+    put_u32_be(length, size);
+    put_u32_be(crc, ~sum);
+
+    fwrite(length, 1, 4, v->fp);
+    fwrite(type, 1, 4, v->fp);
+    fwrite(data, 1, size, v->fp);
+    fwrite(crc, 1, 4, v->fp);
+}
+
+static const unsigned short length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const unsigned char length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const unsigned short distance_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const unsigned char distance_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+/* Huffman codes go out most significant bit first */
+static void put_code(bit_writer *b, unsigned int code, int length)
+{
+    unsigned int reversed = 0;
+
+    for (int i = 0; i < length; i++) {
+        reversed |= ((code >> i) & 1) << (length - 1 - i);
+    }
+
+    put_bits(b, reversed, length);
+}
+
+/* Literal/length symbol in the fixed code */
+static void put_symbol(bit_writer *b, unsigned int symbol)
+{
+    if (symbol < 144) {
+        put_code(b, 0x30 + symbol, 8);
+    } else if (symbol < 256) {
+        put_code(b, 0x190 + symbol - 144, 9);
+    } else if (symbol < 280) {
+        put_code(b, symbol - 256, 7);
+    } else {
+        put_code(b, 0xC0 + symbol - 280, 8);
+    }
+}
+
+static void put_match(bit_writer *b, unsigned int length, unsigned int distance)
+{
+    int i = 28;
+    while (length_base[i] > length) {
+        i--;
+    }
+    put_symbol(b, 257 + i);
+    put_bits(b, length - length_base[i], length_extra[i]);
+
+    int j = 29;
+    while (distance_base[j] > distance) {
+        j--;
+    }
+    put_code(b, j, 5);
+    put_bits(b, distance - distance_base[j], distance_extra[j]);
+}
+
+/* zlib stream of data, rows stride bytes apart */
+static size_t encode_zlib(const unsigned char *data, size_t size, size_t stride, unsigned char *out)
+{
+    bit_writer b = { out + 2, 0, 0 };
+    uint32_t   s1 = 1, s2 = 0;
+
+    out[0] = 0x78;
+    out[1] = 0x01;
+
+    // one final block with the fixed codes
+    put_bits(&b, 1, 1);
+    put_bits(&b, 1, 2);
+
+    for (size_t i = 0; i < size;) {
+        const size_t candidates[2] = { 1, stride };
+        size_t       best = 0, distance = 0;
+
+        for (int k = 0; k < 2; k++) {
+            size_t d = candidates[k], length = 0;
+
+            if (d > i) {
+                continue;
+            }
+            while (length < 258 && i + length < size && data[i + length] == data[i + length - d]) {
+                length++;
+            }
+            if (length > best) {
+                best     = length;
+                distance = d;
+            }
+        }
+
+        if (best >= 3) {
+            put_match(&b, best, distance);
+            i += best;
+        } else {
+            put_symbol(&b, data[i++]);
+        }
+    }
+
+    put_symbol(&b, 256);
+    flush_bits(&b);
+
+    for (size_t i = 0; i < size; i++) {
+        s1 = (s1 + data[i]) % 65521;
+        s2 = (s2 + s1) % 65521;
+    }
+
+    return put_u32_be(b.p, (s2 << 16) | s1) - out;
+}
+
+static void write_apng_frame(chip8_video *v, int top, int height, unsigned long start, unsigned long end)
+{
+    unsigned char  control[26];
+    unsigned char *p     = control;
+    unsigned long  delay = end - start;
+    unsigned int   den   = 60;
+
+    // longer than a 16-bit count of 60ths, round to seconds
+    if (delay > 65535) {
+        delay = (delay + 30) / 60 < 65535 ? (delay + 30) / 60 : 65535;
+        den   = 1;
+    }
+
+    p = put_u32_be(p, v->sequence++);
+    p = put_u32_be(p, v->scaler.width);
+    p = put_u32_be(p, height);
+    p = put_u32_be(p, 0);
+    p = put_u32_be(p, top);
+    p = put_u16_be(p, delay);
+    p = put_u16_be(p, den);
+    // keep the previous frame under this one, replace what it covers
+    *p++ = 0;
+    *p++ = 0;
+
+    write_chunk(v, "fcTL", control, sizeof(control));
+
+    /* one bit a pixel (two with four colors), each row after a filter
+     * byte of 0
+     */
+    unsigned int    depth  = v->colors == 4 ? 2 : 1;
+    size_t          stride = v->scaler.width * depth / 8 + 1;
+    unsigned char  *raw    = v->raw;
+    const uint32_t *pixels = v->picture + (size_t) top * v->scaler.width;
+
+    for (int y = 0; y < height; y++) {
+        *raw++ = 0;
+        for (unsigned int x = 0; x < v->scaler.width; x += 8 / depth) {
+            unsigned char byte = 0;
+            for (unsigned int i = 0; i < 8 / depth; i++) {
+                byte = byte << depth | pixels[x + i];
+            }
+            *raw++ = byte;
+        }
+        pixels += v->scaler.width;
+    }
+
+    // the first frame is the default image, the others carry a sequence number
+    if (v->written == 0) {
+        size_t size = encode_zlib(v->raw, raw - v->raw, stride, v->buffer);
+        write_chunk(v, "IDAT", v->buffer, size);
+    } else {
+        put_u32_be(v->buffer, v->sequence++);
+        size_t size = encode_zlib(v->raw, raw - v->raw, stride, v->buffer + 4);
+        write_chunk(v, "fdAT", v->buffer, size + 4);
+    }
+}
+
+static void write_actl(chip8_video *v, uint32_t frames)
+{
+    unsigned char data[8];
+
+    put_u32_be(data, frames);
+    // loop forever
+    put_u32_be(data + 4, 0);
+
+    write_chunk(v, "acTL", data, sizeof(data));
+}
+
+/* Raw formats, the whole picture for every 60 Hz frame */
+static void write_raw_frames(chip8_video *v, unsigned long count)
+{
+    size_t pixels = (size_t) v->scaler.width * v->scaler.height;
+
+    if (v->format == CHIP8_VIDEO_PPM) {
+        unsigned char *p = v->buffer;
+
+        for (size_t i = 0; i < pixels; i++) {
+            memcpy(p, v->color[v->picture[i]], 3);
+            p += 3;
+        }
+    } else {
+        /* BT.601 studio range, the offsets keep the sums positive */
+        unsigned char yuv[4][3];
+
+        for (int i = 0; i < 4; i++) {
+            int r = v->color[i][0], g = v->color[i][1], b = v->color[i][2];
+
+            yuv[i][0] = (66 * r + 129 * g + 25 * b + 128 + 16 * 256) >> 8;
+            yuv[i][1] = (-38 * r - 74 * g + 112 * b + 128 + 128 * 256) >> 8;
+            yuv[i][2] = (112 * r - 94 * g - 18 * b + 128 + 128 * 256) >> 8;
+        }
+
+        for (int plane = 0; plane < 3; plane++) {
+            unsigned char *p = v->buffer + plane * pixels;
+
+            for (size_t i = 0; i < pixels; i++) {
+                p[i] = yuv[v->picture[i]][plane];
+            }
+        }
+    }
+
+    for (unsigned long i = 0; i < count; i++) {
+        if (v->format == CHIP8_VIDEO_PPM) {
+            fprintf(v->fp, "P6\n%u %u\n255\n", v->scaler.width, v->scaler.height);
+        } else {
+            fputs("FRAME\n", v->fp);
+        }
+        fwrite(v->buffer, 1, pixels * 3, v->fp);
+    }
+}
+
+/* Writes f as shown from frame start until frame end */
+static void write_frame(chip8_video *v, const chip8_frame *f, unsigned long start, unsigned long end)
+{
+    uint64_t changed = compare_frames(f, &v->shown);
+
+    // the first frame is the whole picture
+    if (v->written == 0) {
+        changed = ALL_HIRES_ROWS;
+    }
+
+    // only the rows of the display are drawn, and so count
+    changed = scale_display(&v->scaler, f, changed, v->picture, v->scaler.width * sizeof(uint32_t));
+    v->shown = *f;
+
+    /* the animated formats only store the band of rows that changed */
+    int top    = changed != 0 ? __builtin_ctzll(changed) * v->scaler.scale : 0;
+    int bottom = changed != 0 ? (64 - __builtin_clzll(changed)) * v->scaler.scale : v->scaler.scale;
+
+    switch (v->format) {
+        case CHIP8_VIDEO_PPM:
+        case CHIP8_VIDEO_Y4M:
+            write_raw_frames(v, end - start);
+            break;
+        case CHIP8_VIDEO_GIF:
+            write_gif_frame(v, top, bottom - top, start, end);
+            break;
+        case CHIP8_VIDEO_APNG:
+            write_apng_frame(v, top, bottom - top, start, end);
+            break;
+    }
+
+    v->written++;
+}
+
+static bool write_header(chip8_video *v)
+{
+    unsigned int width  = v->scaler.width;
+    unsigned int height = v->scaler.height;
+
+    switch (v->format) {
+        case CHIP8_VIDEO_PPM:
+            break;
+
+        case CHIP8_VIDEO_Y4M:
+            fprintf(v->fp, "YUV4MPEG2 W%u H%u F60:1 Ip A1:1 C444\n", width, height);
+            break;
+
+        case CHIP8_VIDEO_GIF: {
+            unsigned char header[64];
+            unsigned char *p = header;
+
+            memcpy(p, "GIF89a", 6);
+            p += 6;
+            p = put_u16_le(p, width);
+            p = put_u16_le(p, height);
+            // a global color table of two (or four) entries, background 0
+            *p++ = v->colors == 4 ? 0x81 : 0x80;
+            *p++ = 0;
+            *p++ = 0;
+            memcpy(p, v->color, v->colors * 3);
+            p += v->colors * 3;
+
+            // loop forever
+            memcpy(p, "\x21\xFF\x0BNETSCAPE2.0\x03\x01\x00\x00\x00", 19);
+            p += 19;
+
+            fwrite(header, 1, p - header, v->fp);
+            break;
+        }
+
+        case CHIP8_VIDEO_APNG: {
+            unsigned char ihdr[13];
+            unsigned char *p = ihdr;
+
+            /* the frame count is only known at the end, ftell fails on a pipe */
+            long start = ftell(v->fp);
+            if (start < 0) {
+                return false;
+            }
+            v->count_offset = start + 8 + sizeof(ihdr) + 12;
+
+            fwrite("\x89PNG\r\n\x1A\n", 1, 8, v->fp);
+
+            p = put_u32_be(p, width);
+            p = put_u32_be(p, height);
+            // 1 (or 2) bit palette indices, no interlacing
+            *p++ = v->colors == 4 ? 2 : 1;
+            *p++ = 3;
+            *p++ = 0;
+            *p++ = 0;
+            *p++ = 0;
+            write_chunk(v, "IHDR", ihdr, sizeof(ihdr));
+
+            write_actl(v, 0);
+            write_chunk(v, "PLTE", (const unsigned char *) v->color, v->colors * 3);
+            break;
+        }
+    }
+
+    return !ferror(v->fp);
+}
+
+static void write_trailer(chip8_video *v)
+{
+    if (v->format == CHIP8_VIDEO_GIF) {
+        fputc(0x3B, v->fp);
+    } else if (v->format == CHIP8_VIDEO_APNG) {
+        write_chunk(v, "IEND", NULL, 0);
+
+        if (fseek(v->fp, v->count_offset, SEEK_SET) != 0) {
+            v->failed = true;
+            return;
+        }
+        write_actl(v, v->written);
+    }
+}
+
+/* Frames go out one change late, once it is known how long they showed */
+static void take_frame(chip8_video *v, const chip8_frame *f)
+{
+    if (!v->started) {
+        v->pending = *f;
+        v->first   = f->number;
+        v->started = true;
+        return;
+    }
+
+    // drawn to but the same picture, the pending frame just shows longer
+    if (compare_frames(f, &v->pending) == 0) {
+        return;
+    }
+
+    write_frame(v, &v->pending, v->pending.number, f->number);
+    v->pending = *f;
+}
+
+static void *run_writer(void *arg)
+{
+    chip8_video *v = arg;
+    struct timespec nap = { 0, 1000000 };
+
+    for (;;) {
+        unsigned int tail = atomic_load_explicit(&v->tail, memory_order_relaxed);
+        /* done is read first, a frame pushed before it is then seen too */
+        bool done = atomic_load_explicit(&v->done, memory_order_acquire);
+        unsigned int head = atomic_load_explicit(&v->head, memory_order_acquire);
+
+        if (tail == head) {
+            if (done) {
+                break;
+            }
+            nanosleep(&nap, NULL);
+            continue;
+        }
+
+        take_frame(v, &v->frames[tail % VIDEO_RING_SIZE]);
+
+        /* hand the slot back to the machine */
+        atomic_store_explicit(&v->tail, tail + 1, memory_order_release);
+    }
+
+    if (v->started) {
+        unsigned long end = v->end > v->pending.number ? v->end : v->pending.number + 1;
+
+        write_frame(v, &v->pending, v->pending.number, end);
+    }
+
+    write_trailer(v);
+
+    return NULL;
+}
+
+bool close_video(chip8_video *v, unsigned long end)
+{
+    if (v == NULL) {
+        return true;
+    }
+
+    v->end = end;
+    atomic_store_explicit(&v->done, true, memory_order_release);
+    pthread_join(v->writer, NULL);
+
+    bool ok = !v->failed && !ferror(v->fp);
+    ok = fclose(v->fp) == 0 && ok;
+
+    free_scaler(&v->scaler);
+    free(v->picture);
+    free(v->buffer);
+    free(v->raw);
+    free(v);
+
+    return ok;
+}
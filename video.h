@@ -0,0 +1,101 @@
+#ifndef VIDEO_H
+#define VIDEO_H
+
+#include <pthread.h>
+
+#include "chip8.h"
+#include "frame.h"
+#include "scale.h"
+
+/* Video export
+ *
+ * Once attached, the core hands the display to the video at every 60 Hz
+ * boundary where it was drawn to, stamped with its frame number. Frames
+ * queue up in a ring and a writer thread scales and encodes them and does
+ * all the file I/O. The machine only waits if the writer falls a whole ring
+ * behind, and never drops a frame.
+ *
+ * The format follows the file name:
+ *
+ *   .ppm         P6 images back to back, one per 60 Hz frame
+ *   .y4m         YUV4MPEG2 4:4:4 at 60 fps, one per 60 Hz frame
+ *   .gif         animated GIF
+ *   .png .apng   animated PNG
+ *
+ * A frame identical to the one before it is dropped and the earlier one is
+ * shown for longer, so the animated formats cost nothing while the display
+ * is static and only store the rows that changed. The raw formats repeat
+ * the picture to keep the frame rate constant.
+ *
+ * Every frame is held back until the next one differs (or the video is
+ * closed) since the animated formats store its duration up front.
+ *
+ * The picture is the size of the profile's display, and XO-CHIP videos
+ * have the four colors of its planes.
+ */
+
+#define VIDEO_RING_SIZE  64
+
+typedef enum chip8_video_format_t {
+    CHIP8_VIDEO_PPM = 0,
+    CHIP8_VIDEO_Y4M,
+    CHIP8_VIDEO_GIF,
+    CHIP8_VIDEO_APNG
+} chip8_video_format;
+
+typedef struct chip8_video_t {
+    /* The machine fills frames[head % VIDEO_RING_SIZE], the writer drains from tail */
+    chip8_frame    frames[VIDEO_RING_SIZE];
+    _Alignas(64) atomic_uint head;
+    _Alignas(64) atomic_uint tail;
+    atomic_bool    done;
+    /* Frame the video ends at, set before done */
+    unsigned long  end;
+
+    /* Writer side */
+    pthread_t          writer;
+    FILE              *fp;
+    chip8_video_format format;
+    bool               failed;
+    /* Draws palette indices, 0 off and 1 on (2 and 3 for the second plane),
+     * into picture
+     */
+    chip8_scaler       scaler;
+    uint32_t          *picture;
+    unsigned int       colors;
+    unsigned char      color[4][3];
+    /* Encoded frame, and for APNG the rows before compression */
+    unsigned char     *buffer;
+    unsigned char     *raw;
+    /* GIF string table, the code of each string plus one more index */
+    unsigned short     lzw[4096][4];
+
+    /* Frame waiting for its duration, the last one written and how many
+     * were written
+     */
+    bool               started;
+    chip8_frame        pending;
+    chip8_frame        shown;
+    unsigned long      first;
+    unsigned long      written;
+    /* APNG frame count, patched into the header at the end */
+    long               count_offset;
+    unsigned int       sequence;
+} chip8_video;
+
+/* Starts the writer thread, NULL if the format is unknown or the file can't
+ * be created, or for an animated PNG, can't be seeked (a pipe)
+ */
+chip8_video  *open_video        (const char *path, chip8_variant variant, unsigned int scale, const chip8_palette *palette);
+/* Shows the last frame until frame end, stops the writer and frees the
+ * video, false if a write failed
+ */
+bool          close_video       (chip8_video *v, unsigned long end);
+/* The video starts with the display as it is */
+void          attach_video      (chip8 *c, chip8_video *v);
+bool          get_video_format  (const char *path, chip8_video_format *format);
+
+/* Called by the core at a 60 Hz boundary where the display was drawn to */
+void          push_video_frame  (chip8_video *v, chip8 *c);
+
+#endif